@@ -0,0 +1,237 @@
+#pragma once
+
+#include "messages.h"
+#include "sha256.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+inline std::string hex_from_hash(const BlobHash& hash)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned char b : hash.bytes)
+    {
+        hex.push_back(digits[b >> 4]);
+        hex.push_back(digits[b & 0xf]);
+    }
+    return hex;
+}
+
+inline bool hash_from_hex(const std::string& hex, BlobHash& hash)
+{
+    if (hex.size() != 2 * BLOB_HASH_LEN) return false;
+    for (int i = 0; i < BLOB_HASH_LEN; i++)
+    {
+        unsigned int b;
+        if (sscanf(hex.c_str() + 2 * i, "%2x", &b) != 1) return false;
+        hash.bytes[i] = b;
+    }
+    return true;
+}
+
+inline BlobHash hash_of(const std::string& data)
+{
+    BlobHash hash;
+    sha256(data.data(), data.size(), hash.bytes);
+    return hash;
+}
+
+/*
+    Attachment content, stored once per server as one file per blob named
+    by its SHA-256. References are counted per message that attaches the
+    blob; a blob whose count drops to zero is deleted by the next collect(),
+    unless it is referenced again first. Blobs arrive in BLOB_CHUNK pieces
+    and are verified against their name before they are written.
+*/
+class BlobStore
+{
+public:
+    bool open(const std::string& path)
+    {
+        dir = path;
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        return !ec;
+    }
+
+    bool contains(const BlobHash& hash) const
+    {
+        return std::filesystem::exists(path_of(hash));
+    }
+
+    bool read(const BlobHash& hash, std::string& data) const
+    {
+        std::ifstream in(path_of(hash), std::ios::binary);
+        if (!in) return false;
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    /*
+        Adds one chunk of an incoming blob. Returns true once the last chunk
+        of a blob has been verified and written. Blobs already stored and
+        chunks that do not fit the announced size are ignored.
+    */
+    bool add_chunk(const BlobMessage& chunk)
+    {
+        if (chunk.size > MAX_BLOB_SIZE || chunk.length > BLOB_CHUNK
+            || chunk.offset % BLOB_CHUNK != 0
+            || static_cast<uint64_t>(chunk.offset) + chunk.length > chunk.size)
+            return false;
+        if (contains(chunk.hash))
+        {
+            unreferenced.erase(chunk.hash);
+            return false;
+        }
+
+        Partial& p = partial[chunk.hash];
+        if (p.received.empty())
+        {
+            p.data.resize(chunk.size);
+            p.received.assign(chunks_in(chunk.size), false);
+            p.missing = p.received.size();
+        }
+        if (p.data.size() != chunk.size) return false;
+
+        size_t n = chunk.offset / BLOB_CHUNK;
+        if (n >= p.received.size() || p.received[n]) return false;
+        memcpy(&p.data[chunk.offset], chunk.data, chunk.length);
+        p.received[n] = true;
+        if (--p.missing > 0) return false;
+
+        std::string data = std::move(p.data);
+        partial.erase(chunk.hash);
+        return write(chunk.hash, data);
+    }
+
+    /*
+        Calls `send` with each chunk of a stored blob. Returns false if the
+        blob is not here.
+    */
+    template <typename Func>
+    bool for_each_chunk(const BlobHash& hash, MessageType type, Func send) const
+    {
+        std::string data;
+        if (!read(hash, data)) return false;
+
+        BlobMessage chunk;
+        chunk.type = type;
+        chunk.hash = hash;
+        chunk.size = data.size();
+        for (size_t n = 0; n < chunks_in(data.size()); n++)
+        {
+            chunk.offset = n * BLOB_CHUNK;
+            chunk.length = std::min(data.size() - chunk.offset, size_t(BLOB_CHUNK));
+            memcpy(chunk.data, data.data() + chunk.offset, chunk.length);
+            send(chunk);
+        }
+        return true;
+    }
+
+    void add_ref(const BlobHash& hash)
+    {
+        ++refs[hash];
+        unreferenced.erase(hash);
+    }
+
+    void release(const BlobHash& hash)
+    {
+        auto it = refs.find(hash);
+        if (it == refs.end()) return;
+        if (--it->second == 0)
+        {
+            refs.erase(it);
+            unreferenced.insert(hash);
+        }
+    }
+
+    /*
+        Marks every stored blob nothing references, such as uploads whose
+        mail never arrived, for the next collect().
+    */
+    void find_unreferenced()
+    {
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(dir, ec))
+        {
+            BlobHash hash;
+            if (hash_from_hex(entry.path().filename().string(), hash) && !refs.count(hash))
+                unreferenced.insert(hash);
+        }
+    }
+
+    /*
+        Deletes blobs that are still unreferenced. Returns how many.
+    */
+    int collect()
+    {
+        int removed = 0;
+        for (const auto& hash : unreferenced)
+        {
+            if (refs.count(hash)) continue;
+            std::error_code ec;
+            if (std::filesystem::remove(path_of(hash), ec))
+                ++removed;
+        }
+        unreferenced.clear();
+        return removed;
+    }
+
+    size_t referenced() const { return refs.size(); }
+
+private:
+    struct Partial
+    {
+        std::string data;
+        std::vector<bool> received;
+        size_t missing = 0;
+    };
+
+    static size_t chunks_in(size_t size)
+    {
+        return size == 0 ? 1 : (size + BLOB_CHUNK - 1) / BLOB_CHUNK;
+    }
+
+    std::string path_of(const BlobHash& hash) const
+    {
+        return dir + "/" + hex_from_hash(hash);
+    }
+
+    /*
+        Written under a temporary name, synced and renamed, so a blob file
+        that exists is always complete and survives a crash once mail
+        referring to it is acked.
+    */
+    bool write(const BlobHash& hash, const std::string& data)
+    {
+        if (!(hash_of(data) == hash)) return false;
+
+        std::string tmp = path_of(hash) + ".tmp";
+        FILE * out = fopen(tmp.c_str(), "wb");
+        if (out == nullptr) return false;
+        bool ok = fwrite(data.data(), 1, data.size(), out) == data.size()
+            && fflush(out) == 0 && fsync(fileno(out)) == 0;
+        ok = fclose(out) == 0 && ok;
+        if (!ok) return false;
+
+        std::error_code ec;
+        std::filesystem::rename(tmp, path_of(hash), ec);
+        return !ec;
+    }
+
+    std::string dir;
+    std::map<BlobHash, int> refs;
+    std::set<BlobHash> unreferenced;
+    std::map<BlobHash, Partial> partial;
+};
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <iostream>
 #include <random>
+#include <vector>
 
 #define RESPONSE_TIMEOUT 2
 
@@ -24,11 +25,24 @@ void disconnect();
 void connect_failure_handler(int, void*);
 void leave_current_session();
 void send_email();
-void get_inbox();
+void send_multi_email(const std::vector<std::string>&);
+bool attach_files(AttachmentRef *, int&);
+void upload_blob(const AttachmentRef&, const std::string&);
+void save_attachment(int);
+void receive_attachment(const BlobMessage&);
+bool parse_inbox_filters(const char *, GetInboxMessage&);
+void get_inbox(GetInboxMessage);
+void search_inbox(const char *, int);
 void goodbye();
 void print_menu();
 MessageIdentifier find_id_using_index(int index);
 void read_email(int index);
 void delete_email(int index);
+void mark_all_read();
+void fetch_bodies(const std::vector<int>&);
+void print_bodies(const BodiesMessage&);
 void get_component();
+void get_stats();
+void update_list(const char *, ListOp, const char *);
+void update_folder(FolderOp, const char *, int);
 void handle_timeout(int, void*);
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "client.h"
 #include "messages.h"
+#include "sha256.hpp"
 
 #include <string>
 #include "utils.hpp"
@@ -9,6 +10,11 @@
 #include <list>
 #include <set>
 #include <cstdlib>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <iterator>
+#include <cstddef>
 
 static std::string username;
 //static int uid;
@@ -36,12 +42,20 @@ static int16_t mess_type;
 static membership_info  memb_info;
 static int endian_mismatch;
 
-static std::multiset<InboxHeader> inbox;
+static std::vector<InboxHeader> inbox;
 static bool blocking;
 static int blocking_id;
+static int acks_awaited = 1;    // acks that end the request being blocked on
 static bool listed = false;
 static bool printInbox = false;
 static sp_time timeout = { 2, 0 };
+static std::string last_query;
+static int search_page = 0;
+static std::string current_folder;   // of the last listing; empty is the inbox
+static std::vector<AttachmentRef> read_attachments;   // of the last message read
+static AttachmentRef saving;          // attachment being downloaded
+static std::string saved_data;
+static size_t saved_bytes = 0;
 
 
 int main(int argc, char * argv[])
@@ -104,7 +118,8 @@ void handle_keyboard_in(int, int, void*)
     {
         case 'u':
             ret = sscanf(&command[2], "%s", args);
-            if (ret < 1)
+            // Folders are keyed user/folder on the server
+            if (ret < 1 || strchr(args, FOLDER_SEPARATOR) != nullptr)
             {
                 printf("Invalid username\n");
                 fflush(stdout);
@@ -143,13 +158,24 @@ void handle_keyboard_in(int, int, void*)
                 send_email
             );
             break;
-        case 'l':
+        case 'l': {
+            GetInboxMessage filters;
+            strip_newline(command);
+            if (!parse_inbox_filters(&command[1], filters))
+            {
+                printf("Usage: l [in <folder>] [unread] [from <user>] [since <time>] "
+                    "[until <time>] [newest]\n");
+                fflush(stdout);
+                break;
+            }
             require(
                 connected,
                 "Must be connected to a server to view inbox.",
-                get_inbox
+                get_inbox,
+                filters
             );
             break;
+        }
         case 'd':
             ret = sscanf(&command[2], "%s", args);
             if (ret < 1)
@@ -196,6 +222,133 @@ void handle_keyboard_in(int, int, void*)
                 fflush(stdout);
             }
             break;
+        case 'a':
+            require(
+                listed,
+                "Must list mail first",
+                mark_all_read
+            );
+            break;
+        case 'b': {
+            std::istringstream in(&command[1]);
+            std::vector<int> selection;
+            int index;
+            while (in >> index)
+                selection.push_back(index);
+            require(
+                listed,
+                "Must list mail first",
+                fetch_bodies,
+                selection
+            );
+            break;
+        }
+        case 's':
+            strip_newline(command);
+            if (strlen(command) < 3)
+            {
+                printf("Usage: s <search terms>\n");
+                fflush(stdout);
+                break;
+            }
+            require(
+                connected,
+                "Must be connected to a server to search.",
+                search_inbox,
+                &command[2],
+                0
+            );
+            break;
+        case 'n':
+            require(
+                connected && !last_query.empty(),
+                "Must search before paging through results.",
+                search_inbox,
+                last_query.c_str(),
+                search_page + 1
+            );
+            break;
+        case 'g': {
+            char list[100] = {0};
+            char op[100] = {0};
+            ret = sscanf(&command[2], "%99s %99s %99s", list, op, args);
+            if (ret < 3 || (strcmp(op, "add") != 0 && strcmp(op, "remove") != 0)
+                || strlen(list) >= MAX_USERNAME || strlen(args) >= MAX_USERNAME)
+            {
+                printf("Usage: g <%clist> add|remove <user>\n", LIST_PREFIX);
+                fflush(stdout);
+                break;
+            }
+            require(
+                connected,
+                "Must be connected to a server to change lists.",
+                update_list,
+                list,
+                strcmp(op, "add") == 0 ? ListOp::ADD_MEMBER : ListOp::REMOVE_MEMBER,
+                args
+            );
+            break;
+        }
+        case 'f':
+            ret = sscanf(&command[2], "%99s", args);
+            if (ret < 1 || strlen(args) >= MAX_FOLDER)
+            {
+                printf("Usage: f <folder>\n");
+                fflush(stdout);
+                break;
+            }
+            require(
+                connected,
+                "Must be connected to a server to create folders.",
+                update_folder,
+                FolderOp::CREATE_FOLDER,
+                args,
+                -1
+            );
+            break;
+        case 'o': {
+            int index;
+            ret = sscanf(&command[2], "%d %99s", &index, args);
+            if (ret < 2 || strlen(args) >= MAX_FOLDER)
+            {
+                printf("Usage: o <i> <folder>\n");
+                fflush(stdout);
+                break;
+            }
+            require(
+                listed,
+                "Must list mail first",
+                update_folder,
+                FolderOp::MOVE_TO_FOLDER,
+                args,
+                index
+            );
+            break;
+        }
+        case 'w': {
+            int index;
+            ret = sscanf(&command[2], "%d", &index);
+            if (ret < 1)
+            {
+                printf("Usage: w <n>\n");
+                fflush(stdout);
+                break;
+            }
+            require(
+                connected && !read_attachments.empty(),
+                "Must read a message with attachments first.",
+                save_attachment,
+                index
+            );
+            break;
+        }
+        case 'i':
+            require(
+                connected,
+                "Must be connected to a server to view mailbox stats.",
+                get_stats
+            );
+            break;
         case 'v':
             require(
                 connected,
@@ -290,6 +443,14 @@ void process_server_response(int16_t mess_type, const char * mess)
         E_dequeue(handle_timeout, 0, nullptr);
         const ServerResponse * resp = reinterpret_cast<const ServerResponse*>(mess);
         AckMessage ack = std::get<AckMessage>(resp->data);
+        // A request sent in several messages is done at its last ack
+        if (--acks_awaited > 0)
+        {
+            printf("%s\n", ack.body);
+            E_queue(handle_timeout, 0, nullptr, timeout);
+            return;
+        }
+        acks_awaited = 1;
         if (printInbox) {
             printf("\n");
             int indx = 1;
@@ -297,7 +458,7 @@ void process_server_response(int16_t mess_type, const char * mess)
                 printf(std::to_string(indx).c_str());
 
                 printf(". from: %s subject: %s read: %s timestamp: %s\n", i.sender, i.subject, 
-                    i.read ? "true" : "false", std::to_string(i.timestamp).c_str());
+                    (i.flags & MAIL_READ) ? "true" : "false", std::to_string(i.timestamp).c_str());
                 indx++;
             }
             printInbox = false;
@@ -311,7 +472,7 @@ void process_server_response(int16_t mess_type, const char * mess)
     {
         const ServerInboxResponse* resp = reinterpret_cast<const ServerInboxResponse*>(mess);
         for (int i = 0; i < resp->mail_count; i++) {
-            inbox.insert(resp->inbox[i]);
+            inbox.push_back(resp->inbox[i]);
         }
         printInbox = true;
         listed = true;
@@ -320,8 +481,30 @@ void process_server_response(int16_t mess_type, const char * mess)
         const ServerResponse * resp = reinterpret_cast<const ServerResponse*>(mess);
         InboxMessage msg = std::get<InboxMessage>(resp->data);
         printf("\nFrom: %s\n Subject: %s\n%s\n", msg.msg.from, msg.msg.subject, msg.msg.message);
+        int n = std::min(std::max(msg.msg.n_attachments, 0), MAX_ATTACHMENTS);
+        read_attachments.assign(msg.msg.attachments, msg.msg.attachments + n);
+        for (int i = 0; i < n; i++) {
+            printf(" [%d] %s (%u bytes)\n", i + 1, msg.msg.attachments[i].name,
+                msg.msg.attachments[i].size);
+        }
         fflush(stdout);
     } 
+    else if (mess_type == MessageType::BODIES) {
+        print_bodies(*reinterpret_cast<const BodiesMessage*>(mess));
+    }
+    else if (mess_type == MessageType::BLOB) {
+        receive_attachment(*reinterpret_cast<const BlobMessage*>(mess));
+    }
+    else if (mess_type == MessageType::STATS) {
+        const ServerResponse * resp = reinterpret_cast<const ServerResponse*>(mess);
+        StatsMessage stats = std::get<StatsMessage>(resp->data);
+        printf("\n%d messages, %d unread, %ld bytes\n", stats.total, stats.unread, stats.bytes);
+        if (stats.quota_messages != 0 || stats.quota_bytes != 0) {
+            printf("Quota: %d messages, %ld bytes (0 = unlimited)\n", 
+                stats.quota_messages, stats.quota_bytes);
+        }
+        fflush(stdout);
+    }
     else if (mess_type == MessageType::COMPONENT) {
         const ServerResponse * resp = reinterpret_cast<const ServerResponse*>(mess);
         ComponentMessage msg = std::get<ComponentMessage>(resp->data);
@@ -413,18 +596,43 @@ void disconnect()
     leave_current_session();
 
     connected = false;
+    acks_awaited = 1;
 }
 
 void send_email()
 {
-    printf("To: ");
-    MailMessage msg;
-    if (fgets(msg.to, MAX_USERNAME, stdin) == NULL)
+    printf("To (separate several with commas): ");
+    char to_line[MAX_RECIPIENTS * MAX_USERNAME];
+    if (fgets(to_line, sizeof(to_line), stdin) == NULL)
     {
         printf("Invalid send address\n");
         return;
     }
-    strip_newline(msg.to);
+    strip_newline(to_line);
+
+    std::vector<std::string> recipients;
+    for (char * name = strtok(to_line, ", "); name != nullptr; name = strtok(nullptr, ", "))
+    {
+        if (strlen(name) >= MAX_USERNAME)
+        {
+            printf("Invalid send address %s\n", name);
+            return;
+        }
+        recipients.push_back(name);
+    }
+    if (recipients.empty() || recipients.size() > MAX_RECIPIENTS)
+    {
+        printf("Mail needs between 1 and %d recipients\n", MAX_RECIPIENTS);
+        return;
+    }
+    if (recipients.size() > 1)
+    {
+        send_multi_email(recipients);
+        return;
+    }
+
+    MailMessage msg;
+    strcpy(msg.to, recipients[0].c_str());
     printf("Subject: ");
     if (fgets(msg.subject, MAX_SUBJECT, stdin) == NULL)
     {
@@ -439,6 +647,8 @@ void send_email()
         return;
     }
     strip_newline(msg.message);
+    if (!attach_files(msg.attachments, msg.n_attachments))
+        return;
     msg.seq_num = seq_num++;
     msg.session_id = session_id;
     strcpy(msg.username, username.c_str());
@@ -452,6 +662,167 @@ void send_email()
     );
 }
 
+/*
+    Sends one copy of a message to several recipients; the server stores and
+    replicates it once.
+*/
+void send_multi_email(const std::vector<std::string>& recipients)
+{
+    MultiMailMessage msg;
+    msg.n_recipients = recipients.size();
+    for (size_t i = 0; i < recipients.size(); i++)
+    {
+        strcpy(msg.to[i], recipients[i].c_str());
+    }
+    printf("Subject: ");
+    if (fgets(msg.subject, MAX_SUBJECT, stdin) == NULL)
+    {
+        printf("Invalid subject\n");
+        return;
+    }
+    strip_newline(msg.subject);
+    printf("Message: ");
+    if (fgets(msg.message, EMAIL_LEN, stdin) == NULL)
+    {
+        printf("Invalid message body\n");
+        return;
+    }
+    strip_newline(msg.message);
+    if (!attach_files(msg.attachments, msg.n_attachments))
+        return;
+    msg.seq_num = seq_num++;
+    msg.session_id = session_id;
+    strcpy(msg.username, username.c_str());
+
+    SP_multicast(mbox, AGREED_MESS, 
+        connected_server_inbox.c_str(), 
+        MessageType::MULTI_MAIL,
+        sizeof(msg),
+        reinterpret_cast<const char*>(&msg)
+    );
+}
+
+/*
+    Prompts for files to attach and uploads each before the mail, which
+    then references them by hash. The server stores a blob it already has
+    only once.
+*/
+bool attach_files(AttachmentRef * refs, int& n)
+{
+    printf("Attachments (paths separated by spaces, empty for none): ");
+    char line[1000];
+    if (fgets(line, sizeof(line), stdin) == NULL)
+        return false;
+    strip_newline(line);
+
+    n = 0;
+    for (char * path = strtok(line, " "); path != nullptr; path = strtok(nullptr, " "))
+    {
+        if (n == MAX_ATTACHMENTS)
+        {
+            printf("At most %d attachments\n", MAX_ATTACHMENTS);
+            return false;
+        }
+        std::ifstream in(path, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (!in.good() && !in.eof())
+        {
+            printf("Could not read %s\n", path);
+            return false;
+        }
+        if (data.size() > MAX_BLOB_SIZE)
+        {
+            printf("%s is larger than %d bytes\n", path, MAX_BLOB_SIZE);
+            return false;
+        }
+
+        AttachmentRef& ref = refs[n++];
+        memset(&ref, 0, sizeof(ref));
+        sha256(data.data(), data.size(), ref.hash.bytes);
+        ref.size = data.size();
+        const char * name = strrchr(path, '/');
+        strncpy(ref.name, name ? name + 1 : path, MAX_ATTACHMENT_NAME - 1);
+        upload_blob(ref, data);
+    }
+    return true;
+}
+
+void upload_blob(const AttachmentRef& ref, const std::string& data)
+{
+    BlobMessage chunk;
+    chunk.session_id = session_id;
+    chunk.hash = ref.hash;
+    chunk.size = data.size();
+    size_t offset = 0;
+    do {
+        chunk.offset = offset;
+        chunk.length = std::min(data.size() - offset, size_t(BLOB_CHUNK));
+        memcpy(chunk.data, data.data() + offset, chunk.length);
+        SP_multicast(mbox, AGREED_MESS,
+            connected_server_inbox.c_str(),
+            MessageType::PUT_BLOB,
+            offsetof(BlobMessage, data) + chunk.length,
+            reinterpret_cast<const char*>(&chunk)
+        );
+        offset += chunk.length;
+    } while (offset < data.size());
+}
+
+/*
+    Downloads the nth attachment of the last message read into the current
+    directory.
+*/
+void save_attachment(int index) {
+    if (index < 1 || index > static_cast<int>(read_attachments.size())) {
+        printf("invalid selection\n");
+        return;
+    }
+    saving = read_attachments[index - 1];
+    saving.name[MAX_ATTACHMENT_NAME - 1] = '\0';
+    if (strchr(saving.name, '/') || strcmp(saving.name, "..") == 0 || saving.name[0] == '\0') {
+        printf("invalid attachment name\n");
+        return;
+    }
+    saved_data.assign(saving.size, '\0');
+    saved_bytes = 0;
+
+    BlobRequestMessage msg;
+    msg.session_id = session_id;
+    msg.hash = saving.hash;
+    msg.holder = -1;
+    SP_multicast(mbox, AGREED_MESS,
+        connected_server_inbox.c_str(),
+        MessageType::GET_BLOB,
+        sizeof(msg),
+        reinterpret_cast<const char*>(&msg)
+    );
+
+    blocking = true;
+    timeout.sec = RESPONSE_TIMEOUT;
+    timeout.usec = 0;
+    E_queue(handle_timeout, 0, nullptr, timeout);
+}
+
+void receive_attachment(const BlobMessage& chunk) {
+    if (!(chunk.hash == saving.hash) || chunk.size != saved_data.size()
+        || static_cast<uint64_t>(chunk.offset) + chunk.length > saved_data.size())
+        return;
+    memcpy(&saved_data[chunk.offset], chunk.data, chunk.length);
+    saved_bytes += chunk.length;
+    if (saved_bytes < saved_data.size()) return;
+
+    BlobHash hash;
+    sha256(saved_data.data(), saved_data.size(), hash.bytes);
+    if (!(hash == saving.hash)) {
+        printf("\nattachment %s is corrupt\n", saving.name);
+        return;
+    }
+    std::ofstream out(saving.name, std::ios::binary | std::ios::trunc);
+    out.write(saved_data.data(), saved_data.size());
+    printf("\nsaved %s\n", saving.name);
+    fflush(stdout);
+}
+
 void handle_timeout(int, void*)
 {
     disconnect();
@@ -460,12 +831,53 @@ void handle_timeout(int, void*)
     fflush(stdout);
 }
 
-void get_inbox()
+/*
+    Parses the optional arguments of the list command into the filter fields
+    of a SHOW_INBOX request. Times are seconds since the epoch.
+*/
+bool parse_inbox_filters(const char * args, GetInboxMessage& msg)
+{
+    std::istringstream in(args);
+    std::string word;
+    while (in >> word) {
+        if (word == "unread") {
+            msg.filters |= FILTER_UNREAD;
+        }
+        else if (word == "newest") {
+            msg.order = SortOrder::NEWEST_FIRST;
+        }
+        else if (word == "in") {
+            std::string folder;
+            if (!(in >> folder) || folder.size() >= MAX_FOLDER) return false;
+            strcpy(msg.folder, folder.c_str());
+        }
+        else if (word == "from") {
+            std::string sender;
+            if (!(in >> sender) || sender.size() >= MAX_USERNAME) return false;
+            strcpy(msg.sender, sender.c_str());
+            msg.filters |= FILTER_SENDER;
+        }
+        else if (word == "since") {
+            if (!(in >> msg.since)) return false;
+            msg.filters |= FILTER_SINCE;
+        }
+        else if (word == "until") {
+            if (!(in >> msg.until)) return false;
+            msg.filters |= FILTER_UNTIL;
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+void get_inbox(GetInboxMessage msg)
 {
-    GetInboxMessage msg;
     msg.seq_num = seq_num++;
     msg.session_id = session_id;
     strcpy(msg.username, username.c_str());
+    current_folder = msg.folder;
 
     SP_multicast(mbox, AGREED_MESS,
         connected_server_inbox.c_str(),
@@ -528,6 +940,233 @@ void read_email(int index) {
     E_queue(handle_timeout, 0, nullptr, timeout);
 }
 
+/*
+    Reads the selected listed messages, or all of them, in one request.
+    The server marks them read.
+*/
+void fetch_bodies(const std::vector<int>& selection) {
+    FetchBodiesMessage msg;
+    msg.seq_num = seq_num++;
+    msg.session_id = session_id;
+    strcpy(msg.username, username.c_str());
+    msg.mark_read = true;
+    msg.count = 0;
+
+    if (selection.empty()) {
+        for (const auto & i: inbox) {
+            if (msg.count == MAX_FETCH_BATCH) break;
+            msg.ids[msg.count++] = i.id;
+        }
+    }
+    for (int index : selection) {
+        if (index < 1 || index > static_cast<int>(inbox.size())) {
+            printf("invalid selection\n");
+            return;
+        }
+        if (msg.count == MAX_FETCH_BATCH) break;
+        msg.ids[msg.count++] = inbox[index - 1].id;
+    }
+    if (msg.count == 0) {
+        printf("No messages listed\n");
+        return;
+    }
+
+    SP_multicast(mbox, AGREED_MESS,
+        connected_server_inbox.c_str(),
+        MessageType::FETCH_BODIES,
+        sizeof(msg),
+        reinterpret_cast<const char*>(&msg)
+    );
+
+    blocking = true;
+    timeout.sec = RESPONSE_TIMEOUT;
+    timeout.usec = 0;
+    E_queue(handle_timeout, 0, nullptr, timeout);
+}
+
+void print_bodies(const BodiesMessage& res) {
+    const char * in = res.data;
+    const char * end = res.data + std::min<uint32_t>(res.used, BODIES_PAYLOAD);
+    for (int i = 0; i < res.count; i++) {
+        PackedBody packed;
+        if (in + sizeof(packed) > end) break;
+        memcpy(&packed, in, sizeof(packed));
+        in += sizeof(packed);
+        size_t text = packed.from_len + packed.subject_len + packed.message_len;
+        size_t refs = packed.n_attachments * sizeof(AttachmentRef);
+        if (in + text + refs > end) break;
+
+        std::string from(in, packed.from_len);
+        in += packed.from_len;
+        std::string subject(in, packed.subject_len);
+        in += packed.subject_len;
+        std::string message(in, packed.message_len);
+        in += packed.message_len;
+        printf("\nFrom: %s\n Subject: %s\n%s\n", from.c_str(), subject.c_str(), message.c_str());
+        for (int a = 0; a < packed.n_attachments; a++) {
+            AttachmentRef ref;
+            memcpy(&ref, in, sizeof(ref));
+            in += sizeof(ref);
+            printf(" attachment: %.*s (%u bytes)\n", MAX_ATTACHMENT_NAME, ref.name, ref.size);
+        }
+    }
+    if (res.missing > 0)
+        printf("%d messages no longer exist\n", res.missing);
+    fflush(stdout);
+}
+
+/*
+    Marks every listed unread message as read, sending one batched flag
+    update per MAX_FLAG_BATCH messages.
+*/
+void mark_all_read() {
+
+    FlagMessage msg;
+    msg.session_id = session_id;
+    strcpy(msg.username, username.c_str());
+    msg.set = MAIL_READ;
+    msg.clear = 0;
+    msg.count = 0;
+
+    int sent = 0;
+    for (const auto & i: inbox) {
+        if (i.flags & MAIL_READ) continue;
+        msg.ids[msg.count++] = i.id;
+        if (msg.count == MAX_FLAG_BATCH) {
+            msg.seq_num = seq_num++;
+            SP_multicast(mbox, AGREED_MESS, 
+                connected_server_inbox.c_str(), 
+                MessageType::FLAG,
+                sizeof(msg),
+                reinterpret_cast<const char*>(&msg)
+            );
+            ++sent;
+            msg.count = 0;
+        }
+    }
+    if (msg.count > 0) {
+        msg.seq_num = seq_num++;
+        SP_multicast(mbox, AGREED_MESS, 
+            connected_server_inbox.c_str(), 
+            MessageType::FLAG,
+            sizeof(msg),
+            reinterpret_cast<const char*>(&msg)
+        );
+        ++sent;
+    }
+    if (sent == 0) {
+        printf("No unread messages\n");
+        return;
+    }
+
+    // Each FLAG message is acked on its own
+    acks_awaited = sent;
+    blocking = true;
+    timeout.sec = RESPONSE_TIMEOUT;
+    timeout.usec = 0;
+    E_queue(handle_timeout, 0, nullptr, timeout);
+}
+
+void search_inbox(const char * query, int page) {
+    SearchMessage msg;
+    msg.seq_num = seq_num++;
+    msg.session_id = session_id;
+    msg.page = page;
+    strcpy(msg.username, username.c_str());
+    strcpy(msg.folder, current_folder.c_str());
+    strncpy(msg.query, query, MAX_SUBJECT - 1);
+    msg.query[MAX_SUBJECT - 1] = '\0';
+
+    last_query = msg.query;
+    search_page = page;
+
+    SP_multicast(mbox, AGREED_MESS,
+        connected_server_inbox.c_str(),
+        MessageType::SEARCH,
+        sizeof(msg),
+        reinterpret_cast<const char*>(&msg)
+    );
+
+    inbox.clear();
+
+    blocking = true;
+    timeout.sec = RESPONSE_TIMEOUT;
+    timeout.usec = 0;
+    E_queue(handle_timeout, 0, nullptr, timeout);
+    listed = true;
+}
+
+void update_list(const char * list, ListOp op, const char * member) {
+    ListMessage msg;
+    msg.seq_num = seq_num++;
+    msg.session_id = session_id;
+    strcpy(msg.username, username.c_str());
+    strcpy(msg.list, list);
+    strcpy(msg.member, member);
+    msg.op = op;
+    SP_multicast(mbox, AGREED_MESS,
+        connected_server_inbox.c_str(),
+        MessageType::LIST_UPDATE,
+        sizeof(msg),
+        reinterpret_cast<const char*>(&msg)
+    );
+
+    blocking = true;
+    timeout.sec = RESPONSE_TIMEOUT;
+    timeout.usec = 0;
+    E_queue(handle_timeout, 0, nullptr, timeout);
+}
+
+/*
+    Creates `folder`, or moves the ith listed message into it.
+*/
+void update_folder(FolderOp op, const char * folder, int index) {
+    FolderMessage msg;
+    msg.seq_num = seq_num++;
+    msg.session_id = session_id;
+    strcpy(msg.username, username.c_str());
+    strcpy(msg.folder, folder);
+    msg.op = op;
+    msg.count = 0;
+    if (op == FolderOp::MOVE_TO_FOLDER) {
+        if (index < 1 || index > static_cast<int>(inbox.size())) {
+            printf("invalid selection\n");
+            return;
+        }
+        msg.ids[msg.count++] = find_id_using_index(index - 1);
+    }
+    SP_multicast(mbox, AGREED_MESS,
+        connected_server_inbox.c_str(),
+        MessageType::FOLDER,
+        sizeof(msg),
+        reinterpret_cast<const char*>(&msg)
+    );
+
+    blocking = true;
+    timeout.sec = RESPONSE_TIMEOUT;
+    timeout.usec = 0;
+    E_queue(handle_timeout, 0, nullptr, timeout);
+}
+
+void get_stats() {
+    GetStatsMessage msg;
+    msg.seq_num = seq_num++;
+    msg.session_id = session_id;
+    strcpy(msg.username, username.c_str());
+    strcpy(msg.folder, current_folder.c_str());
+    SP_multicast(mbox, AGREED_MESS,
+        connected_server_inbox.c_str(),
+        MessageType::MAILBOX_STATS,
+        sizeof(msg),
+        reinterpret_cast<const char*>(&msg)
+    );
+
+    blocking = true;
+    timeout.sec = RESPONSE_TIMEOUT;
+    timeout.usec = 0;
+    E_queue(handle_timeout, 0, nullptr, timeout);
+}
+
 void get_component() {
     GetComponentMessage msg;
     msg.session_id = session_id;
@@ -577,9 +1216,19 @@ void print_menu()
 	printf("\tc <server number> -- connect to server <server number>\n");
 	printf("\n");
 	printf("\tm -- send an email\n");
-    printf("\tl -- show current user's inbox\n");
+    printf("\tl [in <folder>] [unread] [from <user>] [since <time>] [until <time>] [newest]"
+        " -- show a folder, the inbox by default\n");
 	printf("\tr <i> -- mark the ith message in the inbox as read\n");
 	printf("\td <i> -- delete the ith message in the inbox \n");
+	printf("\ta -- mark all listed messages as read\n");
+	printf("\tb [<i> ...] -- read the selected listed messages, or all of them\n");
+	printf("\ts <terms> -- search the current user's mail\n");
+	printf("\tn -- show the next page of search results\n");
+	printf("\tg <%clist> add|remove <user> -- change a distribution list\n", LIST_PREFIX);
+	printf("\tf <folder> -- create a folder\n");
+	printf("\to <i> <folder> -- move the ith listed message to a folder\n");
+	printf("\tw <n> -- save the nth attachment of the last message read\n");
+	printf("\ti -- show message counts and quota for the listed folder\n");
 	printf("\tv -- show servers in current component\n");
 	printf("\th -- help menu \n");
 	printf("\n");
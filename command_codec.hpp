@@ -0,0 +1,213 @@
+#pragma once
+
+#include "messages.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <variant>
+
+/*
+    Wire and log encoding of a UserCommand, all integers in host byte
+    order:
+
+        CommandHeader
+        the fields of the active alternative only
+
+    Fixed fields are copied as laid out in memory; text is a length and its
+    characters, and batches of ids, recipients or attachments carry only
+    their used entries. A command that takes most of sizeof(UserCommand)
+    in memory is a few hundred bytes encoded.
+*/
+
+struct CommandHeader
+{
+    int32_t index;
+    int32_t origin;
+    int64_t timestamp;
+    uint32_t kind;      // index of the alternative in UserCommand::data
+    uint32_t length;    // bytes of fields that follow
+};
+
+class CommandEncoder
+{
+public:
+    explicit CommandEncoder(std::string& out) : out(out) {}
+
+    bool bytes(const void * data, size_t len)
+    {
+        out.append(static_cast<const char *>(data), len);
+        return true;
+    }
+
+    template <typename T>
+    bool value(const T& v) { return bytes(&v, sizeof(v)); }
+
+    bool text(const char * s, size_t max)
+    {
+        uint32_t len = strnlen(s, max - 1);
+        return value(len) && bytes(s, len);
+    }
+
+    // The first `count` entries, as the decoder will clamp it
+    template <typename T>
+    bool array(const T * entries, int count, int max)
+    {
+        return bytes(entries, std::min(std::max(count, 0), max) * sizeof(T));
+    }
+
+private:
+    std::string& out;
+};
+
+/*
+    Reads fields back into a zeroed alternative. Every read is checked
+    against the bytes left, so a short or corrupted encoding fails instead
+    of reading past it.
+*/
+class CommandDecoder
+{
+public:
+    CommandDecoder(const char * data, size_t len) : p(data), end(data + len) {}
+
+    bool bytes(void * data, size_t len)
+    {
+        if (static_cast<size_t>(end - p) < len) return false;
+        memcpy(data, p, len);
+        p += len;
+        return true;
+    }
+
+    template <typename T>
+    bool value(T& v) { return bytes(&v, sizeof(v)); }
+
+    bool text(char * s, size_t max)
+    {
+        uint32_t len;
+        if (!value(len) || len >= max) return false;
+        s[len] = '\0';
+        return bytes(s, len);
+    }
+
+    template <typename T>
+    bool array(T * entries, int count, int max)
+    {
+        return bytes(entries, std::min(std::max(count, 0), max) * sizeof(T));
+    }
+
+    bool done() const { return p == end; }
+
+private:
+    const char * p;
+    const char * end;
+};
+
+/*
+    The fields of each alternative, in order, for either direction. A count
+    precedes the batch it sizes.
+*/
+template <typename Codec, typename M>
+bool code_prefix_and_body(Codec& c, M& m, size_t prefix)
+{
+    return c.bytes(&m, prefix) && c.text(m.subject, MAX_SUBJECT)
+        && c.text(m.message, EMAIL_LEN) && c.value(m.n_attachments)
+        && c.array(m.attachments, m.n_attachments, MAX_ATTACHMENTS);
+}
+
+template <typename Codec>
+bool code_fields(Codec& c, MailMessage& m)
+{
+    return code_prefix_and_body(c, m, offsetof(MailMessage, subject));
+}
+
+template <typename Codec>
+bool code_fields(Codec& c, MultiMailMessage& m)
+{
+    return c.bytes(&m, offsetof(MultiMailMessage, to))
+        && c.array(m.to, m.n_recipients, MAX_RECIPIENTS)
+        && code_prefix_and_body(c, m, 0);
+}
+
+template <typename Codec>
+bool code_fields(Codec& c, FlagMessage& m)
+{
+    return c.bytes(&m, offsetof(FlagMessage, ids)) && c.array(m.ids, m.count, MAX_FLAG_BATCH);
+}
+
+template <typename Codec>
+bool code_fields(Codec& c, FolderMessage& m)
+{
+    return c.bytes(&m, offsetof(FolderMessage, ids)) && c.array(m.ids, m.count, MAX_FLAG_BATCH);
+}
+
+template <typename Codec>
+bool code_fields(Codec& c, ExpireMessage& m)
+{
+    return c.bytes(&m, offsetof(ExpireMessage, ids))
+        && c.array(m.ids, m.count, MAX_EXPIRE_BATCH);
+}
+
+// Alternatives with no batches are copied whole
+template <typename Codec, typename M>
+bool code_fields(Codec& c, M& m)
+{
+    return c.bytes(&m, sizeof(m));
+}
+
+/*
+    Appends the encoding of `command` to `out`.
+*/
+inline void encode_command(const UserCommand& command, std::string& out)
+{
+    size_t start = out.size();
+    CommandHeader header{command.id.index, command.id.origin,
+        static_cast<int64_t>(command.timestamp),
+        static_cast<uint32_t>(command.data.index()), 0};
+    out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    CommandEncoder encoder(out);
+    std::visit([&encoder](const auto& m) {
+        // The encoder only reads, through the same field list as decoding
+        code_fields(encoder, const_cast<std::remove_const_t<
+            std::remove_reference_t<decltype(m)>>&>(m));
+    }, command.data);
+
+    header.length = out.size() - start - sizeof(header);
+    memcpy(&out[start], &header, sizeof(header));
+}
+
+template <size_t I = 0>
+bool decode_alternative(UserCommand& command, uint32_t kind, CommandDecoder& decoder)
+{
+    using Data = decltype(UserCommand::data);
+    if constexpr (I < std::variant_size_v<Data>)
+    {
+        if (kind != I) return decode_alternative<I + 1>(command, kind, decoder);
+        return code_fields(decoder, command.data.template emplace<I>());
+    }
+    else
+    {
+        return false;
+    }
+}
+
+/*
+    Decodes one command of exactly `len` bytes. Returns false if it is not
+    a well formed encoding.
+*/
+inline bool decode_command(const char * data, size_t len, UserCommand& command)
+{
+    CommandHeader header;
+    if (len < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (header.length != len - sizeof(header)) return false;
+
+    command.id.index = header.index;
+    command.id.origin = header.origin;
+    command.timestamp = static_cast<time_t>(header.timestamp);
+    CommandDecoder decoder(data + sizeof(header), header.length);
+    return decode_alternative(command, header.kind, decoder) && decoder.done();
+}
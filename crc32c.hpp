@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define CRC32C_POLY 0x82f63b78      // Castagnoli, reflected
+
+/*
+    Table driven CRC-32C, one byte per step. Works on any CPU; crc32c()
+    uses it where the CRC instruction is not available.
+*/
+inline uint32_t crc32c_portable(uint32_t crc, const void * data, size_t len)
+{
+    struct Table
+    {
+        uint32_t entries[256];
+
+        Table()
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+                entries[i] = c;
+            }
+        }
+    };
+    static const Table table;
+
+    const unsigned char * p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+        crc = table.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+
+/*
+    CRC-32C with the SSE4.2 crc32 instruction, eight bytes per step.
+*/
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_sse42(uint32_t crc, const void * data, size_t len)
+{
+    const unsigned char * p = static_cast<const unsigned char *>(data);
+    uint64_t c = ~crc;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = __builtin_ia32_crc32di(c, word);
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    for (; len > 0; p++, len--)
+        c32 = __builtin_ia32_crc32qi(c32, *p);
+    return ~c32;
+}
+
+#endif
+
+/*
+    CRC-32C of `len` bytes, continuing from `crc`; start with 0. Uses the
+    CPU's CRC instruction when it has one.
+*/
+inline uint32_t crc32c(uint32_t crc, const void * data, size_t len)
+{
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) return crc32c_sse42(crc, data, len);
+#endif
+    return crc32c_portable(crc, data, len);
+}
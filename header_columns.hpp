@@ -0,0 +1,220 @@
+#pragma once
+
+#include "messages.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define COLUMN_BLOCK 16
+#define NO_SENDER UINT32_MAX
+
+/*
+    One user's headers as parallel arrays sorted by (date_sent, id): dates,
+    ids, flags and interned sender numbers. A time range is located by
+    binary search over the dates, and the unread and sender predicates are
+    evaluated COLUMN_BLOCK rows at a time over contiguous memory, with SSE2
+    when it is available.
+
+    Mail normally arrives in date order, so insertion is an append; an
+    out-of-order insert or an erase moves the tail of each column.
+*/
+class HeaderColumns
+{
+public:
+    void insert(time_t date_sent, const MessageIdentifier& id, uint8_t flag_bits,
+        const char * sender)
+    {
+        size_t pos = position(date_sent, id);
+        dates.insert(dates.begin() + pos, date_sent);
+        ids.insert(ids.begin() + pos, id);
+        flags.insert(flags.begin() + pos, flag_bits);
+        senders.insert(senders.begin() + pos, intern(sender));
+    }
+
+    void erase(time_t date_sent, const MessageIdentifier& id)
+    {
+        size_t pos = position(date_sent, id);
+        if (pos == dates.size() || !(ids[pos] == id)) return;
+        dates.erase(dates.begin() + pos);
+        ids.erase(ids.begin() + pos);
+        flags.erase(flags.begin() + pos);
+        senders.erase(senders.begin() + pos);
+    }
+
+    void set_flags(time_t date_sent, const MessageIdentifier& id, uint8_t flag_bits)
+    {
+        size_t pos = position(date_sent, id);
+        if (pos < dates.size() && ids[pos] == id)
+            flags[pos] = flag_bits;
+    }
+
+    size_t count_unread() const
+    {
+        size_t unread = 0;
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i read_bit = _mm_set1_epi8(MAIL_READ);
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + COLUMN_BLOCK <= flags.size(); i += COLUMN_BLOCK)
+        {
+            __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&flags[i]));
+            __m128i is_unread = _mm_cmpeq_epi8(_mm_and_si128(f, read_bit), zero);
+            unread += __builtin_popcount(_mm_movemask_epi8(is_unread));
+        }
+#endif
+        for (; i < flags.size(); i++)
+            unread += !(flags[i] & MAIL_READ);
+        return unread;
+    }
+
+    /*
+        Calls `visit` with the id of each row matching the unread, sender
+        and time filters of `query`, oldest or newest first, until it
+        returns false.
+    */
+    template <typename Query, typename Func>
+    void scan(const Query& query, Func visit) const
+    {
+        size_t first = 0;
+        size_t last = dates.size();
+        if (query.filters & FILTER_SINCE)
+            first = first_at_or_after(query.since);
+        if ((query.filters & FILTER_UNTIL)
+            && query.until < std::numeric_limits<time_t>::max())
+            last = first_at_or_after(query.until + 1);
+        if (first >= last) return;
+
+        bool unread = query.filters & FILTER_UNREAD;
+        uint32_t sender = NO_SENDER;
+        if (query.filters & FILTER_SENDER)
+        {
+            auto it = sender_ids.find(query.sender);
+            if (it == sender_ids.end()) return;
+            sender = it->second;
+        }
+
+        if (!query.newest_first)
+        {
+            for (size_t block = first; block < last; block += COLUMN_BLOCK)
+            {
+                uint32_t mask = match_block(block, std::min(last - block, size_t(COLUMN_BLOCK)),
+                    unread, sender);
+                while (mask != 0)
+                {
+                    int bit = __builtin_ctz(mask);
+                    if (!visit(ids[block + bit])) return;
+                    mask &= mask - 1;
+                }
+            }
+        }
+        else
+        {
+            for (size_t end = last; end > first; )
+            {
+                size_t block = end - std::min(end - first, size_t(COLUMN_BLOCK));
+                uint32_t mask = match_block(block, end - block, unread, sender);
+                while (mask != 0)
+                {
+                    int bit = 31 - __builtin_clz(mask);
+                    if (!visit(ids[block + bit])) return;
+                    mask &= ~(1u << bit);
+                }
+                end = block;
+            }
+        }
+    }
+
+    size_t size() const { return dates.size(); }
+
+private:
+    /*
+        Bit i is set if row start + i matches. Full blocks are evaluated
+        with vector compares; a short final block falls back to scalar.
+    */
+    uint32_t match_block(size_t start, size_t count, bool unread, uint32_t sender) const
+    {
+        uint32_t mask = (1u << count) - 1;
+#ifdef __SSE2__
+        if (count == COLUMN_BLOCK)
+        {
+            if (unread)
+            {
+                __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&flags[start]));
+                __m128i is_unread = _mm_cmpeq_epi8(
+                    _mm_and_si128(f, _mm_set1_epi8(MAIL_READ)), _mm_setzero_si128());
+                mask &= _mm_movemask_epi8(is_unread);
+            }
+            if (sender != NO_SENDER)
+            {
+                const __m128i wanted = _mm_set1_epi32(sender);
+                uint32_t same = 0;
+                for (int lane = 0; lane < COLUMN_BLOCK / 4; lane++)
+                {
+                    __m128i s = _mm_loadu_si128(
+                        reinterpret_cast<const __m128i*>(&senders[start + 4 * lane]));
+                    __m128i eq = _mm_cmpeq_epi32(s, wanted);
+                    same |= _mm_movemask_ps(_mm_castsi128_ps(eq)) << (4 * lane);
+                }
+                mask &= same;
+            }
+            return mask;
+        }
+#endif
+        for (size_t i = 0; i < count; i++)
+        {
+            bool match = (!unread || !(flags[start + i] & MAIL_READ))
+                && (sender == NO_SENDER || senders[start + i] == sender);
+            if (!match)
+                mask &= ~(1u << i);
+        }
+        return mask;
+    }
+
+    size_t first_at_or_after(time_t date) const
+    {
+        size_t lo = 0, hi = dates.size();
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (dates[mid] < date)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    /*
+        Row of (date_sent, id), or the row it would be inserted at.
+    */
+    size_t position(time_t date_sent, const MessageIdentifier& id) const
+    {
+        size_t pos = first_at_or_after(date_sent);
+        while (pos < dates.size() && dates[pos] == date_sent && ids[pos] < id)
+            ++pos;
+        return pos;
+    }
+
+    uint32_t intern(const char * sender)
+    {
+        auto it = sender_ids.find(sender);
+        if (it != sender_ids.end()) return it->second;
+        uint32_t next = sender_ids.size();
+        sender_ids.emplace(sender, next);
+        return next;
+    }
+
+    std::vector<time_t> dates;
+    std::vector<MessageIdentifier> ids;
+    std::vector<uint8_t> flags;
+    std::vector<uint32_t> senders;
+    std::unordered_map<std::string, uint32_t> sender_ids;
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "messages.h"
+
+#include <map>
+
+/*
+    Compact set of message identifiers. Identifiers are kept per origin as
+    disjoint inclusive [first, last] index ranges, so runs of consecutive
+    ids cost a single entry. Membership is O(1) for an origin with no
+    entries and O(log ranges) otherwise.
+*/
+class IdSet
+{
+public:
+    bool contains(const MessageIdentifier& id) const
+    {
+        if (!valid_origin(id.origin)) return false;
+        const auto& r = ranges[id.origin];
+        if (r.empty()) return false;
+
+        auto it = r.upper_bound(id.index);
+        if (it == r.begin()) return false;
+        --it;
+        return id.index <= it->second;
+    }
+
+    void insert(const MessageIdentifier& id)
+    {
+        insert_range(id.origin, id.index, id.index);
+    }
+
+    void insert_range(int origin, int first, int last)
+    {
+        if (!valid_origin(origin) || first > last) return;
+        auto& r = ranges[origin];
+
+        // Merge with every range that overlaps or touches [first, last]
+        auto it = r.upper_bound(first);
+        if (it != r.begin())
+        {
+            auto prev = std::prev(it);
+            if (prev->second >= first - 1)
+                it = prev;
+        }
+        while (it != r.end() && it->first <= last + 1)
+        {
+            first = std::min(first, it->first);
+            last = std::max(last, it->second);
+            it = r.erase(it);
+        }
+        r.emplace(first, last);
+    }
+
+    /*
+        Removes a single identifier. Returns false if it was not present.
+    */
+    bool erase(const MessageIdentifier& id)
+    {
+        if (!valid_origin(id.origin)) return false;
+        auto& r = ranges[id.origin];
+        if (r.empty()) return false;
+
+        auto it = r.upper_bound(id.index);
+        if (it == r.begin()) return false;
+        --it;
+        if (id.index > it->second) return false;
+
+        int first = it->first;
+        int last = it->second;
+        r.erase(it);
+        if (first < id.index)
+            r.emplace(first, id.index - 1);
+        if (id.index < last)
+            r.emplace(id.index + 1, last);
+        return true;
+    }
+
+    /*
+        Drops every identifier from `origin` with index <= `index`.
+    */
+    void expire_up_to(int origin, int index)
+    {
+        if (!valid_origin(origin)) return;
+        auto& r = ranges[origin];
+        while (!r.empty() && r.begin()->first <= index)
+        {
+            int last = r.begin()->second;
+            r.erase(r.begin());
+            if (last > index)
+            {
+                r.emplace(index + 1, last);
+                break;
+            }
+        }
+    }
+
+    template <typename Func>
+    void for_each_range(Func f) const
+    {
+        for (int origin = 0; origin < N_MACHINES; origin++)
+        {
+            for (const auto& range : ranges[origin])
+                f(origin, range.first, range.second);
+        }
+    }
+
+    size_t range_count() const
+    {
+        size_t n = 0;
+        for (const auto& r : ranges)
+            n += r.size();
+        return n;
+    }
+
+    bool empty() const
+    {
+        return range_count() == 0;
+    }
+
+private:
+    static bool valid_origin(int origin)
+    {
+        return origin >= 0 && origin < N_MACHINES;
+    }
+
+    std::map<int, int> ranges[N_MACHINES];
+};
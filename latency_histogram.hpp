@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+#define LATENCY_BUCKETS 32
+
+/*
+    Counts durations in power-of-two buckets of microseconds: bucket 0
+    holds durations under 1us, bucket i those in [2^(i-1), 2^i) us.
+    Percentiles are reported as the upper bound of their bucket.
+*/
+class LatencyHistogram
+{
+public:
+    void record(uint64_t nanos)
+    {
+        uint64_t micros = nanos / 1000;
+        int bucket = 0;
+        while (micros > 0 && bucket < LATENCY_BUCKETS - 1)
+        {
+            micros >>= 1;
+            ++bucket;
+        }
+        ++buckets[bucket];
+        ++total;
+        sum += nanos;
+        if (nanos > longest) longest = nanos;
+    }
+
+    uint64_t count() const { return total; }
+    double mean_micros() const { return total == 0 ? 0 : sum / 1000.0 / total; }
+    double max_micros() const { return longest / 1000.0; }
+
+    /*
+        Upper bound in microseconds of the bucket holding the p-th
+        percentile, for p in [0, 100].
+    */
+    uint64_t percentile_micros(double p) const
+    {
+        uint64_t rank = static_cast<uint64_t>(p / 100 * total);
+        uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            seen += buckets[i];
+            if (seen > rank || seen == total)
+                return uint64_t(1) << i;
+        }
+        return uint64_t(1) << (LATENCY_BUCKETS - 1);
+    }
+
+    void print_summary(FILE * out, const char * label) const
+    {
+        fprintf(out, "%s: %llu commits, mean %.1fus, p50 <%lluus, p99 <%lluus, max %.1fus\n",
+            label, static_cast<unsigned long long>(total), mean_micros(),
+            static_cast<unsigned long long>(percentile_micros(50)),
+            static_cast<unsigned long long>(percentile_micros(99)), max_micros());
+    }
+
+    /*
+        One line per non-empty bucket.
+    */
+    void print_buckets(FILE * out) const
+    {
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            if (buckets[i] == 0) continue;
+            fprintf(out, "  <%10lluus %10llu\n", static_cast<unsigned long long>(uint64_t(1) << i),
+                static_cast<unsigned long long>(buckets[i]));
+        }
+    }
+
+private:
+    uint64_t buckets[LATENCY_BUCKETS] = {};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t longest = 0;
+};
@@ -0,0 +1,99 @@
+#include "server.h"
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+/*
+    Offline tool: measures log throughput and commit latency under each
+    durability mode on the disk holding `dir`.
+
+        log_bench [records] [batch] [interval_ms] [dir]
+
+    Appends `records` records of an encoded mail command from every origin
+    in commits of `batch` records, as the server does, into a scratch
+    directory that is removed afterwards.
+*/
+
+static std::string bench_dir;
+static std::string record;      // the encoded command every record holds
+
+std::string bench_log_name(int origin, int index)
+{
+    return bench_dir + "/log_" + std::to_string(origin) + "_"
+        + std::to_string(index / FILE_BLOCK_SIZE);
+}
+
+bool run_mode(Durability mode, int records, int batch, int interval_ms)
+{
+    std::filesystem::create_directories(bench_dir);
+    LatencyHistogram latency;
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        LogWriter writer(N_MACHINES, FILE_BLOCK_SIZE, bench_log_name);
+        writer.set_durability(mode, interval_ms);
+        for (int i = 0; i < records; i++)
+        {
+            if (!writer.append(i % N_MACHINES, i / N_MACHINES, record.data(), record.size(),
+                    LOG_RECORD_COMMAND))
+                return false;
+            if ((i + 1) % batch != 0 && i + 1 != records) continue;
+
+            auto commit_start = std::chrono::steady_clock::now();
+            if (!writer.commit()) return false;
+            latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - commit_start).count());
+        }
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    std::filesystem::remove_all(bench_dir);
+
+    printf("%-8s %10.0f records/s %8.1f MB/s %10.0f commits/s\n", durability_name(mode),
+        records / seconds, records * record.size() / seconds / 1e6,
+        latency.count() / seconds);
+    latency.print_summary(stdout, "  latency");
+    latency.print_buckets(stdout);
+    return true;
+}
+
+int main(int argc, char * argv[])
+{
+    int records = argc > 1 ? std::stoi(argv[1]) : 10000;
+    int batch = argc > 2 ? std::stoi(argv[2]) : 16;
+    int interval_ms = argc > 3 ? std::stoi(argv[3]) : 100;
+    std::string dir = argc > 4 ? argv[4] : ".";
+    if (argc > 5 || records <= 0 || batch <= 0 || interval_ms < 0)
+    {
+        std::cerr << "Usage: " << argv[0] << " [records] [batch] [interval_ms] [dir]"
+            << std::endl;
+        return 1;
+    }
+    bench_dir = dir + "/log_bench_" + std::to_string(getpid());
+
+    UserCommand command{};
+    MailMessage mail{};
+    strcpy(mail.username, "alice");
+    strcpy(mail.to, "bob");
+    strcpy(mail.subject, "Quarterly report");
+    memset(mail.message, 'x', 400);
+    command.data = mail;
+    encode_command(command, record);
+
+    printf("%d records of %zu bytes, %d per commit, interval %d ms\n",
+        records, record.size(), batch, interval_ms);
+    for (int mode = 0; mode < N_DURABILITY_MODES; mode++)
+    {
+        if (!run_mode(static_cast<Durability>(mode), records, batch, interval_ms))
+        {
+            perror("Could not write log");
+            std::filesystem::remove_all(bench_dir);
+            return 1;
+        }
+    }
+    return 0;
+}
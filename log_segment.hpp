@@ -0,0 +1,255 @@
+#pragma once
+
+#include "crc32c.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define LOG_SEGMENT_MAGIC 0x00474f4c4c49414dULL     // "MAILLOG"
+#define LOG_INDEX_MAGIC 0x0058444e4c49414dULL       // "MAILNDX"
+#define LOG_SEGMENT_VERSION 3
+#define RECORD_FRAME_V1_SIZE 8      // index and length, no checksum
+
+/*
+    Log segment layout, all integers in host byte order:
+
+        SegmentHeader
+        records: RecordFrame, then `length` bytes
+        SegmentIndexEntry per record        (sealed segments only)
+        SegmentFooter                       (sealed segments only)
+
+    A segment is sealed once its block is complete. The footer's index maps
+    each command index to its record's offset, so a reader can seek
+    straight to a record, and its checksum covers everything before it.
+    The segment still being appended to has no footer and is scanned.
+
+    Each record carries a CRC-32C of its frame and data, so a torn or
+    corrupted record is detected where it is read, and a type left to the
+    writer. Version 2 frames have no type and their checksum covers index,
+    length and data; version 1 frames have only index and length. Records
+    of both are of type 0.
+*/
+
+struct SegmentHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct RecordFrame
+{
+    int32_t index;
+    uint32_t length;
+    uint32_t checksum;      // CRC-32C of index, length, type and data
+    uint32_t type;
+};
+
+inline uint32_t record_checksum(const RecordFrame& frame, const void * data,
+    uint32_t version = LOG_SEGMENT_VERSION)
+{
+    uint32_t crc = crc32c(0, &frame, RECORD_FRAME_V1_SIZE);
+    if (version > 2)
+        crc = crc32c(crc, &frame.type, sizeof(frame.type));
+    return crc32c(crc, data, frame.length);
+}
+
+struct SegmentIndexEntry
+{
+    int32_t index;
+    uint32_t offset;
+};
+
+struct SegmentFooter
+{
+    uint64_t index_offset;
+    uint32_t count;
+    uint32_t checksum;      // CRC-32C of the segment up to the footer
+    int32_t first_index;
+    int32_t last_index;
+    uint64_t magic;
+};
+
+// A record as it lies in the segment
+struct LogRecord
+{
+    int index;
+    const char * data;
+    uint32_t length;
+    uint32_t type;
+};
+
+/*
+    Maps a log segment and walks its records in place. Records are handed
+    out as views into the mapping, valid while the segment stays open, so
+    callers copy only the ones they keep.
+*/
+class LogSegment
+{
+public:
+    /*
+        Returns false if the file cannot be read or is not a log segment.
+    */
+    bool open(const std::string& path)
+    {
+        entries.clear();
+        is_sealed = false;
+        is_damaged = false;
+
+        if (!file.open(path)) return false;
+        file.advise(MADV_SEQUENTIAL);
+        bytes = file.data();
+        length = file.size();
+
+        SegmentHeader header;
+        if (length < sizeof(header)) return false;
+        memcpy(&header, bytes, sizeof(header));
+        if (header.magic != LOG_SEGMENT_MAGIC
+            || header.version < 1 || header.version > LOG_SEGMENT_VERSION)
+            return false;
+        version = header.version;
+        frame_size = version == 1 ? RECORD_FRAME_V1_SIZE : sizeof(RecordFrame);
+        cursor = sizeof(header);
+        data_end = length;
+
+        if (length >= sizeof(header) + sizeof(footer))
+        {
+            memcpy(&footer, bytes + length - sizeof(footer), sizeof(footer));
+            is_sealed = footer.magic == LOG_INDEX_MAGIC
+                && footer.index_offset >= sizeof(header)
+                && footer.index_offset + footer.count * sizeof(SegmentIndexEntry)
+                    + sizeof(footer) == length;
+        }
+        if (is_sealed)
+        {
+            data_end = footer.index_offset;
+            entries.resize(footer.count);
+            memcpy(entries.data(), bytes + footer.index_offset,
+                footer.count * sizeof(SegmentIndexEntry));
+        }
+        return true;
+    }
+
+    bool sealed() const { return is_sealed; }
+    uint32_t format_version() const { return version; }
+
+    // Whether the last read stopped at a torn or corrupted record
+    bool damaged() const { return is_damaged; }
+
+    /*
+        Reads the whole segment: every record's checksum and, if sealed, the
+        index and footer checksum. Returns nullptr if all is well, otherwise
+        what is wrong. Leaves the reader after the last good record.
+    */
+    const char * verify()
+    {
+        cursor = sizeof(SegmentHeader);
+        is_damaged = false;
+        size_t n = 0;
+        size_t at = cursor;
+        LogRecord record;
+        while (next(record))
+        {
+            if (is_sealed && (n >= entries.size() || entries[n].index != record.index
+                    || entries[n].offset != at))
+                return "index does not match records";
+            ++n;
+            at = cursor;
+        }
+        if (is_damaged) return "torn or corrupted record";
+        if (!is_sealed) return nullptr;
+        if (n != entries.size()) return "index does not match records";
+        if (crc32c(0, bytes, length - sizeof(footer)) != footer.checksum)
+            return "footer checksum mismatch";
+        return nullptr;
+    }
+
+    /*
+        Positions the reader at the record for `index`: a lookup in the
+        footer index of a sealed segment, a scan of an open one or if the
+        indexed record does not check out. Returns false if the segment has
+        no such record before its end or its first damaged record.
+    */
+    bool seek(int index)
+    {
+        is_damaged = false;
+        LogRecord record;
+        if (is_sealed)
+        {
+            auto found = std::lower_bound(entries.begin(), entries.end(), index,
+                [](const SegmentIndexEntry& e, int i) { return e.index < i; });
+            if (found == entries.end() || found->index != index) return false;
+            if (found->offset >= sizeof(SegmentHeader) && found->offset < data_end)
+            {
+                cursor = found->offset;
+                if (next(record) && record.index == index)
+                {
+                    cursor = found->offset;
+                    return true;
+                }
+                is_damaged = false;
+            }
+        }
+
+        cursor = sizeof(SegmentHeader);
+        while (true)
+        {
+            size_t at = cursor;
+            if (!next(record)) return false;
+            if (record.index == index)
+            {
+                cursor = at;
+                return true;
+            }
+        }
+    }
+
+    /*
+        Reads the record at the reader's position and moves past it. Returns
+        false at the end of the records, or at a torn or corrupted record,
+        which marks the segment damaged and leaves the reader before it.
+    */
+    bool next(LogRecord& record)
+    {
+        if (cursor == data_end) return false;
+        is_damaged = true;
+
+        RecordFrame frame;
+        if (data_end - cursor < frame_size) return false;
+        memcpy(&frame, bytes + cursor, frame_size);
+        if (frame.length > data_end - cursor - frame_size) return false;
+        const char * data = bytes + cursor + frame_size;
+        if (version > 1 && record_checksum(frame, data, version) != frame.checksum)
+            return false;
+
+        is_damaged = false;
+        record.index = frame.index;
+        record.data = data;
+        record.length = frame.length;
+        record.type = version > 2 ? frame.type : 0;
+        cursor += frame_size + frame.length;
+        return true;
+    }
+
+    // Offset just past the last good record read
+    size_t position() const { return cursor; }
+
+    const char * data() const { return bytes; }
+
+private:
+    MappedFile file;
+    const char * bytes = nullptr;
+    size_t length = 0;
+    std::vector<SegmentIndexEntry> entries;
+    SegmentFooter footer;
+    bool is_sealed = false;
+    bool is_damaged = false;
+    uint32_t version = LOG_SEGMENT_VERSION;
+    size_t frame_size = sizeof(RecordFrame);
+    size_t cursor = 0;
+    size_t data_end = 0;
+};
@@ -0,0 +1,328 @@
+#pragma once
+
+#include "log_segment.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+    When committed records reach the disk:
+        DURABILITY_NONE      left to the OS; lost on power failure
+        DURABILITY_INTERVAL  synced at most one interval after commit
+        DURABILITY_ACK       synced by commit, before anything is acked
+*/
+enum Durability
+{
+    DURABILITY_NONE,
+    DURABILITY_INTERVAL,
+    DURABILITY_ACK,
+    N_DURABILITY_MODES
+};
+
+inline const char * durability_name(Durability mode)
+{
+    static const char * names[] = {"none", "interval", "ack"};
+    return names[mode];
+}
+
+/*
+    Appends records to per-origin log segments of `block_size` records
+    each. Every origin's current segment stays open and appends are
+    buffered; commit() writes each origin's buffer with one write and,
+    depending on the durability mode, syncs the segments it touched, so
+    all records appended between two commits share one write and one sync
+    per segment. When appends move past a segment's block, or its block is
+    full at close, the segment is sealed: its index and footer are written
+    and it is synced.
+
+    Reopening a segment after a restart rebuilds its index from the records
+    already in it, dropping a torn record at the end. A segment of an
+    earlier format version is first rewritten in the current one. The
+    directory is synced whenever a segment is created or replaced, so a
+    synced record is not lost with its file's name.
+*/
+class LogWriter
+{
+public:
+    using NameFunc = std::string (*)(int origin, int index);
+
+    LogWriter(int origins, int block_size, NameFunc name)
+        : segments(origins), block_size(block_size), name(name)
+    {
+    }
+
+    LogWriter(const LogWriter&) = delete;
+    LogWriter& operator=(const LogWriter&) = delete;
+    ~LogWriter() { close(); }
+
+    /*
+        Returns false if the segment for `index` could not be opened or the
+        previous one could not be written.
+    */
+    bool append(int origin, int index, const void * data, size_t len, uint32_t type)
+    {
+        Segment& s = segments[origin];
+        int block = index / block_size;
+        if (block != s.block)
+        {
+            if (!seal(s) || !reopen(s, name(origin, index))) return false;
+            s.block = block;
+        }
+
+        add_record(s, index, data, len, type);
+        ++pending;
+        return true;
+    }
+
+    void set_durability(Durability mode, int interval_ms)
+    {
+        durability = mode;
+        sync_interval = std::chrono::milliseconds(interval_ms);
+    }
+
+    Durability mode() const { return durability; }
+
+    /*
+        Hands every appended record to the OS and syncs as the durability
+        mode requires. Returns false on an I/O error.
+    */
+    bool commit()
+    {
+        bool ok = true;
+        for (auto& s : segments)
+            ok = write_out(s) && ok;
+        pending = 0;
+        if (durability == DURABILITY_ACK)
+            ok = sync_all() && ok;
+        else if (durability == DURABILITY_INTERVAL)
+            ok = sync_if_due() && ok;
+        return ok;
+    }
+
+    /*
+        In interval mode, syncs committed records once the interval since
+        the last sync has passed. Call periodically.
+    */
+    bool sync_if_due()
+    {
+        if (durability != DURABILITY_INTERVAL) return true;
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_sync < sync_interval) return true;
+        last_sync = now;
+        return sync_all();
+    }
+
+    /*
+        Syncs every committed record regardless of the durability mode.
+    */
+    bool sync_all()
+    {
+        bool ok = true;
+        for (auto& s : segments)
+            ok = sync(s) && ok;
+        return ok;
+    }
+
+    // Records appended since the last commit
+    size_t uncommitted() const { return pending; }
+
+    void close()
+    {
+        for (auto& s : segments)
+        {
+            if (!s.entries.empty() && s.entries.back().index % block_size == block_size - 1)
+                seal(s);
+            else
+                finish(s);
+        }
+    }
+
+private:
+    struct Segment
+    {
+        int fd = -1;
+        int block = -1;
+        std::string buffer;
+        bool unsynced = false;
+        uint64_t size = 0;          // bytes written plus buffered
+        uint32_t checksum = 0;
+        std::vector<SegmentIndexEntry> entries;
+    };
+
+    static void add(Segment& s, const void * data, size_t len)
+    {
+        s.buffer.append(static_cast<const char *>(data), len);
+        s.checksum = crc32c(s.checksum, data, len);
+        s.size += len;
+    }
+
+    static void add_record(Segment& s, int index, const void * data, size_t len,
+        uint32_t type)
+    {
+        RecordFrame frame{index, static_cast<uint32_t>(len), 0, type};
+        frame.checksum = record_checksum(frame, data);
+        s.entries.push_back(SegmentIndexEntry{index, static_cast<uint32_t>(s.size)});
+        add(s, &frame, sizeof(frame));
+        add(s, data, len);
+    }
+
+    /*
+        Opens `path` for appending. An existing segment's records are kept
+        and its index rebuilt; anything after its last good record,
+        including a footer, is cut off.
+    */
+    static bool reopen(Segment& s, const std::string& path)
+    {
+        if (!upgrade(path)) return false;
+        bool created = access(path.c_str(), F_OK) != 0;
+        s.fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (s.fd < 0) return false;
+        // Syncing a new segment's records does not make its name durable
+        if (created && !sync_dir(path))
+        {
+            ::close(s.fd);
+            s.fd = -1;
+            return false;
+        }
+        s.size = 0;
+        s.checksum = 0;
+        s.entries.clear();
+
+        LogSegment existing;
+        if (existing.open(path))
+        {
+            LogRecord record;
+            size_t end = existing.position();
+            while (existing.next(record))
+            {
+                s.entries.push_back(SegmentIndexEntry{record.index,
+                    static_cast<uint32_t>(end)});
+                end = existing.position();
+            }
+            s.size = end;
+            s.checksum = crc32c(0, existing.data(), end);
+        }
+        if (ftruncate(s.fd, s.size) != 0)
+        {
+            ::close(s.fd);
+            s.fd = -1;
+            return false;
+        }
+
+        if (s.size == 0)
+        {
+            SegmentHeader header{LOG_SEGMENT_MAGIC, LOG_SEGMENT_VERSION, 0};
+            add(s, &header, sizeof(header));
+        }
+        return true;
+    }
+
+    /*
+        Rewrites a segment of an earlier format version in the current one
+        with its good records, so that records appended to it share one
+        format. The rewrite replaces the segment only once it is on disk.
+    */
+    static bool upgrade(const std::string& path)
+    {
+        LogSegment existing;
+        if (!existing.open(path) || existing.format_version() == LOG_SEGMENT_VERSION)
+            return true;
+
+        std::string temp = path + ".tmp";
+        Segment s;
+        s.fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (s.fd < 0) return false;
+        SegmentHeader header{LOG_SEGMENT_MAGIC, LOG_SEGMENT_VERSION, 0};
+        add(s, &header, sizeof(header));
+        LogRecord record;
+        while (existing.next(record))
+            add_record(s, record.index, record.data, record.length, record.type);
+
+        bool ok = write_out(s) && fdatasync(s.fd) == 0;
+        ::close(s.fd);
+        return ok && rename(temp.c_str(), path.c_str()) == 0 && sync_dir(path);
+    }
+
+    /*
+        Syncs the directory holding `path`, so a file created or renamed
+        there survives a power failure.
+    */
+    static bool sync_dir(const std::string& path)
+    {
+        size_t slash = path.find_last_of('/');
+        std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0) return false;
+        bool ok = fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+    }
+
+    /*
+        Writes the segment's index and footer after its records, then syncs
+        and closes it.
+    */
+    static bool seal(Segment& s)
+    {
+        if (s.fd < 0) return true;
+        SegmentFooter footer;
+        footer.index_offset = s.size;
+        footer.count = s.entries.size();
+        footer.first_index = s.entries.empty() ? -1 : s.entries.front().index;
+        footer.last_index = s.entries.empty() ? -1 : s.entries.back().index;
+        footer.magic = LOG_INDEX_MAGIC;
+        add(s, s.entries.data(), s.entries.size() * sizeof(SegmentIndexEntry));
+        footer.checksum = s.checksum;
+        add(s, &footer, sizeof(footer));
+        return finish(s);
+    }
+
+    static bool write_out(Segment& s)
+    {
+        const char * p = s.buffer.data();
+        size_t left = s.buffer.size();
+        while (left > 0)
+        {
+            ssize_t n = ::write(s.fd, p, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return false;
+            p += n;
+            left -= n;
+            s.unsynced = true;
+        }
+        s.buffer.clear();
+        return true;
+    }
+
+    static bool sync(Segment& s)
+    {
+        if (!s.unsynced) return true;
+        s.unsynced = false;
+        return fdatasync(s.fd) == 0;
+    }
+
+    static bool finish(Segment& s)
+    {
+        if (s.fd < 0) return true;
+        bool ok = write_out(s) && sync(s);
+        ::close(s.fd);
+        s.fd = -1;
+        s.block = -1;
+        s.entries.clear();
+        return ok;
+    }
+
+    std::vector<Segment> segments;
+    int block_size;
+    NameFunc name;
+    size_t pending = 0;
+    Durability durability = DURABILITY_ACK;
+    std::chrono::milliseconds sync_interval{0};
+    std::chrono::steady_clock::time_point last_sync;
+};
@@ -0,0 +1,360 @@
+#pragma once
+
+#include "messages.h"
+#include "mailbox.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define STORE_PAGE_SIZE 4096
+#define STORE_INITIAL_SLOTS 1024
+#define STORE_MAGIC 0x524f54534c49414dULL
+
+/*
+    A file of fixed-size slots mapped into memory. The first page holds the
+    allocation state and a caller-defined Meta block; slots follow. Freed
+    slots are chained through the file, so allocation never scans. The
+    mapping is replaced when the file grows, so callers refer to slots by
+    index rather than by address.
+*/
+template <typename T, typename Meta>
+class SlotFile
+{
+    struct Header
+    {
+        uint64_t magic;
+        uint32_t slot_size;
+        uint32_t capacity;
+        uint32_t high_water;
+        uint32_t free_head;
+        uint32_t used;
+        Meta meta;
+    };
+
+    struct Slot
+    {
+        uint32_t in_use;
+        uint32_t next_free;
+        T value;
+    };
+
+    static_assert(sizeof(Header) <= STORE_PAGE_SIZE, "store header must fit one page");
+
+public:
+    SlotFile() = default;
+    SlotFile(const SlotFile&) = delete;
+    SlotFile& operator=(const SlotFile&) = delete;
+
+    ~SlotFile()
+    {
+        unmap();
+        if (fd >= 0) ::close(fd);
+    }
+
+    /*
+        Maps `path`, creating it if it does not exist. Returns false if the
+        file cannot be mapped or was written with a different slot layout.
+    */
+    bool open(const std::string& path)
+    {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) return false;
+
+        created = st.st_size == 0;
+        if (created)
+        {
+            if (!map(STORE_INITIAL_SLOTS)) return false;
+            Header * h = header();
+            memset(h, 0, sizeof(Header));
+            h->magic = STORE_MAGIC;
+            h->slot_size = sizeof(Slot);
+            h->capacity = STORE_INITIAL_SLOTS;
+            h->free_head = NO_SLOT;
+            return true;
+        }
+
+        if (static_cast<size_t>(st.st_size) < STORE_PAGE_SIZE) return false;
+        uint32_t capacity = (st.st_size - STORE_PAGE_SIZE) / sizeof(Slot);
+        if (!map(capacity)) return false;
+        return header()->magic == STORE_MAGIC && header()->slot_size == sizeof(Slot)
+            && header()->capacity <= capacity;
+    }
+
+    uint32_t allocate()
+    {
+        Header * h = header();
+        uint32_t index = h->free_head;
+        if (index != NO_SLOT)
+        {
+            h->free_head = slot(index).next_free;
+        }
+        else
+        {
+            if (h->high_water == h->capacity)
+            {
+                grow();
+                h = header();
+            }
+            index = h->high_water++;
+        }
+        slot(index).in_use = 1;
+        ++h->used;
+        return index;
+    }
+
+    void release(uint32_t index)
+    {
+        Header * h = header();
+        Slot& s = slot(index);
+        s.in_use = 0;
+        s.next_free = h->free_head;
+        h->free_head = index;
+        --h->used;
+    }
+
+    T& at(uint32_t index) { return slot(index).value; }
+    const T& at(uint32_t index) const { return slot(index).value; }
+    bool in_use(uint32_t index) const
+    {
+        return index < header()->high_water && slot(index).in_use;
+    }
+
+    template <typename Func>
+    void for_each(Func f)
+    {
+        for (uint32_t i = 0; i < header()->high_water; i++)
+        {
+            if (slot(i).in_use)
+                f(i, slot(i).value);
+        }
+    }
+
+    Meta& meta() { return header()->meta; }
+    uint32_t used() const { return header()->used; }
+    bool fresh() const { return created; }
+    bool is_open() const { return base != nullptr; }
+
+    bool sync()
+    {
+        return msync(base, length, MS_SYNC) == 0;
+    }
+
+private:
+    static size_t bytes_for(uint32_t capacity)
+    {
+        return STORE_PAGE_SIZE + static_cast<size_t>(capacity) * sizeof(Slot);
+    }
+
+    bool map(uint32_t capacity)
+    {
+        size_t bytes = bytes_for(capacity);
+        if (ftruncate(fd, bytes) < 0) return false;
+        void * p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) return false;
+        base = static_cast<char*>(p);
+        length = bytes;
+        return true;
+    }
+
+    void unmap()
+    {
+        if (base != nullptr) munmap(base, length);
+        base = nullptr;
+    }
+
+    void grow()
+    {
+        uint32_t capacity = header()->capacity * 2;
+        unmap();
+        if (!map(capacity))
+        {
+            perror("mail store");
+            exit(1);
+        }
+        header()->capacity = capacity;
+    }
+
+    Header * header() const { return reinterpret_cast<Header*>(base); }
+
+    Slot& slot(uint32_t index) const
+    {
+        return reinterpret_cast<Slot*>(base + STORE_PAGE_SIZE)[index];
+    }
+
+    int fd = -1;
+    char * base = nullptr;
+    size_t length = 0;
+    bool created = false;
+};
+
+/*
+    Replication progress as of the last flush. The manifest holds the
+    replay point; this records which progress the flushed mail covers.
+*/
+struct StoreCheckpoint
+{
+    uint32_t valid;
+    int knowledge[N_MACHINES][N_MACHINES];
+    int applied_to_state[N_MACHINES];
+};
+
+struct StoredHeader
+{
+    char owner[MAX_USERNAME];
+    MessageIdentifier id;
+    time_t date_sent;
+    uint8_t flags;
+    uint32_t body;
+};
+
+struct StoredBody
+{
+    uint32_t refs;
+    MailBody body;
+};
+
+struct NoMeta {};
+
+/*
+    Inboxes kept in two mapped slot files: one recipient copy per header
+    slot, and one shared body per body slot, counted by the headers that
+    reference it. The kernel pages bodies in and out as they are used;
+    only headers and indexes are held in the process's own memory.
+*/
+class MailStore
+{
+public:
+    bool open(const std::string& base)
+    {
+        return headers.open(base + ".headers") && bodies.open(base + ".bodies");
+    }
+
+    bool is_open() const { return headers.is_open() && bodies.is_open(); }
+    bool fresh() const { return headers.fresh(); }
+
+    /*
+        A new body starts unreferenced; release_if_unused frees it if no
+        copy was delivered.
+    */
+    uint32_t add_body()
+    {
+        uint32_t slot = bodies.allocate();
+        StoredBody& b = bodies.at(slot);
+        memset(&b, 0, sizeof(b));
+        return slot;
+    }
+
+    MailBody * body(uint32_t slot) { return &bodies.at(slot).body; }
+
+    void release_if_unused(uint32_t slot)
+    {
+        if (bodies.in_use(slot) && bodies.at(slot).refs == 0)
+            bodies.release(slot);
+    }
+
+    uint32_t add_header(const std::string& owner, const StoredMail& mail)
+    {
+        uint32_t slot = headers.allocate();
+        StoredHeader& h = headers.at(slot);
+        memset(&h, 0, sizeof(h));
+        strncpy(h.owner, owner.c_str(), MAX_USERNAME - 1);
+        h.id = mail.id;
+        h.date_sent = mail.date_sent;
+        h.flags = mail.flags;
+        h.body = mail.body.store_slot();
+        ++bodies.at(h.body).refs;
+        return slot;
+    }
+
+    void remove_header(uint32_t slot)
+    {
+        uint32_t body = headers.at(slot).body;
+        headers.release(slot);
+        if (--bodies.at(body).refs == 0)
+            bodies.release(body);
+    }
+
+    void set_flags(uint32_t slot, uint8_t flags)
+    {
+        headers.at(slot).flags = flags;
+    }
+
+    /*
+        Calls `f` with the owner and in-memory copy of every stored message.
+    */
+    template <typename Func>
+    void for_each_mail(Func f)
+    {
+        headers.for_each([&f](uint32_t slot, const StoredHeader& h) {
+            StoredMail mail;
+            mail.id = h.id;
+            mail.date_sent = h.date_sent;
+            mail.flags = h.flags;
+            mail.body = BodyPtr::stored(h.body);
+            mail.slot = slot;
+            f(std::string(h.owner, strnlen(h.owner, MAX_USERNAME)), mail);
+        });
+    }
+
+    /*
+        Recounts body references from the headers and frees bodies that none
+        reference, such as one written just before a crash.
+    */
+    void collect_orphans()
+    {
+        std::vector<uint32_t> refs;
+        headers.for_each([&refs](uint32_t, const StoredHeader& h) {
+            if (h.body >= refs.size())
+                refs.resize(h.body + 1, 0);
+            ++refs[h.body];
+        });
+        bodies.for_each([&refs](uint32_t slot, StoredBody& b) {
+            b.refs = slot < refs.size() ? refs[slot] : 0;
+        });
+
+        std::vector<uint32_t> orphans;
+        bodies.for_each([&orphans](uint32_t slot, const StoredBody& b) {
+            if (b.refs == 0)
+                orphans.push_back(slot);
+        });
+        for (uint32_t slot : orphans)
+            bodies.release(slot);
+    }
+
+    const StoreCheckpoint& last_checkpoint() { return headers.meta(); }
+
+    /*
+        Flushes all mail before the checkpoint that describes it. Mail
+        applied after a checkpoint may also reach the disk; replay then
+        finds its copies already held.
+    */
+    bool save_checkpoint(const StoreCheckpoint& checkpoint)
+    {
+        if (!sync()) return false;
+        headers.meta() = checkpoint;
+        headers.meta().valid = 1;
+        return headers.sync();
+    }
+
+    bool sync()
+    {
+        return bodies.sync() && headers.sync();
+    }
+
+    uint32_t mail_count() const { return headers.used(); }
+    uint32_t body_count() const { return bodies.used(); }
+
+private:
+    SlotFile<StoredHeader, StoreCheckpoint> headers;
+    SlotFile<StoredBody, NoMeta> bodies;
+};
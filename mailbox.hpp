@@ -0,0 +1,375 @@
+#pragma once
+
+#include "messages.h"
+#include "pool.hpp"
+#include "header_columns.hpp"
+
+#include <cstring>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+struct InboxKey
+{
+    time_t date_sent;
+    MessageIdentifier id;
+
+    friend bool operator<(const InboxKey& k1, const InboxKey& k2)
+    {
+        if (k1.date_sent != k2.date_sent)
+            return k1.date_sent < k2.date_sent;
+        return k1.id < k2.id;
+    }
+};
+
+/*
+    The immutable part of a message. It is stored once and shared by every
+    recipient's copy.
+*/
+struct MailBody
+{
+    char from[MAX_USERNAME];
+    char subject[MAX_SUBJECT];
+    char message[EMAIL_LEN];
+};
+
+#define NO_SLOT UINT32_MAX
+
+// Set while bodies are kept in the mapped mail store
+inline MailBody * (*stored_body)(uint32_t slot) = nullptr;
+
+/*
+    Reference to a shared body. Pooled bodies are reference counted by their
+    handles. Bodies in the mail store are counted by the store's headers, so
+    a handle to one does not own it and is resolved on every access, since
+    the mapping may move as the store grows.
+*/
+class BodyPtr
+{
+public:
+    BodyPtr() = default;
+
+    static BodyPtr make()
+    {
+        BodyPtr ptr;
+        ptr.pooled = RcPtr<MailBody>::make();
+        return ptr;
+    }
+
+    static BodyPtr stored(uint32_t slot)
+    {
+        BodyPtr ptr;
+        ptr.slot = slot;
+        return ptr;
+    }
+
+    MailBody * get() const
+    {
+        if (pooled) return pooled.get();
+        return slot == NO_SLOT ? nullptr : stored_body(slot);
+    }
+
+    MailBody& operator*() const { return *get(); }
+    MailBody * operator->() const { return get(); }
+    explicit operator bool() const { return pooled || slot != NO_SLOT; }
+
+    uint32_t store_slot() const { return slot; }
+
+private:
+    RcPtr<MailBody> pooled;
+    uint32_t slot = NO_SLOT;
+};
+
+/*
+    One recipient's copy of a message: its own flags plus a reference to the
+    shared body. `slot` locates the copy in the mail store, if one is used.
+*/
+struct StoredMail
+{
+    MessageIdentifier id;
+    time_t date_sent;
+    uint8_t flags;
+    BodyPtr body;
+    uint32_t slot = NO_SLOT;
+};
+
+/*
+    Bytes a message counts against its recipient's quota.
+*/
+inline size_t mail_size(const MailBody& body)
+{
+    return strlen(body.subject) + strlen(body.message);
+}
+
+/*
+    Expands a stored message into the wire format sent to clients.
+*/
+inline InboxMessage make_inbox_message(const std::string& owner, const StoredMail& mail)
+{
+    InboxMessage result;
+    result.id = mail.id;
+    result.msg.flags = mail.flags;
+    result.msg.date_sent = mail.date_sent;
+    strcpy(result.msg.to, owner.c_str());
+    strcpy(result.msg.from, mail.body->from);
+    strcpy(result.msg.subject, mail.body->subject);
+    strcpy(result.msg.message, mail.body->message);
+    result.msg.n_attachments = 0;
+    return result;
+}
+
+struct IdentifierHash
+{
+    size_t operator()(const MessageIdentifier& id) const
+    {
+        return std::hash<long long>()(
+            (static_cast<long long>(id.origin) << 32) ^ static_cast<unsigned>(id.index));
+    }
+};
+
+/*
+    Which messages an inbox listing returns. Filters are FILTER_* bits;
+    since and until are inclusive bounds on date_sent.
+*/
+struct InboxQuery
+{
+    uint8_t filters = 0;
+    std::string sender;
+    time_t since = 0;
+    time_t until = 0;
+    bool newest_first = false;
+};
+
+/*
+    A single user's mail. Messages are ordered by (date_sent, id) in a tree
+    whose key never changes after insertion, so the stored message can be
+    modified in place: flag updates do not touch the tree structure. A hash
+    index gives constant time lookup by identifier, and the message, unread
+    and byte counts are maintained as mail is added, removed and flagged.
+
+    Secondary indexes over the same keys hold the unread messages and each
+    sender's messages, so filtered listings cost O(log n + matches scanned)
+    instead of a walk of the whole mailbox. With the columnar layout they
+    are replaced by HeaderColumns, which answers listings and the unread
+    count with sequential scans.
+*/
+class Mailbox
+{
+public:
+    using Index = std::map<InboxKey, StoredMail, std::less<InboxKey>,
+        PoolAllocator<std::pair<const InboxKey, StoredMail>>>;
+    using const_iterator = Index::const_iterator;
+    using KeyIndex = std::map<InboxKey, Index::iterator, std::less<InboxKey>,
+        PoolAllocator<std::pair<const InboxKey, Index::iterator>>>;
+
+    // Layout for mailboxes created from now on
+    static inline bool columnar_layout = false;
+
+    Mailbox() = default;
+    Mailbox(Mailbox&&) = default;
+    Mailbox& operator=(Mailbox&&) = default;
+    Mailbox(const Mailbox&) = delete;
+    Mailbox& operator=(const Mailbox&) = delete;
+
+    /*
+        Returns false if a message with the same identifier is already
+        present.
+    */
+    bool insert(const StoredMail& mail)
+    {
+        if (by_id.find(mail.id) != by_id.end()) return false;
+
+        InboxKey key{mail.date_sent, mail.id};
+        auto it = by_date.emplace(key, mail).first;
+        by_id.emplace(mail.id, it);
+        if (columnar)
+        {
+            columns.insert(mail.date_sent, mail.id, mail.flags, mail.body->from);
+        }
+        else
+        {
+            by_sender[mail.body->from].emplace(key, it);
+            if (!(mail.flags & MAIL_READ))
+                unread_index.emplace(key, it);
+        }
+        byte_count += mail_size(*mail.body);
+        return true;
+    }
+
+    bool erase(const MessageIdentifier& id)
+    {
+        auto found = by_id.find(id);
+        if (found == by_id.end()) return false;
+
+        Index::iterator it = found->second;
+        const StoredMail& mail = it->second;
+        if (columnar)
+        {
+            columns.erase(mail.date_sent, mail.id);
+        }
+        else
+        {
+            unread_index.erase(it->first);
+            auto sender = by_sender.find(mail.body->from);
+            sender->second.erase(it->first);
+            if (sender->second.empty())
+                by_sender.erase(sender);
+        }
+        byte_count -= mail_size(*mail.body);
+        by_date.erase(it);
+        by_id.erase(found);
+        return true;
+    }
+
+    const StoredMail * find(const MessageIdentifier& id) const
+    {
+        auto found = by_id.find(id);
+        return found == by_id.end() ? nullptr : &found->second->second;
+    }
+
+    /*
+        Sets the bits in `set` and clears the bits in `clear` on one message.
+        Returns false if the message is not in this mailbox.
+    */
+    bool set_flags(const MessageIdentifier& id, uint8_t set, uint8_t clear)
+    {
+        auto found = by_id.find(id);
+        if (found == by_id.end()) return false;
+
+        Index::iterator it = found->second;
+        uint8_t& flags = it->second.flags;
+        bool was_read = flags & MAIL_READ;
+        flags = (flags | set) & ~clear;
+        if (columnar)
+        {
+            columns.set_flags(it->first.date_sent, id, flags);
+            return true;
+        }
+        bool is_read = flags & MAIL_READ;
+        if (was_read && !is_read) unread_index.emplace(it->first, it);
+        if (!was_read && is_read) unread_index.erase(it->first);
+        return true;
+    }
+
+    /*
+        Applies the same flag change to a batch of messages. Identifiers that
+        are not present are passed to `missing`.
+    */
+    template <typename Func>
+    int set_flags(const MessageIdentifier * ids, int n, uint8_t set, uint8_t clear,
+        Func missing)
+    {
+        int updated = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (set_flags(ids[i], set, clear))
+                ++updated;
+            else
+                missing(ids[i]);
+        }
+        return updated;
+    }
+
+    /*
+        Calls `visit` with each message matching `q`, in the requested date
+        order, until it returns false. The time range bounds a scan of the
+        smallest applicable index; remaining predicates are checked per
+        message.
+    */
+    template <typename Func>
+    void query(const InboxQuery& q, Func visit) const
+    {
+        if (columnar)
+        {
+            columns.scan(q, [this, &visit](const MessageIdentifier& id) {
+                return visit(*find(id));
+            });
+            return;
+        }
+
+        InboxKey lo{std::numeric_limits<time_t>::min(), {INT_MIN, INT_MIN}};
+        InboxKey hi{std::numeric_limits<time_t>::max(), {INT_MAX, INT_MAX}};
+        if (q.filters & FILTER_SINCE) lo.date_sent = q.since;
+        if (q.filters & FILTER_UNTIL) hi.date_sent = q.until;
+        if (hi < lo) return;
+
+        const KeyIndex * candidates = nullptr;
+        if (q.filters & FILTER_SENDER)
+        {
+            auto sender = by_sender.find(q.sender);
+            if (sender == by_sender.end()) return;
+            candidates = &sender->second;
+        }
+        if ((q.filters & FILTER_UNREAD)
+            && (candidates == nullptr || unread_index.size() < candidates->size()))
+        {
+            candidates = &unread_index;
+        }
+
+        auto matching = [&q, &visit](const StoredMail& mail) {
+            if ((q.filters & FILTER_UNREAD) && (mail.flags & MAIL_READ))
+                return true;
+            if ((q.filters & FILTER_SENDER) && q.sender != mail.body->from)
+                return true;
+            return visit(mail);
+        };
+
+        if (candidates == nullptr)
+        {
+            scan(by_date, lo, hi, q.newest_first,
+                [](Index::const_iterator it) -> const StoredMail& { return it->second; },
+                matching);
+        }
+        else
+        {
+            scan(*candidates, lo, hi, q.newest_first,
+                [](KeyIndex::const_iterator it) -> const StoredMail& { return it->second->second; },
+                matching);
+        }
+    }
+
+    const_iterator begin() const { return by_date.begin(); }
+    const_iterator end() const { return by_date.end(); }
+    size_t size() const { return by_date.size(); }
+    bool empty() const { return by_date.empty(); }
+    int unread() const { return columnar ? columns.count_unread() : unread_index.size(); }
+    size_t bytes() const { return byte_count; }
+
+private:
+    template <typename Map, typename Get, typename Func>
+    static void scan(const Map& index, const InboxKey& lo, const InboxKey& hi,
+        bool reverse, Get get, Func visit)
+    {
+        auto first = index.lower_bound(lo);
+        auto last = index.upper_bound(hi);
+        if (!reverse)
+        {
+            for (auto it = first; it != last; ++it)
+            {
+                if (!visit(get(it))) return;
+            }
+        }
+        else
+        {
+            for (auto it = last; it != first; )
+            {
+                --it;
+                if (!visit(get(it))) return;
+            }
+        }
+    }
+
+    Index by_date;
+    std::unordered_map<MessageIdentifier, Index::iterator, IdentifierHash,
+        std::equal_to<MessageIdentifier>,
+        PoolAllocator<std::pair<const MessageIdentifier, Index::iterator>>> by_id;
+    bool columnar = columnar_layout;
+    HeaderColumns columns;
+    KeyIndex unread_index;
+    std::unordered_map<std::string, KeyIndex> by_sender;
+    size_t byte_count = 0;
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+    Read-only mapping of a whole file.
+*/
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path)
+    {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0)
+        {
+            void * p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = p != MAP_FAILED;
+            if (ok)
+            {
+                base = static_cast<const char *>(p);
+                length = st.st_size;
+            }
+        }
+        ::close(fd);
+        return ok;
+    }
+
+    void close()
+    {
+        if (base != nullptr)
+            munmap(const_cast<char *>(base), length);
+        base = nullptr;
+        length = 0;
+    }
+
+    /*
+        Passes an madvise() hint, such as MADV_SEQUENTIAL, for the mapping.
+    */
+    void advise(int advice)
+    {
+        if (base != nullptr)
+            madvise(const_cast<char *>(base), length, advice);
+    }
+
+    const char * data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    const char * base = nullptr;
+    size_t length = 0;
+};
@@ -2,6 +2,7 @@
 
 #include "net_include.h"
 #include <time.h>
+#include <cstring>
 #include <variant>
 
 #define MAX_USERNAME 30
@@ -10,25 +11,71 @@
 #define N_MACHINES 5
 #define MAX_MEMBERS 100
 #define INBOX_LIMIT 20
+#define MAX_FLAG_BATCH 100
+#define MAX_EXPIRE_BATCH 100
+#define MAX_READ_RANGES 64
+#define READ_SUMMARY_BUCKETS 64     // groups of users compared by ReadSummaryMessage
+#define MAX_FETCH_BATCH 100
+#define MAX_RECIPIENTS 50
+#define LIST_PREFIX '@'
+#define MAX_FOLDER 30
+#define INBOX_FOLDER "Inbox"
+#define SENT_FOLDER "Sent"
+#define FOLDER_SEPARATOR '/'
+#define MAX_ATTACHMENTS 4
+#define MAX_ATTACHMENT_NAME 64
+#define BLOB_HASH_LEN 32
+#define BLOB_CHUNK 32768
+#define MAX_BLOB_SIZE (16 << 20)
+
+// Inbox listing filters, combined in GetInboxMessage::filters
+#define FILTER_UNREAD 0x01
+#define FILTER_SENDER 0x02
+#define FILTER_SINCE 0x04
+#define FILTER_UNTIL 0x08
+
+// Per-message flags stored in InboxEntry::flags
+#define MAIL_READ 0x01
+#define MAIL_FLAGGED 0x02
+#define MAIL_ANSWERED 0x04
+#define MAIL_FLAG_BITS 8     // bits in a mail's flags
+
 enum MessageType
 {
     // Client to server messages
 	CONNECT,
     MAIL,
+    MULTI_MAIL,
 	READ,
 	DELETE,
 	SHOW_INBOX,
     SHOW_COMPONENT,
+    FLAG,
+    LIST_UPDATE,
+    SEARCH,
+    MAILBOX_STATS,
+    FOLDER,
+    PUT_BLOB,
+    GET_BLOB,
+    FETCH_BODIES,
 
     // Server to client message
 	ACK,
 	INBOX,
     RESPONSE,
     COMPONENT,
+    STATS,
+    BLOB,
+    BODIES,
 
     // Server to server messages
 	COMMAND,
-	KNOWLEDGE
+	KNOWLEDGE,
+    EXPIRE,
+    READ_DELTA,
+    FETCH_BLOB,
+    BLOB_DATA,
+    READ_SUMMARY
 };
 
 struct MessageHeader
@@ -64,6 +111,29 @@ bool operator==(const MessageIdentifier& m1, const MessageIdentifier& m2)
     return (m1.index == m2.index && m1.origin == m2.origin);
 }
 
+// SHA-256 of an attachment's content, which names it everywhere
+struct BlobHash
+{
+    unsigned char bytes[BLOB_HASH_LEN];
+
+    friend bool operator<(const BlobHash& h1, const BlobHash& h2)
+    {
+        return memcmp(h1.bytes, h2.bytes, BLOB_HASH_LEN) < 0;
+    }
+    friend bool operator==(const BlobHash& h1, const BlobHash& h2)
+    {
+        return memcmp(h1.bytes, h2.bytes, BLOB_HASH_LEN) == 0;
+    }
+};
+
+// Mail carries attachments by reference; their content is uploaded first
+struct AttachmentRef
+{
+    BlobHash hash;
+    uint32_t size;
+    char name[MAX_ATTACHMENT_NAME];
+};
+
 struct ConnectMessage
 {
     MessageType type = MessageType::CONNECT;
@@ -79,6 +149,23 @@ struct MailMessage
     char to[MAX_USERNAME];
     char subject[MAX_SUBJECT];
     char message[EMAIL_LEN];
+    int n_attachments = 0;
+    AttachmentRef attachments[MAX_ATTACHMENTS];
+};
+
+// One message to several recipients, replicated and stored once
+struct MultiMailMessage
+{
+    MessageType type = MessageType::MULTI_MAIL;
+    uint32_t session_id;
+    int seq_num;
+    char username[MAX_USERNAME];
+    int n_recipients;
+    char to[MAX_RECIPIENTS][MAX_USERNAME];
+    char subject[MAX_SUBJECT];
+    char message[EMAIL_LEN];
+    int n_attachments = 0;
+    AttachmentRef attachments[MAX_ATTACHMENTS];
 };
 
 struct ReadMessage
@@ -90,6 +177,18 @@ struct ReadMessage
     MessageIdentifier id;
 };
 
+// Several messages' bodies in one request, optionally marking them read
+struct FetchBodiesMessage
+{
+    MessageType type = MessageType::FETCH_BODIES;
+    uint32_t session_id;
+    int seq_num;
+    char username[MAX_USERNAME];
+    bool mark_read;
+    int count;
+    MessageIdentifier ids[MAX_FETCH_BATCH];
+};
+
 struct DeleteMessage
 {
     MessageType type = MessageType::DELETE;
@@ -99,12 +198,125 @@ struct DeleteMessage
     MessageIdentifier id;
 };
 
+struct FlagMessage
+{
+    MessageType type = MessageType::FLAG;
+    uint32_t session_id;
+    int seq_num;
+    char username[MAX_USERNAME];
+    uint8_t set;
+    uint8_t clear;
+    int count;
+    MessageIdentifier ids[MAX_FLAG_BATCH];
+};
+
+enum ListOp
+{
+    ADD_MEMBER,
+    REMOVE_MEMBER
+};
+
+// Changes the membership of a distribution list. List names start with
+// LIST_PREFIX and lists cannot contain other lists.
+struct ListMessage
+{
+    MessageType type = MessageType::LIST_UPDATE;
+    uint32_t session_id;
+    int seq_num;
+    char username[MAX_USERNAME];
+    char list[MAX_USERNAME];
+    char member[MAX_USERNAME];
+    ListOp op;
+};
+
+enum SortOrder
+{
+    OLDEST_FIRST,
+    NEWEST_FIRST
+};
+
+enum FolderOp
+{
+    CREATE_FOLDER,
+    MOVE_TO_FOLDER
+};
+
+// Creates a folder, or files a batch of messages into one. Every user has
+// INBOX_FOLDER; SENT_FOLDER is created by the first mail they send.
+struct FolderMessage
+{
+    MessageType type = MessageType::FOLDER;
+    uint32_t session_id;
+    int seq_num;
+    char username[MAX_USERNAME];
+    char folder[MAX_FOLDER];
+    FolderOp op;
+    int count;
+    MessageIdentifier ids[MAX_FLAG_BATCH];
+};
+
+// An empty folder means INBOX_FOLDER in the requests below
 struct GetInboxMessage
 {
     MessageType type = MessageType::SHOW_INBOX;
     uint32_t session_id;
     int seq_num;
     char username[MAX_USERNAME];
+    char folder[MAX_FOLDER] = "";
+    uint8_t filters = 0;
+    char sender[MAX_USERNAME];
+    time_t since;
+    time_t until;
+    SortOrder order = SortOrder::OLDEST_FIRST;
+};
+
+struct SearchMessage
+{
+    MessageType type = MessageType::SEARCH;
+    uint32_t session_id;
+    int seq_num;
+    char username[MAX_USERNAME];
+    char folder[MAX_FOLDER] = "";
+    int page;
+    char query[MAX_SUBJECT];
+};
+
+struct GetStatsMessage
+{
+    MessageType type = MessageType::MAILBOX_STATS;
+    uint32_t session_id;
+    int seq_num;
+    char username[MAX_USERNAME];
+    char folder[MAX_FOLDER] = "";
+};
+
+/*
+    One chunk of a blob: uploaded by clients as PUT_BLOB, sent to clients as
+    BLOB and between servers as BLOB_DATA. Only the first `length` bytes of
+    data are sent.
+*/
+struct BlobMessage
+{
+    MessageType type = MessageType::PUT_BLOB;
+    uint32_t session_id;
+    BlobHash hash;
+    uint32_t size;
+    uint32_t offset;
+    uint32_t length;
+    char data[BLOB_CHUNK];
+};
+
+/*
+    Asks for a blob: GET_BLOB from a client, or FETCH_BLOB from a server
+    that applied mail referencing a blob it lacks. A FETCH_BLOB is answered
+    by `holder` if it is present, and otherwise by any server with the blob.
+*/
+struct BlobRequestMessage
+{
+    MessageType type = MessageType::GET_BLOB;
+    uint32_t session_id;
+    BlobHash hash;
+    int holder;
 };
 
 struct GetComponentMessage 
@@ -113,6 +325,49 @@ struct GetComponentMessage
     uint32_t session_id;
 };
 
+// Generated by the origin server when a user's mail outlives its retention
+struct ExpireMessage
+{
+    MessageType type = MessageType::EXPIRE;
+    char username[MAX_USERNAME];
+    int count;
+    MessageIdentifier ids[MAX_EXPIRE_BATCH];
+};
+
+struct ReadRange
+{
+    int origin;
+    int first;
+    int last;
+};
+
+/*
+    Gossiped between servers outside the command log: message ids a user
+    has read, as inclusive per-origin ranges. Merging is idempotent, so
+    deltas may be duplicated or reordered.
+*/
+struct ReadDeltaMessage
+{
+    MessageType type = MessageType::READ_DELTA;
+    char username[MAX_USERNAME];
+    int count;
+    ReadRange ranges[MAX_READ_RANGES];
+};
+
+/*
+    Sent by every server after a membership change: for each origin and
+    each bucket of users, how many read ids the server holds and a digest
+    of them. Only buckets on which the servers present disagree are then
+    exchanged as READ_DELTA.
+*/
+struct ReadSummaryMessage
+{
+    MessageType type = MessageType::READ_SUMMARY;
+    int sender;
+    uint32_t count[N_MACHINES][READ_SUMMARY_BUCKETS];
+    uint64_t digest[N_MACHINES][READ_SUMMARY_BUCKETS];
+};
+
 struct UserCommand
 {
     MessageIdentifier id;
@@ -120,7 +375,12 @@ struct UserCommand
     std::variant<
         MailMessage, 
         ReadMessage, 
-        DeleteMessage
+        DeleteMessage,
+        FlagMessage,
+        ExpireMessage,
+        MultiMailMessage,
+        ListMessage,
+        FolderMessage
     > data;
 };
 
@@ -146,12 +406,14 @@ struct AckMessage
 
 struct InboxEntry
 {
-    bool read;
+    uint8_t flags;
     time_t date_sent;
     char to[MAX_USERNAME];
     char from[MAX_USERNAME];
     char subject[MAX_SUBJECT];
     char message[EMAIL_LEN];
+    int n_attachments;
+    AttachmentRef attachments[MAX_ATTACHMENTS];
 };
 
 struct InboxMessage
@@ -171,6 +433,16 @@ struct ComponentMessage
     char names [5][MAX_GROUP_NAME];
 };
 
+// Quota fields are 0 when unlimited
+struct StatsMessage
+{
+    int total;
+    int unread;
+    long bytes;
+    int quota_messages;
+    long quota_bytes;
+};
+
 bool operator==(const InboxMessage& m1, const InboxMessage& m2)
 {
     return m1.id == m2.id;
@@ -193,7 +465,8 @@ struct ServerResponse
     std::variant<
         AckMessage,
         InboxMessage,
-        ComponentMessage
+        ComponentMessage,
+        StatsMessage
     > data;
 };
 
@@ -202,7 +475,7 @@ struct InboxHeader
     time_t timestamp;
     char subject [MAX_SUBJECT];
     char sender [MAX_USERNAME];
-    bool read;
+    uint8_t flags;
     MessageIdentifier id;
     
     friend bool operator<(const InboxHeader& m1, const InboxHeader& m2);
@@ -213,6 +486,38 @@ bool operator<(const InboxHeader& m1, const InboxHeader& m2) {
     return m1.timestamp < m2.timestamp;
 }
 
+/*
+    Header of one message packed into a BodiesMessage. It is followed by
+    the sender, subject and body without terminators, then its attachment
+    refs.
+*/
+struct PackedBody
+{
+    MessageIdentifier id;
+    time_t date_sent;
+    uint8_t flags;
+    uint8_t n_attachments;
+    uint16_t from_len;
+    uint16_t subject_len;
+    uint16_t message_len;
+};
+
+#define BODIES_PAYLOAD (MAX_MESS_LEN - 16)
+
+/*
+    Answers FETCH_BODIES with as many packed bodies as fit. Only `used`
+    bytes of data are sent; `missing` counts requested ids not found and
+    is set on the last message.
+*/
+struct BodiesMessage
+{
+    MessageType type = MessageType::BODIES;
+    uint16_t count;
+    uint16_t missing;
+    uint32_t used;
+    char data[BODIES_PAYLOAD];
+};
+
 struct ServerInboxResponse
 {
     MessageType type = MessageType::RESPONSE;
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#define POOL_SLAB_BYTES (1 << 16)
+
+struct PoolStats
+{
+    size_t object_size;
+    size_t slabs;
+    size_t capacity;
+    size_t in_use;
+    size_t peak;
+};
+
+class SlabPoolBase
+{
+public:
+    virtual PoolStats stats() const = 0;
+};
+
+/*
+    Every slab pool registers itself here so occupancy can be reported
+    without knowing which object sizes are in use.
+*/
+inline std::vector<const SlabPoolBase*>& pool_registry()
+{
+    static std::vector<const SlabPoolBase*>* registry
+        = new std::vector<const SlabPoolBase*>;
+    return *registry;
+}
+
+/*
+    Fixed-size block allocator. Blocks are carved out of slabs of roughly
+    POOL_SLAB_BYTES and recycled through an intrusive free list, so steady
+    state allocation never reaches the heap. Slabs are only released when
+    the pool is destroyed. Not thread safe.
+*/
+template <size_t Size>
+class SlabPool : public SlabPoolBase
+{
+    union Block
+    {
+        Block * next;
+        alignas(std::max_align_t) char data[Size];
+    };
+
+    static constexpr size_t blocks_per_slab =
+        sizeof(Block) >= POOL_SLAB_BYTES ? 1 : POOL_SLAB_BYTES / sizeof(Block);
+
+public:
+    SlabPool()
+    {
+        pool_registry().push_back(this);
+    }
+
+    void * allocate()
+    {
+        if (free_list == nullptr)
+            grow();
+
+        Block * block = free_list;
+        free_list = block->next;
+        if (++in_use > peak)
+            peak = in_use;
+        return block->data;
+    }
+
+    void deallocate(void * p)
+    {
+        Block * block = reinterpret_cast<Block*>(p);
+        block->next = free_list;
+        free_list = block;
+        --in_use;
+    }
+
+    PoolStats stats() const override
+    {
+        PoolStats s;
+        s.object_size = Size;
+        s.slabs = slabs.size();
+        s.capacity = slabs.size() * blocks_per_slab;
+        s.in_use = in_use;
+        s.peak = peak;
+        return s;
+    }
+
+private:
+    void grow()
+    {
+        slabs.emplace_back(new Block[blocks_per_slab]);
+        Block * slab = slabs.back().get();
+        for (size_t i = 0; i < blocks_per_slab; ++i)
+        {
+            slab[i].next = free_list;
+            free_list = &slab[i];
+        }
+    }
+
+    std::vector<std::unique_ptr<Block[]>> slabs;
+    Block * free_list = nullptr;
+    size_t in_use = 0;
+    size_t peak = 0;
+};
+
+/*
+    One pool per block size, shared by every type of that size. The pool is
+    intentionally leaked so containers with static storage duration can still
+    release their nodes during exit.
+*/
+template <size_t Size>
+SlabPool<Size>& slab_pool()
+{
+    static SlabPool<Size> * pool = new SlabPool<Size>;
+    return *pool;
+}
+
+/*
+    Standard allocator that serves single-object requests (tree and list
+    nodes) from the matching slab pool and forwards anything else to the
+    default allocator.
+*/
+template <typename T>
+struct PoolAllocator
+{
+    using value_type = T;
+
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+        "PoolAllocator cannot over-align");
+
+    PoolAllocator() = default;
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T * allocate(size_t n)
+    {
+        if (n == 1)
+            return static_cast<T*>(slab_pool<sizeof(T)>().allocate());
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T * p, size_t n)
+    {
+        if (n == 1)
+            slab_pool<sizeof(T)>().deallocate(p);
+        else
+            std::allocator<T>().deallocate(p, n);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) { return false; }
+
+/*
+    Intrusively reference counted pointer to a pool allocated T. The count
+    lives next to the object in the same block and is not atomic, so this
+    must only be shared within a single thread.
+*/
+template <typename T>
+class RcPtr
+{
+    struct Node
+    {
+        template <typename ...Args>
+        Node(Args&&... args) : value(std::forward<Args>(args)...) {}
+
+        T value;
+        uint32_t refs = 1;
+    };
+
+public:
+    RcPtr() = default;
+
+    RcPtr(const RcPtr& other) : node(other.node)
+    {
+        if (node) ++node->refs;
+    }
+
+    RcPtr(RcPtr&& other) noexcept : node(other.node)
+    {
+        other.node = nullptr;
+    }
+
+    ~RcPtr()
+    {
+        release();
+    }
+
+    RcPtr& operator=(RcPtr other) noexcept
+    {
+        std::swap(node, other.node);
+        return *this;
+    }
+
+    template <typename ...Args>
+    static RcPtr make(Args&&... args)
+    {
+        RcPtr ptr;
+        void * block = slab_pool<sizeof(Node)>().allocate();
+        ptr.node = new (block) Node(std::forward<Args>(args)...);
+        return ptr;
+    }
+
+    T& operator*() const { return node->value; }
+    T * operator->() const { return &node->value; }
+    T * get() const { return node ? &node->value : nullptr; }
+    uint32_t use_count() const { return node ? node->refs : 0; }
+    explicit operator bool() const { return node != nullptr; }
+
+private:
+    void release()
+    {
+        if (node && --node->refs == 0)
+        {
+            node->~Node();
+            slab_pool<sizeof(Node)>().deallocate(node);
+        }
+        node = nullptr;
+    }
+
+    Node * node = nullptr;
+};
+
+inline void print_pool_stats()
+{
+    for (const SlabPoolBase * pool : pool_registry())
+    {
+        PoolStats s = pool->stats();
+        printf("pool %5zu B: %zu/%zu blocks in use (peak %zu) across %zu slabs\n",
+            s.object_size, s.in_use, s.capacity, s.peak, s.slabs);
+    }
+}
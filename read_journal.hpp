@@ -0,0 +1,132 @@
+#pragma once
+
+#include "messages.h"
+#include "crc32c.hpp"
+#include "mapped_file.hpp"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct ReadJournalRecord
+{
+    char user[MAX_USERNAME];
+    uint16_t reserved;
+    int32_t index;
+    int32_t origin;
+    uint32_t checksum;      // CRC-32C of the fields before it
+};
+
+/*
+    Append-only journal of the reads made on this server that no manifest
+    records yet. Appends are buffered and commit() writes them with one
+    write, so a read costs one small record rather than a snapshot. Each
+    record carries a checksum; replay stops at a torn or corrupted one.
+    Once a manifest covering every journalled read is in place, reset()
+    empties the journal.
+*/
+class ReadJournal
+{
+public:
+    ReadJournal() = default;
+    ReadJournal(const ReadJournal&) = delete;
+    ReadJournal& operator=(const ReadJournal&) = delete;
+    ~ReadJournal() { close(); }
+
+    bool open(const std::string& path)
+    {
+        close();
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        return fd >= 0;
+    }
+
+    void close()
+    {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+
+    /*
+        Calls `f(user, id)` for each good record in the journal at `path`.
+    */
+    template <typename Func>
+    static void replay(const std::string& path, Func f)
+    {
+        MappedFile file;
+        if (!file.open(path)) return;
+        for (size_t at = 0; at + sizeof(ReadJournalRecord) <= file.size();
+            at += sizeof(ReadJournalRecord))
+        {
+            ReadJournalRecord r;
+            memcpy(&r, file.data() + at, sizeof(r));
+            if (crc32c(0, &r, offsetof(ReadJournalRecord, checksum)) != r.checksum)
+                return;
+            f(std::string(r.user, strnlen(r.user, MAX_USERNAME)),
+                MessageIdentifier{r.index, r.origin});
+        }
+    }
+
+    void append(const std::string& user, const MessageIdentifier& id)
+    {
+        ReadJournalRecord r;
+        memset(&r, 0, sizeof(r));
+        strncpy(r.user, user.c_str(), MAX_USERNAME);
+        r.index = id.index;
+        r.origin = id.origin;
+        r.checksum = crc32c(0, &r, offsetof(ReadJournalRecord, checksum));
+        buffer.append(reinterpret_cast<const char *>(&r), sizeof(r));
+    }
+
+    // Records appended since the last commit
+    size_t uncommitted() const { return buffer.size() / sizeof(ReadJournalRecord); }
+
+    /*
+        Writes the appended records, syncing them if `durable`. Returns
+        false on an I/O error.
+    */
+    bool commit(bool durable)
+    {
+        const char * p = buffer.data();
+        size_t left = buffer.size();
+        while (left > 0)
+        {
+            ssize_t n = ::write(fd, p, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return false;
+            p += n;
+            left -= n;
+            unsynced = true;
+        }
+        buffer.clear();
+        return !durable || sync();
+    }
+
+    bool sync()
+    {
+        if (!unsynced) return true;
+        unsynced = false;
+        return fdatasync(fd) == 0;
+    }
+
+    /*
+        Empties the journal, if open. Call once its reads are recorded
+        elsewhere.
+    */
+    bool reset()
+    {
+        if (fd < 0) return true;
+        unsynced = false;
+        return ftruncate(fd, 0) == 0;
+    }
+
+private:
+    int fd = -1;
+    std::string buffer;
+    bool unsynced = false;
+};
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "messages.h"
+#include "mailbox.hpp"
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define DEFAULT_CACHE_BYTES (16 << 20)
+
+/*
+    Least recently used cache of encoded client responses, bounded by the
+    bytes it holds. Entries are grouped by user: an inbox listing is keyed by
+    its query and a message by its identifier, so a change to one message
+    drops that message and the user's listings and nothing else.
+*/
+class ResponseCache
+{
+public:
+    using Pages = std::vector<std::string>;
+
+    explicit ResponseCache(size_t budget = DEFAULT_CACHE_BYTES) : budget(budget) {}
+
+    // A budget of 0 caches nothing
+    void set_budget(size_t bytes)
+    {
+        budget = bytes;
+        evict();
+    }
+
+    const Pages * find_listing(const std::string& user, const InboxQuery& query)
+    {
+        return find(user, listing_key(query));
+    }
+
+    void store_listing(const std::string& user, const InboxQuery& query, Pages pages)
+    {
+        store(user, listing_key(query), std::move(pages));
+    }
+
+    const std::string * find_message(const std::string& user, const MessageIdentifier& id)
+    {
+        const Pages * pages = find(user, message_key(id));
+        return pages == nullptr ? nullptr : &pages->front();
+    }
+
+    void store_message(const std::string& user, const MessageIdentifier& id,
+        std::string encoded)
+    {
+        Pages pages;
+        pages.push_back(std::move(encoded));
+        store(user, message_key(id), std::move(pages));
+    }
+
+    /*
+        Drops every cached listing of `user`'s mailbox. Cached messages are
+        kept, since adding mail does not change them.
+    */
+    void invalidate_listings(const std::string& user)
+    {
+        auto u = users.find(user);
+        if (u == users.end()) return;
+
+        for (auto e = u->second.begin(); e != u->second.end(); )
+        {
+            if (e->first[0] != LISTING)
+            {
+                ++e;
+                continue;
+            }
+            used -= e->second->bytes;
+            lru.erase(e->second);
+            e = u->second.erase(e);
+        }
+        if (u->second.empty())
+            users.erase(u);
+    }
+
+    /*
+        Drops one message and every listing that may show it.
+    */
+    void invalidate(const std::string& user, const MessageIdentifier& id)
+    {
+        auto u = users.find(user);
+        if (u == users.end()) return;
+
+        auto e = u->second.find(message_key(id));
+        if (e != u->second.end())
+            remove(e->second);
+        invalidate_listings(user);
+    }
+
+    size_t bytes() const { return used; }
+    size_t entries() const { return lru.size(); }
+    size_t hits() const { return hit_count; }
+    size_t misses() const { return miss_count; }
+
+private:
+    static constexpr char LISTING = 'L';
+    static constexpr char MESSAGE = 'M';
+
+    struct Entry
+    {
+        std::string user;
+        std::string key;
+        Pages pages;
+        size_t bytes;
+    };
+
+    using Lru = std::list<Entry>;
+
+    /*
+        Fields a filter does not use are left out, so equivalent queries
+        share an entry.
+    */
+    static std::string listing_key(const InboxQuery& query)
+    {
+        std::string key(1, LISTING);
+        key += static_cast<char>(query.filters);
+        key += query.newest_first ? 'N' : 'O';
+        if (query.filters & FILTER_SINCE)
+            key.append(reinterpret_cast<const char*>(&query.since), sizeof(query.since));
+        if (query.filters & FILTER_UNTIL)
+            key.append(reinterpret_cast<const char*>(&query.until), sizeof(query.until));
+        if (query.filters & FILTER_SENDER)
+            key += query.sender;
+        return key;
+    }
+
+    static std::string message_key(const MessageIdentifier& id)
+    {
+        std::string key(1, MESSAGE);
+        key.append(reinterpret_cast<const char*>(&id), sizeof(id));
+        return key;
+    }
+
+    const Pages * find(const std::string& user, const std::string& key)
+    {
+        auto u = users.find(user);
+        if (u != users.end())
+        {
+            auto e = u->second.find(key);
+            if (e != u->second.end())
+            {
+                ++hit_count;
+                lru.splice(lru.begin(), lru, e->second);
+                return &e->second->pages;
+            }
+        }
+        ++miss_count;
+        return nullptr;
+    }
+
+    void store(const std::string& user, const std::string& key, Pages pages)
+    {
+        size_t bytes = user.size() + key.size();
+        for (const auto& page : pages)
+            bytes += page.size();
+        if (bytes > budget) return;
+
+        auto& entries = users[user];
+        auto existing = entries.find(key);
+        if (existing != entries.end())
+        {
+            used -= existing->second->bytes;
+            lru.erase(existing->second);
+            entries.erase(existing);
+        }
+
+        lru.push_front(Entry{user, key, std::move(pages), bytes});
+        entries.emplace(key, lru.begin());
+        used += bytes;
+        evict();
+    }
+
+    void evict()
+    {
+        while (used > budget && !lru.empty())
+            remove(std::prev(lru.end()));
+    }
+
+    void remove(Lru::iterator entry)
+    {
+        auto u = users.find(entry->user);
+        u->second.erase(entry->key);
+        if (u->second.empty())
+            users.erase(u);
+        used -= entry->bytes;
+        lru.erase(entry);
+    }
+
+    size_t budget;
+    size_t used = 0;
+    size_t hit_count = 0;
+    size_t miss_count = 0;
+    Lru lru;
+    std::unordered_map<std::string, std::unordered_map<std::string, Lru::iterator>> users;
+};
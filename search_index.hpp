@@ -0,0 +1,123 @@
+#pragma once
+
+#include "messages.h"
+#include "mailbox.hpp"
+#include "pool.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define MIN_TERM_LEN 2
+
+/*
+    Inverted index over the subject, sender and body of one user's mail.
+    Terms are lower-cased runs of ASCII letters and digits; a query matches
+    messages that contain every one of its terms.
+*/
+class SearchIndex
+{
+public:
+    using Postings = std::set<MessageIdentifier, std::less<MessageIdentifier>,
+        PoolAllocator<MessageIdentifier>>;
+
+    void add(const StoredMail& mail)
+    {
+        for_each_term(mail, [this, &mail](const std::string& term) {
+            postings[term].insert(mail.id);
+        });
+    }
+
+    void remove(const StoredMail& mail)
+    {
+        for_each_term(mail, [this, &mail](const std::string& term) {
+            auto it = postings.find(term);
+            if (it == postings.end()) return;
+            it->second.erase(mail.id);
+            if (it->second.empty())
+                postings.erase(it);
+        });
+    }
+
+    /*
+        Returns the identifiers of every message containing all terms in
+        `text`, in identifier order.
+    */
+    std::vector<MessageIdentifier> query(const char * text) const
+    {
+        std::vector<const Postings*> lists;
+        bool any_terms = false;
+        tokenize(text, [this, &lists, &any_terms](const std::string& term) {
+            any_terms = true;
+            auto it = postings.find(term);
+            lists.push_back(it == postings.end() ? nullptr : &it->second);
+        });
+
+        std::vector<MessageIdentifier> result;
+        if (!any_terms) return result;
+        for (const Postings * list : lists)
+        {
+            if (list == nullptr) return result;
+        }
+
+        // Intersect starting from the rarest term
+        std::sort(lists.begin(), lists.end(),
+            [](const Postings * a, const Postings * b) { return a->size() < b->size(); });
+        result.assign(lists[0]->begin(), lists[0]->end());
+        for (size_t i = 1; i < lists.size() && !result.empty(); i++)
+        {
+            std::vector<MessageIdentifier> narrowed;
+            for (const auto& id : result)
+            {
+                if (lists[i]->count(id))
+                    narrowed.push_back(id);
+            }
+            result.swap(narrowed);
+        }
+        return result;
+    }
+
+    size_t term_count() const { return postings.size(); }
+
+    template <typename Func>
+    static void tokenize(const char * text, Func f)
+    {
+        std::string term;
+        for (const char * c = text; ; ++c)
+        {
+            if (*c != '\0' && isalnum(static_cast<unsigned char>(*c)))
+            {
+                term.push_back(tolower(static_cast<unsigned char>(*c)));
+                continue;
+            }
+            if (term.size() >= MIN_TERM_LEN)
+                f(term);
+            term.clear();
+            if (*c == '\0') break;
+        }
+    }
+
+private:
+    /*
+        Visits each distinct term of a message once.
+    */
+    template <typename Func>
+    static void for_each_term(const StoredMail& mail, Func f)
+    {
+        std::vector<std::string> terms;
+        auto collect = [&terms](const std::string& term) { terms.push_back(term); };
+        tokenize(mail.body->subject, collect);
+        tokenize(mail.body->from, collect);
+        tokenize(mail.body->message, collect);
+
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+        for (const auto& term : terms)
+            f(term);
+    }
+
+    std::unordered_map<std::string, Postings> postings;
+};
@@ -3,12 +3,29 @@
 #include "net_include.h"
 #include "sp.h"
 #include "messages.h"
+#include "command_codec.hpp"
 #include "utils.hpp"
+#include "pool.hpp"
+#include "mailbox.hpp"
+#include "id_set.hpp"
+#include "search_index.hpp"
+#include "response_cache.hpp"
+#include "mail_store.hpp"
+#include "blob_store.hpp"
+#include "snapshot.hpp"
+#include "log_writer.hpp"
+#include "read_journal.hpp"
+#include "latency_histogram.hpp"
+#include "timer_wheel.hpp"
 
 #include <list>
+#include <map>
 #include <set>
 #include <string>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <memory>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -17,32 +34,224 @@
 #define MAX_VSSETS 100
 #define MAX_UPDATES_BW_SERIALIZE 5
 #define MAX_CHANGES_BW_GARBAGE 5
+#define CONFIG_FILE "mail.conf"
+#define TICK_INTERVAL 1
+#define MAX_LOG_BATCH 64     // messages drained per log commit
+
+// Log record types
+#define LOG_RECORD_IMAGE 0      // a UserCommand as laid out in memory, before encoding
+#define LOG_RECORD_COMMAND 1    // a command encoded by encode_command
 
 using boost::property_tree::ptree;
 
+// The server is single threaded, so commands and inbox nodes come from
+// slab pools and commands are shared through a non-atomic refcount.
+using CommandPtr = RcPtr<UserCommand>;
+using CommandQueue = std::list<CommandPtr, PoolAllocator<CommandPtr>>;
+
+// Pending reads and deletes are tracked per recipient, since every
+// recipient's copy of a message shares its identifier
+using PendingSets = std::unordered_map<std::string, IdSet>;
+
+struct Quota
+{
+    int messages;   // 0 = unlimited
+    long bytes;     // 0 = unlimited
+};
+
+struct ExpiryTimer
+{
+    std::string user;       // mailbox key, see mailbox_key
+    MessageIdentifier id;
+    bool load = false;      // wake an unloaded inbox instead of one message
+};
+
+/*
+    A mailbox saved in its own inbox file: the file, plus what the server
+    needs from it before first access.
+*/
+struct LazyInbox
+{
+    std::string file;
+    int total;
+    int unread;
+    long bytes;
+    time_t oldest_local;    // earliest mail originated here, 0 if none
+    IdSet read;
+    std::map<std::string, int> bodies;      // body file -> copies it holds
+};
+
+/*
+    A body shared by the loaded copies of one message, and the body file
+    holding it, empty until a snapshot writes it.
+*/
+struct SharedBody
+{
+    BodyPtr body;
+    std::string file;
+    int copies = 0;
+};
+
+// A body file mapped while the inboxes referring to it load
+struct BodyFile
+{
+    MappedFile file;
+    SnapshotReader doc;
+};
+
+/*
+    One origin's log from its replay point, as read and checked by a
+    recovery reader. Commands point into the mapped files, which stay open
+    until the commands are applied.
+*/
+struct OriginReplay
+{
+    std::vector<std::unique_ptr<MappedFile>> legacy_files;
+    std::vector<std::unique_ptr<LogSegment>> segments;
+    std::vector<LogRecord> commands;
+};
+
+/*
+    Orders changes to a copy that replicas may apply in different orders:
+    by the command's timestamp, then by its identifier.
+*/
+struct UpdateStamp
+{
+    time_t timestamp = 0;
+    int origin = -1;
+    int index = 0;
+};
+
+inline bool operator<(const UpdateStamp& a, const UpdateStamp& b)
+{
+    return std::tie(a.timestamp, a.origin, a.index) < std::tie(b.timestamp, b.origin, b.index);
+}
+
+/*
+    The latest change to each flag of one user's copy of a message, and its
+    latest move. Each keeps the value of its latest change whatever order
+    changes arrive in, and changes made before the copy arrives apply when
+    it does.
+*/
+struct CopyUpdates
+{
+    uint8_t flags_known = 0;    // flags some change has set or cleared
+    uint8_t flags = 0;          // their values
+    UpdateStamp flag_stamps[MAIL_FLAG_BITS];
+    bool moved = false;
+    UpdateStamp move_stamp;
+    std::string folder;         // where the latest move put it
+    bool delivered = false;     // the copy has arrived here
+};
+
 void init();
+void load_config();
 void load_state();
 void write_state();
 void read_message();
+bool message_ready(int);
+void on_tick();
 void process_data_message();
 void process_membership_message();
 void add_log_entry(int, const UserCommand&);
 void process_backend_message();
 void process_new_email();
+void process_new_multi_email();
 void process_read_command();
 void process_delete_command();
+void process_flag_command();
+void process_list_command();
+bool valid_list_update(const ListMessage&);
+void process_folder_command();
+bool valid_folder_update(const FolderMessage&);
+bool valid_folder_name(const std::string&);
+bool valid_username(const std::string&);
+bool accept_username(uint32_t, const char *);
 void send_inbox_to_client();
+ResponseCache::Pages encode_listing(const std::string&, const InboxQuery&);
 void send_mail_to_client();
+void send_bodies_to_client();
+bool pack_body(BodiesMessage&, const StoredMail&);
+void send_search_results_to_client();
+void fill_inbox_header(InboxHeader&, const StoredMail&);
 void send_component_to_client();
+void send_stats_to_client();
+Quota quota_for(const std::string&);
+bool accept_within_quota(uint32_t, const char *, size_t);
+bool accept_mail(const MailMessage&, CommandPtr&);
+bool accept_multi_mail(MultiMailMessage, CommandPtr&);
+bool expand_lists(MultiMailMessage&);
+bool accept_recipients(MultiMailMessage&);
+bool requested_mailbox(uint32_t, const char *, const char *, std::string&);
+bool attachments_present(uint32_t, const AttachmentRef *, int);
+void process_put_blob();
+void send_blob_to_client();
 void process_connection_request();
 void process_command_message(bool queue = false);
-void apply_new_command(const std::shared_ptr<UserCommand>&);
-void apply_command_to_state(const std::shared_ptr<UserCommand>&);
-void add_command_to_queue(const std::shared_ptr<UserCommand>&);
-void broadcast_command(const std::shared_ptr<UserCommand>&);
-void apply_mail_message(const std::shared_ptr<UserCommand>&);
-void apply_read_message(const std::shared_ptr<UserCommand>&);
-void apply_delete_message(const std::shared_ptr<UserCommand>&);
+void apply_new_command(const CommandPtr&);
+void apply_command_to_state(const CommandPtr&);
+void add_command_to_queue(const CommandPtr&);
+void broadcast_command(const CommandPtr&);
+void apply_mail_message(const CommandPtr&);
+void apply_multi_mail_message(const CommandPtr&);
+void deliver_mail(const std::string&, const StoredMail&);
+void file_sent_copy(const std::string&, const std::vector<std::string>&, const StoredMail&);
+bool add_copy(const std::string&, StoredMail);
+bool remove_copy(const std::string&, const MessageIdentifier&);
+void attach_blobs(const MessageIdentifier&, const AttachmentRef *, int);
+void drop_unused_attachments(const MessageIdentifier&);
+void want_blob(const BlobHash&, int);
+void request_blob(const BlobHash&, int);
+void request_wanted_blobs();
+void serve_blob_request();
+void receive_blob_data();
+BodyPtr new_body();
+void release_unused_body(const BodyPtr&);
+void unstore_mail(const StoredMail&);
+void store_flags(const std::string&, const MessageIdentifier&);
+std::vector<std::string> resolve_recipients(const char (*)[MAX_USERNAME], int);
+void apply_list_message(const CommandPtr&);
+void apply_folder_message(const CommandPtr&);
+bool move_mail(const std::string&, const MessageIdentifier&, const std::string&);
+std::string mailbox_key(const std::string&, const std::string&);
+std::string owner_of(const std::string&);
+std::string folder_of(const std::string&, const MessageIdentifier&);
+std::string key_of(const std::string&, const MessageIdentifier&);
+std::vector<std::string> mailbox_keys(const std::string&);
+bool folder_exists(const std::string&, const std::string&);
+void unfile_mail(const std::string&, const std::string&, const MessageIdentifier&);
+bool take_pending(PendingSets&, const std::string&, const MessageIdentifier&);
+void apply_read_message(const CommandPtr&);
+bool mark_read(const std::string&, const MessageIdentifier&);
+void mark_read_locally(const std::string&, const MessageIdentifier&);
+void replay_read_journal();
+bool marked_read(const std::string&, const MessageIdentifier&);
+bool take_read_marks(FlagMessage&);
+void flush_read_marks();
+std::map<std::string, IdSet> collect_read_state();
+int read_summary_bucket(const std::string&);
+uint64_t read_range_digest(const std::string&, int, int, int);
+void broadcast_read_state();
+void merge_read_summary();
+void exchange_read_state();
+void clear_read_summaries();
+void send_read_ranges(const std::string&, const IdSet&);
+void merge_read_delta();
+void flag_read_range(const std::string&, int, int, int);
+void flag_read_range_in(const std::string&, int, int, int);
+void apply_delete_message(const CommandPtr&);
+void apply_flag_message(const CommandPtr&);
+void record_flag_change(CopyUpdates&, const UpdateStamp&, uint8_t, uint8_t);
+CopyUpdates * find_copy_updates(const std::string&, const MessageIdentifier&);
+std::string apply_copy_updates(const std::string&, StoredMail&, const std::string&);
+bool file_copy(const std::string&, const std::string&, const StoredMail&);
+void forget_copy_updates(const std::string&, const MessageIdentifier&);
+void expire_copy_updates(int, int);
+void apply_expire_message(const CommandPtr&);
+long retention_for(const std::string&);
+void schedule_expiry(const std::string&, const StoredMail&);
+void schedule_all_expiries();
+void expire_old_mail();
 void synchronize();
 void broadcast_knowledge();
 void copy_group_members();
@@ -52,6 +261,7 @@ void clear_synch_arrays();
 void update_knowledge();
 void collect_garbage();
 void erase_queue_up_to(int, int);
+void expire_pending(PendingSets&, int, int);
 bool different_block(int, int);
 void delete_file_block(int, int);
 void delete_file_block_by_index(int, int);
@@ -61,8 +271,8 @@ void send_my_messages();
 void count_my_synch_servers();
 void send_synch_commands();
 void broadcast_messages_from_queue(int, int);
-std::list<std::shared_ptr<UserCommand>>::iterator 
-    find_message_index(std::list<std::shared_ptr<UserCommand>>&, int);
+CommandQueue::iterator 
+    find_message_index(CommandQueue&, int);
 void apply_queued_updates();
 void end_connection(const std::string&);
 void goodbye();
@@ -74,42 +284,113 @@ bool message_sent_to_servers();
 bool connection_exists(uint32_t);
 bool is_server_memb_mess();
 
+void open_mail_store();
+void import_inboxes_to_store();
+void read_inboxes_from_store();
+void checkpoint_mail_store();
+void open_blob_store();
 void read_state_file();
 void read_inbox_state();
 void read_log_state();
 void repopulate_local_data();
 void read_log_files();
+void read_origin_log(int, int, OriginReplay&);
+void replay_logged_command(const LogRecord&);
+bool valid_logged_command(const LogRecord&);
+int read_log_segment(int, int, OriginReplay&);
+int read_legacy_log_file(int, int, OriginReplay&);
+int scrub_logs();
+void rebuild_search_index();
+Mailbox& inbox_for(const std::string&);
+Mailbox * find_inbox(const std::string&);
+void load_inbox(const std::string&);
+BodyPtr read_body(std::map<std::string, BodyFile>&, const std::string&,
+    const MessageIdentifier&);
+void share_body(const StoredMail&, const std::string&);
+void unshare_body(const MessageIdentifier&);
+void load_all_inboxes();
+void index_inbox(const std::string&, const Mailbox&);
 
-void write_inbox_state();
-void write_log_state();
+void mark_dirty(const std::string&);
+void write_dirty_inboxes();
+void write_body_file(const std::map<MessageIdentifier, SharedBody*>&);
+void release_body_files(const std::map<std::string, int>&);
+FILE * create_inbox_file(std::string&);
+void close_inbox_file(FILE *, const std::string&, bool);
+void remove_stale_inbox_files();
 
-std::multiset<InboxMessage>::iterator
-find_mail_by_id(const MessageIdentifier&, const std::string&);
-
-void write_command_to_log(const std::shared_ptr<UserCommand>&);
-std::string serialize_command(const std::shared_ptr<UserCommand>&);
-std::shared_ptr<UserCommand> deserialize_command(const char *);
+void write_command_to_log(const CommandPtr&);
+void commit_log();
+std::string serialize_command(const CommandPtr&);
+CommandPtr deserialize_command(const char *, size_t);
 std::string get_log_name(int, int);
+std::string get_legacy_log_name(int, int);
+
+void read_snapshot(const std::string&);
+void write_inbox_index(SnapshotWriter&);
+void read_inbox_files(const SnapshotReader&);
+void read_inbox_index(const SnapshotReader&);
+LazyInbox summarize_inbox(const Mailbox&);
+MailRefRecord mail_ref_record(SnapshotWriter&, const StoredMail&, const std::string&);
+BodyRecord body_record(SnapshotWriter&, const MessageIdentifier&, const MailBody&);
+StoredMail stored_mail_from_record(const SnapshotReader&, const MailRecord&);
+void write_stats(SnapshotWriter&);
+void write_lists(SnapshotWriter&);
+void read_lists(const SnapshotReader&);
+void write_folders(SnapshotWriter&);
+void read_folders(const SnapshotReader&);
+void write_attachments(SnapshotWriter&);
+void read_attachments(const SnapshotReader&);
+void write_pending_sets(SnapshotWriter&, SnapshotSection, const PendingSets&);
+void read_pending_sets(const SnapshotReader&, SnapshotSection, PendingSets&);
+void write_copy_updates(SnapshotWriter&);
+void write_moves(SnapshotWriter&);
+void read_copy_updates(const SnapshotReader&);
+void read_moves(const SnapshotReader&);
 
-ptree ptree_from_identifier(const MessageIdentifier&);
-ptree inbox_to_ptree(const std::pair<std::string, std::multiset<InboxMessage>>&);
-ptree write_inboxes_to_ptree();
-ptree write_pending_delete_to_ptree();
-ptree write_pending_read_to_ptree();
-ptree ptree_from_inbox(const std::multiset<InboxMessage>&);
-ptree ptree_from_inbox_message(const InboxMessage&);
+// Readers for JSON snapshots written before the binary format
+void read_legacy_inbox_state();
+void read_legacy_log_state();
+void load_legacy_inboxes(const ptree&);
+void read_lists_from_ptree(const ptree&);
+void read_folders_from_ptree(const ptree&);
+void read_attachments_from_ptree(const ptree&);
+void read_id_set_from_ptree(IdSet&, const ptree&);
+void read_pending_sets_from_ptree(PendingSets&, const ptree&);
 MessageIdentifier identifier_from_ptree(const ptree&);
+void extract_inboxes_to_state(const ptree&, const ptree&);
+void read_inbox_list_from_ptree(Mailbox&, const ptree&,
+    std::unordered_map<MessageIdentifier, BodyPtr, IdentifierHash>&);
+StoredMail stored_mail_from_ptree(const ptree&,
+    std::unordered_map<MessageIdentifier, BodyPtr, IdentifierHash>&);
+BodyPtr body_from_ptree(const ptree&);
 
-void extract_inboxes_to_state(const ptree&);
-std::multiset<InboxMessage> get_inbox_list_from_ptree(const ptree&);
-InboxMessage inbox_message_from_ptree(const ptree&);
+/*
+    The attachments of one message and how many stored copies of it remain.
+    Its blobs are released when the last copy goes.
+*/
+struct MessageAttachments
+{
+    std::vector<AttachmentRef> refs;
+    int copies = 0;
+};
 
 struct State
 {
     int knowledge[N_MACHINES][N_MACHINES];
     int safe_delivered[N_MACHINES];
     int applied_to_state[N_MACHINES];
-    std::unordered_map<std::string, std::multiset<InboxMessage>> inboxes;
-    std::set<MessageIdentifier> pending_delete;
-    std::set<MessageIdentifier> pending_read;
+    std::unordered_map<std::string, Mailbox> inboxes;
+    PendingSets pending_delete;
+    // Ids each user has read that are not yet known to be applied everywhere;
+    // merged from every replica and never ordered
+    PendingSets read_marks;
+    std::unordered_map<std::string, std::set<std::string>> lists;
+    // Each user's folders other than the inbox, with the ids filed in each.
+    // An id is in at most one of a user's folders, or else in the inbox.
+    std::unordered_map<std::string, std::map<std::string, IdSet>> folders;
+    std::map<MessageIdentifier, MessageAttachments> attachments;
+    // Flag changes and moves per user and message, kept while the copy exists or may
+    // still arrive
+    std::unordered_map<std::string, std::map<MessageIdentifier, CopyUpdates>> copy_updates;
 };
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <string>
 #include <unordered_set>
@@ -9,6 +10,7 @@
 #include <limits.h>
 #include <ctime>
 #include <chrono>
+#include <thread>
 
 static mailbox mbox;
 static int seq_num;
@@ -16,6 +18,7 @@ static char user[80];
 static char spread_name[80];
 static char private_group[MAX_GROUP_NAME];
 static char mess[MAX_MESS_LEN];
+static int mess_len;        // bytes of the last message received
 static char backend_mess[MAX_MESS_LEN];
 static char sender[MAX_GROUP_NAME];
 static char target_groups[MAX_MEMBERS][MAX_GROUP_NAME];
@@ -26,18 +29,18 @@ static membership_info  memb_info;
 static int endian_mismatch;
 static sp_time test_timeout;
 static int updates_since_serialize = 0;
+static bool replaying_log = false;      // no checkpoints while recovering
 static int changes_since_garbage_collection = 0;
 
-static std::list<std::shared_ptr<UserCommand>> synch_queue;
+static CommandQueue synch_queue;
 static std::unordered_set<std::string> client_connections;
 static std::unordered_set<int> clients;
 static std::string server_group = "all_servers_group";
 static std::string server_inbox;
 static int server_id;
 static int server_index;
-static std::ofstream outfile;
 
-static std::list<std::shared_ptr<UserCommand>> command_queue[N_MACHINES];
+static CommandQueue command_queue[N_MACHINES];
 
 // Used for synchronizing
 static int n_received;
@@ -56,22 +59,96 @@ static int start_index[N_MACHINES];         // Keep track of the first message
 static bool synchronizing = false;
 
 static std::string state_file;
+static std::string manifest_file;
+// Snapshots of earlier versions, binary and JSON, read once and replaced
+// by the manifest
 static std::string log_state_file;
 static std::string inbox_state_file;
+static std::string legacy_log_state_file;
+static std::string legacy_inbox_state_file;
 
 static State state;
 
+// Derived from state.inboxes; rebuilt on startup and kept current by apply_*
+static std::unordered_map<std::string, SearchIndex> search_indexes;
+
+// Loaded from CONFIG_FILE at startup
+static Quota default_quota = {0, 0};
+static std::unordered_map<std::string, Quota> quotas;
+static long default_retention = 0;
+static std::unordered_map<std::string, long> retentions;
+
+// Expiry deadlines for mail originated here, keyed on date_sent + retention
+static TimerWheel<ExpiryTimer> expiry_wheel;
+
+// Encoded listings and messages; entries are dropped by apply_*
+static ResponseCache response_cache;
+
+// Read marks made here since the last gossip flush
+static PendingSets unsent_reads;
+
+// Read state as of the last summary we sent, and the summaries received
+// from each server since the last membership change
+static std::map<std::string, IdSet> summary_reads;
+static ReadSummaryMessage read_summaries[N_MACHINES];
+static bool summary_received[N_MACHINES];
+
+// Read marks made here that no manifest records yet
+static ReadJournal read_journal;
+static std::string read_journal_file;
+
+// Inboxes kept in mapped files instead of the snapshot, if enabled
+static bool use_mail_store = false;
+static MailStore mail_store;
+
+// Attachment content, and blobs referenced by applied mail that are still
+// missing here, with the server to ask for each
+static BlobStore blob_store;
+static std::map<BlobHash, int> wanted_blobs;
+
+// Users in the snapshot whose inboxes are loaded on first access
+static std::unordered_map<std::string, LazyInbox> unloaded_inboxes;
+
+// Loaded mailboxes unchanged since their inbox file was written, and the
+// mailboxes changed since, whose files the next snapshot rewrites
+static std::unordered_map<std::string, LazyInbox> saved_inboxes;
+static std::unordered_set<std::string> dirty_inboxes;
+
+// Inbox files are numbered in the order they are written. Files the
+// manifest no longer names are removed once a new one is in place.
+static std::string inbox_dir;
+static long next_inbox_file = 0;
+static std::vector<std::string> obsolete_files;
+
+// Bodies of loaded copies by message, so copies share one body in memory
+// and in body files, and the copies in inbox files each body file holds.
+// A body file goes once no inbox file the manifest names refers to it.
+static std::map<MessageIdentifier, SharedBody> shared_bodies;
+static std::unordered_map<std::string, int> body_file_refs;
+
+// Commands are logged through open segments and committed once per batch;
+// acks sent and commands originated here while a batch is uncommitted
+// wait here until it is committed
+static LogWriter log_writer(N_MACHINES, FILE_BLOCK_SIZE, get_log_name);
+static std::vector<std::pair<uint32_t, std::string>> held_acks;
+static std::vector<CommandPtr> held_broadcasts;
+
+// Time each log commit takes, including its sync if the mode syncs
+static LatencyHistogram commit_latency;
+
 int main(int argc, char * argv[])
 {
     int ret;
 
-    if (argc != 2)
+    if (argc != 2 && !(argc == 3 && strcmp(argv[2], "--scrub") == 0))
     {
-        printf("Usage: ./server <id>\n");
+        printf("Usage: ./server <id> [--scrub]\n");
         exit(1);
     }
 
     server_id = std::stoi(argv[1]);
+    if (argc == 3)
+        return scrub_logs() == 0 ? 0 : 1;
     server_inbox = "server_" + std::string(argv[1]) + "_in";
 
     server_index = server_id - 1;
@@ -80,16 +157,28 @@ int main(int argc, char * argv[])
 
     while (true)
     {
-        read_message();
-
-        if (Is_regular_mess(service_type))
+        if (message_ready(TICK_INTERVAL))
         {
-            process_data_message();
-        }
-        else if (Is_membership_mess(service_type))
-        {
-            process_membership_message();
+            // Drain what has already arrived, so its commands share one
+            // log commit
+            int batch = 0;
+            do
+            {
+                read_message();
+
+                if (Is_regular_mess(service_type))
+                {
+                    process_data_message();
+                }
+                else if (Is_membership_mess(service_type))
+                {
+                    process_membership_message();
+                }
+            } while (++batch < MAX_LOG_BATCH && SP_poll(mbox) > 0);
         }
+
+        on_tick();
+        commit_log();
     }
 
     return 0;
@@ -114,17 +203,55 @@ void read_message()
         }
     }
     if (ret < 0) SP_error(ret);
+    mess_len = std::max(ret, 0);
+}
+
+/*
+    Waits up to `timeout` seconds for a message to arrive on the mailbox.
+*/
+bool message_ready(int timeout)
+{
+    if (SP_poll(mbox) > 0) return true;
+
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(mbox, &read_fds);
+    struct timeval tv = {timeout, 0};
+    return select(mbox + 1, &read_fds, nullptr, nullptr, &tv) > 0;
+}
+
+/*
+    Periodic work, run at least every TICK_INTERVAL seconds from the main
+    loop.
+*/
+void on_tick()
+{
+    expire_old_mail();
+    flush_read_marks();
+    if (log_writer.mode() == DURABILITY_INTERVAL && !read_journal.sync())
+    {
+        perror("Could not sync read journal");
+        exit(1);
+    }
 }
 
 void init()
 {
     int ret;
 
-    state_file = "state_" + std::to_string(server_id) + ".json";
-    log_state_file = "log_" + state_file;
-    inbox_state_file = "inbox_" + state_file;
-
+    state_file = "state_" + std::to_string(server_id);
+    manifest_file = "manifest_" + std::to_string(server_id) + ".snap";
+    inbox_dir = "inboxes_" + std::to_string(server_id);
+    read_journal_file = "reads_" + std::to_string(server_id) + ".journal";
+    log_state_file = "log_" + state_file + ".snap";
+    inbox_state_file = "inbox_" + state_file + ".snap";
+    legacy_log_state_file = "log_" + state_file + ".json";
+    legacy_inbox_state_file = "inbox_" + state_file + ".json";
+
+    load_config();
+    expiry_wheel.reset(time(nullptr));
     load_state();
+    print_pool_stats();
 
     sprintf(spread_name, std::to_string(PORT).c_str());
     sprintf(user, std::to_string(server_index).c_str());
@@ -188,15 +315,42 @@ void process_data_message()
             case (MessageType::MAIL):
                 process_new_email();
                 break;
+            case (MessageType::MULTI_MAIL):
+                process_new_multi_email();
+                break;
             case (MessageType::READ):
                 process_read_command();
                 break;
+            case (MessageType::FETCH_BODIES):
+                send_bodies_to_client();
+                break;
             case (MessageType::DELETE):
                 process_delete_command();
                 break;
+            case (MessageType::FLAG):
+                process_flag_command();
+                break;
+            case (MessageType::LIST_UPDATE):
+                process_list_command();
+                break;
+            case (MessageType::FOLDER):
+                process_folder_command();
+                break;
+            case (MessageType::PUT_BLOB):
+                process_put_blob();
+                break;
+            case (MessageType::GET_BLOB):
+                send_blob_to_client();
+                break;
             case (MessageType::SHOW_INBOX):
                 send_inbox_to_client();
                 break;
+            case (MessageType::SEARCH):
+                send_search_results_to_client();
+                break;
+            case (MessageType::MAILBOX_STATS):
+                send_stats_to_client();
+                break;
             case (MessageType::SHOW_COMPONENT): {
                 send_component_to_client();
                 break;
@@ -210,6 +364,12 @@ void process_data_message()
 
 void send_ack(uint32_t session_id, const char * msg)
 {
+    if (log_writer.uncommitted() > 0 || read_journal.uncommitted() > 0)
+    {
+        held_acks.emplace_back(session_id, msg);
+        return;
+    }
+
     ServerResponse res;
     std::string client_name = client_connection_from_id(session_id);
 
@@ -238,6 +398,14 @@ void process_membership_message()
     {
         synchronize();
         apply_queued_updates();
+        broadcast_read_state();
+        request_wanted_blobs();
+        print_pool_stats();
+        commit_latency.print_summary(stdout,
+            ("log commit (" + std::string(durability_name(log_writer.mode())) + ")").c_str());
+        printf("response cache: %zu entries, %zu bytes, %zu hits, %zu misses\n",
+            response_cache.entries(), response_cache.bytes(),
+            response_cache.hits(), response_cache.misses());
     }
     else if (client_connections.find(std::string(sender)) != client_connections.end())
     {
@@ -258,6 +426,18 @@ void process_backend_message()
         case MessageType::COMMAND:
             process_command_message();
             break;
+        case MessageType::READ_DELTA:
+            merge_read_delta();
+            break;
+        case MessageType::READ_SUMMARY:
+            merge_read_summary();
+            break;
+        case MessageType::FETCH_BLOB:
+            serve_blob_request();
+            break;
+        case MessageType::BLOB_DATA:
+            receive_blob_data();
+            break;
         default:
             break;
     }
@@ -265,9 +445,12 @@ void process_backend_message()
 
 void process_command_message(bool queue)
 {
-    UserCommand* msg = reinterpret_cast<UserCommand*>(mess);
-    std::shared_ptr<UserCommand> command 
-        = std::make_shared<UserCommand>(*msg);
+    CommandPtr command = deserialize_command(mess, mess_len);
+    if (!command)
+    {
+        std::cerr << "Malformed command from " << sender << std::endl;
+        return;
+    }
     if (queue)
     {
         synch_queue.push_back(command);
@@ -280,35 +463,150 @@ void process_command_message(bool queue)
 
 void process_new_email()
 {
-    std::shared_ptr<UserCommand> mail_command = std::make_shared<UserCommand>();
+    CommandPtr mail_command = CommandPtr::make();
+    if (!accept_mail(*reinterpret_cast<MailMessage*>(mess), mail_command))
+        return;
 
     mail_command->id.origin = server_index;
     mail_command->id.index = state.knowledge[server_index][server_index] + 1;
 
-    mail_command->data = *reinterpret_cast<MailMessage*>(mess);
     auto temptime = std::chrono::system_clock::now();
     mail_command->timestamp = std::chrono::system_clock::to_time_t(temptime);
     apply_new_command(mail_command);
 }
 
-void process_read_command()
+void process_new_multi_email()
 {
-    send_mail_to_client();
-    std::shared_ptr<UserCommand> read_command = std::make_shared<UserCommand>();
+    CommandPtr mail_command = CommandPtr::make();
+    if (!accept_multi_mail(*reinterpret_cast<MultiMailMessage*>(mess), mail_command))
+        return;
+
+    mail_command->id.origin = server_index;
+    mail_command->id.index = state.knowledge[server_index][server_index] + 1;
+
+    auto temptime = std::chrono::system_clock::now();
+    mail_command->timestamp = std::chrono::system_clock::to_time_t(temptime);
+    apply_new_command(mail_command);
+}
+
+void process_list_command()
+{
+    if (!valid_list_update(*reinterpret_cast<ListMessage*>(mess)))
+        return;
 
-    read_command->id.origin = server_index;
-    read_command->id.index = state.knowledge[server_index][server_index] + 1;
+    CommandPtr list_command = CommandPtr::make();
 
-    read_command->data = *reinterpret_cast<ReadMessage*>(mess);
+    list_command->id.origin = server_index;
+    list_command->id.index = state.knowledge[server_index][server_index] + 1;
+
+    list_command->data = *reinterpret_cast<ListMessage*>(mess);
+    auto temptime = std::chrono::system_clock::now();
+    list_command->timestamp = std::chrono::system_clock::to_time_t(temptime);
+    apply_new_command(list_command);
+}
+
+/*
+    Rejects, with an ack, list updates that would be ignored when applied.
+*/
+bool valid_list_update(const ListMessage& msg)
+{
+    if (msg.list[0] != LIST_PREFIX || strlen(msg.list) < 2
+        || msg.member[0] == LIST_PREFIX || !valid_username(msg.member))
+    {
+        char temp[100];
+        sprintf(temp, "list names must start with %c and members must be users", 
+            LIST_PREFIX);
+        send_ack(msg.session_id, temp);
+        return false;
+    }
+    return true;
+}
+
+void process_folder_command()
+{
+    if (!valid_folder_update(*reinterpret_cast<FolderMessage*>(mess)))
+        return;
+
+    CommandPtr folder_command = CommandPtr::make();
+
+    folder_command->id.origin = server_index;
+    folder_command->id.index = state.knowledge[server_index][server_index] + 1;
+
+    folder_command->data = *reinterpret_cast<FolderMessage*>(mess);
     auto temptime = std::chrono::system_clock::now();
-    read_command->timestamp = std::chrono::system_clock::to_time_t(temptime);
+    folder_command->timestamp = std::chrono::system_clock::to_time_t(temptime);
+    apply_new_command(folder_command);
+}
+
+/*
+    Rejects, with an ack, folder names that cannot be stored and moves into
+    folders that were never created.
+*/
+bool valid_folder_update(const FolderMessage& msg)
+{
+    std::string folder(msg.folder, strnlen(msg.folder, MAX_FOLDER));
+    if (!valid_folder_name(folder))
+    {
+        char temp[100];
+        sprintf(temp, "folder names must be 1 to %d characters without %c",
+            MAX_FOLDER - 1, FOLDER_SEPARATOR);
+        send_ack(msg.session_id, temp);
+        return false;
+    }
+    if (msg.op == FolderOp::MOVE_TO_FOLDER && !folder_exists(msg.username, folder))
+    {
+        send_ack(msg.session_id, "no such folder");
+        return false;
+    }
+    return true;
+}
 
-    apply_new_command(read_command);
+bool valid_folder_name(const std::string& folder)
+{
+    return !folder.empty() && folder.size() < MAX_FOLDER
+        && folder.find(FOLDER_SEPARATOR) == std::string::npos;
+}
+
+/*
+    A user's folders are keyed `user/folder`, so a user name holding the
+    separator would name another user's folder.
+*/
+bool valid_username(const std::string& user)
+{
+    return !user.empty() && user.find(FOLDER_SEPARATOR) == std::string::npos;
+}
+
+/*
+    Acks and returns false if `user`, a sender or recipient, is not a valid
+    user name.
+*/
+bool accept_username(uint32_t session_id, const char * user)
+{
+    if (valid_username(std::string(user, strnlen(user, MAX_USERNAME)))) return true;
+
+    char temp[100];
+    snprintf(temp, sizeof(temp), "user names must not be empty or contain %c",
+        FOLDER_SEPARATOR);
+    send_ack(session_id, temp);
+    return false;
+}
+
+/*
+    Reads need no ordering, so they are applied here and gossiped on the
+    next tick instead of becoming commands.
+*/
+void process_read_command()
+{
+    send_mail_to_client();
+
+    ReadMessage * msg = reinterpret_cast<ReadMessage*>(mess);
+    mark_read_locally(msg->username, msg->id);
+    send_ack(msg->session_id, "read email");
 }
 
 void process_delete_command()
 {
-    std::shared_ptr<UserCommand> delete_command = std::make_shared<UserCommand>();
+    CommandPtr delete_command = CommandPtr::make();
 
     delete_command->id.origin = server_index;
     delete_command->id.index = state.knowledge[server_index][server_index] + 1;
@@ -320,7 +618,25 @@ void process_delete_command()
     apply_new_command(delete_command);
 }
 
-void apply_new_command(const std::shared_ptr<UserCommand>& command)
+void process_flag_command()
+{
+    FlagMessage msg = *reinterpret_cast<FlagMessage*>(mess);
+    if (!take_read_marks(msg))
+        return;
+
+    CommandPtr flag_command = CommandPtr::make();
+
+    flag_command->id.origin = server_index;
+    flag_command->id.index = state.knowledge[server_index][server_index] + 1;
+
+    flag_command->data = msg;
+    auto temptime = std::chrono::system_clock::now();
+    flag_command->timestamp = std::chrono::system_clock::to_time_t(temptime);
+
+    apply_new_command(flag_command);
+}
+
+void apply_new_command(const CommandPtr& command)
 {
     if (command->id.index != state.knowledge[server_index][command->id.origin] + 1) return;
 
@@ -328,11 +644,12 @@ void apply_new_command(const std::shared_ptr<UserCommand>& command)
 
     apply_command_to_state(command);
 
+    // Commands that originate on this server are broadcast once logged for good
     if (command->id.origin == server_index)
-        broadcast_command(command); // Broadcast commands that originate on this server
+        held_broadcasts.push_back(command);
 }
 
-void apply_command_to_state(const std::shared_ptr<UserCommand>& command)
+void apply_command_to_state(const CommandPtr& command)
 {
     ++state.knowledge[server_index][command->id.origin];
     ++state.applied_to_state[command->id.origin];
@@ -343,6 +660,10 @@ void apply_command_to_state(const std::shared_ptr<UserCommand>& command)
     {
         apply_mail_message(command);
     }
+    else if (std::holds_alternative<MultiMailMessage>(command->data))
+    {
+        apply_multi_mail_message(command);
+    }
     else if (std::holds_alternative<ReadMessage>(command->data))
     {
         apply_read_message(command);
@@ -351,9 +672,25 @@ void apply_command_to_state(const std::shared_ptr<UserCommand>& command)
     {
         apply_delete_message(command);
     }
+    else if (std::holds_alternative<FlagMessage>(command->data))
+    {
+        apply_flag_message(command);
+    }
+    else if (std::holds_alternative<ExpireMessage>(command->data))
+    {
+        apply_expire_message(command);
+    }
+    else if (std::holds_alternative<ListMessage>(command->data))
+    {
+        apply_list_message(command);
+    }
+    else if (std::holds_alternative<FolderMessage>(command->data))
+    {
+        apply_folder_message(command);
+    }
 
     ++updates_since_serialize;
-    if (updates_since_serialize >= MAX_UPDATES_BW_SERIALIZE)
+    if (updates_since_serialize >= MAX_UPDATES_BW_SERIALIZE && !replaying_log)
     {
         write_state();
         broadcast_knowledge();
@@ -361,770 +698,3659 @@ void apply_command_to_state(const std::shared_ptr<UserCommand>& command)
     }
 }
 
-void add_command_to_queue(const std::shared_ptr<UserCommand>& command)
+void add_command_to_queue(const CommandPtr& command)
 {
     command_queue[command->id.origin].push_back(command);   
 }
 
-void apply_mail_message(const std::shared_ptr<UserCommand>& command)
+void apply_mail_message(const CommandPtr& command)
 {
     const MailMessage& msg = std::get<MailMessage>(command->data);
 
-    InboxMessage new_mail;
-    strcpy(new_mail.msg.to, msg.to);
-    strcpy(new_mail.msg.from, msg.username);
-    strcpy(new_mail.msg.subject, msg.subject);
-    strcpy(new_mail.msg.message, msg.message);
-    new_mail.msg.date_sent = command->timestamp;
+    StoredMail new_mail;
     new_mail.id = command->id;
-    new_mail.msg.read = false;
-
-    if (state.pending_delete.find(command->id) != state.pending_delete.end())
+    new_mail.date_sent = command->timestamp;
+    new_mail.flags = 0;
+    new_mail.body = new_body();
+    strcpy(new_mail.body->from, msg.username);
+    strcpy(new_mail.body->subject, msg.subject);
+    strcpy(new_mail.body->message, msg.message);
+
+    attach_blobs(command->id, msg.attachments, msg.n_attachments);
+    std::vector<std::string> recipients = resolve_recipients(&msg.to, 1);
+    for (const auto& recipient : recipients)
     {
-        state.pending_delete.erase(command->id);
-        return;
+        deliver_mail(recipient, new_mail);
     }
+    file_sent_copy(msg.username, recipients, new_mail);
+    release_unused_body(new_mail.body);
+    drop_unused_attachments(command->id);
+    
+    char temp[100];
+    strcpy(temp, "mail sent");
+    send_ack(msg.session_id, temp);
+}
 
-    if (state.pending_read.find(command->id) != state.pending_read.end())
+/*
+    Every recipient's copy references the same body and shares the command's
+    identifier.
+*/
+void apply_multi_mail_message(const CommandPtr& command)
+{
+    const MultiMailMessage& msg = std::get<MultiMailMessage>(command->data);
+
+    StoredMail new_mail;
+    new_mail.id = command->id;
+    new_mail.date_sent = command->timestamp;
+    new_mail.flags = 0;
+    new_mail.body = new_body();
+    strcpy(new_mail.body->from, msg.username);
+    strcpy(new_mail.body->subject, msg.subject);
+    strcpy(new_mail.body->message, msg.message);
+
+    attach_blobs(command->id, msg.attachments, msg.n_attachments);
+    int n = std::min(std::max(msg.n_recipients, 0), MAX_RECIPIENTS);
+    std::vector<std::string> recipients = resolve_recipients(msg.to, n);
+    for (const auto& recipient : recipients)
     {
-        new_mail.msg.read = true;
-        state.pending_read.erase(command->id);
+        deliver_mail(recipient, new_mail);
     }
+    file_sent_copy(msg.username, recipients, new_mail);
+    release_unused_body(new_mail.body);
+    drop_unused_attachments(command->id);
 
-    state.inboxes[std::string(new_mail.msg.to)].insert(new_mail);
-    
     char temp[100];
-    strcpy(temp, "mail sent");
+    sprintf(temp, "mail sent to %zu recipients", recipients.size());
     send_ack(msg.session_id, temp);
 }
 
-void apply_read_message(const std::shared_ptr<UserCommand>& command)
+/*
+    Adds one recipient's copy of a message to their inbox, unless a delete
+    for it arrived first, with any reads, flag changes and moves that did.
+*/
+void deliver_mail(const std::string& to, const StoredMail& mail)
 {
-    const ReadMessage& msg = std::get<ReadMessage>(command->data);
-    bool exist = false;
-    auto it = find_mail_by_id(msg.id, msg.username);
-    if (it != state.inboxes[msg.username].end())
+    if (take_pending(state.pending_delete, to, mail.id))
     {
-        exist = true;
-        InboxMessage new_msg = *it;
-        state.inboxes[msg.username].erase(*it);
-        new_msg.msg.read = true;
-        state.inboxes[msg.username].insert(new_msg);
+        forget_copy_updates(to, mail.id);
+        return;
     }
-    if (!exist) {
-        state.pending_read.insert(msg.id);
+
+    StoredMail copy = mail;
+    if (marked_read(to, mail.id))
+    {
+        copy.flags |= MAIL_READ;
     }
-    send_ack(msg.session_id, "read email");
+    file_copy(to, apply_copy_updates(to, copy, INBOX_FOLDER), copy);
 }
 
-void apply_delete_message(const std::shared_ptr<UserCommand>& command)
+/*
+    Files a read copy of outgoing mail in the sender's SENT_FOLDER, sharing
+    the body. Mail to oneself is already in the sender's inbox, and a user
+    has one copy of each message.
+*/
+void file_sent_copy(const std::string& sender, const std::vector<std::string>& recipients,
+    const StoredMail& mail)
 {
-    const DeleteMessage& msg = std::get<DeleteMessage>(command->data);
-    bool exist = false;
-
-    auto it = find_mail_by_id(msg.id, msg.username);
-    if (it != state.inboxes[msg.username].end())
-        exist = true;
-    
-    if (!exist) {
-        state.pending_delete.insert(msg.id);
-        printf("adding to pending delete\n");
-        char temp[100];
-        strcpy(temp, "could not find to delete");
-        send_ack(msg.session_id, temp);
-    } else {
-        state.inboxes[msg.username].erase(*it);
-        char temp[100];
-        strcpy(temp, "successfully deleted");
-        send_ack(msg.session_id, temp);
+    if (std::find(recipients.begin(), recipients.end(), sender) != recipients.end())
+        return;
+    if (take_pending(state.pending_delete, sender, mail.id))
+    {
+        forget_copy_updates(sender, mail.id);
+        return;
     }
+
+    StoredMail copy = mail;
+    copy.flags |= MAIL_READ;
+    file_copy(sender, apply_copy_updates(sender, copy, SENT_FOLDER), copy);
 }
 
-void broadcast_command(const std::shared_ptr<UserCommand>& command)
+/*
+    Adds a new copy to one of `user`'s folders. Returns false if the user
+    already has it.
+*/
+bool file_copy(const std::string& user, const std::string& folder, const StoredMail& copy)
 {
-    SP_multicast(mbox, AGREED_MESS, server_group.c_str(),
-        MessageType::COMMAND, sizeof(*command),
-        reinterpret_cast<const char *>(&(*command)));
+    if (!add_copy(mailbox_key(user, folder), copy)) return false;
+    if (folder != INBOX_FOLDER)
+        state.folders[user][folder].insert(copy.id);
+    return true;
 }
 
-void send_inbox_to_client()
+/*
+    Adds a copy to the mailbox `key` with everything derived from it.
+    Returns false if the mailbox already holds the message.
+*/
+bool add_copy(const std::string& key, StoredMail copy)
 {
-    GetInboxMessage *msg = reinterpret_cast<GetInboxMessage*>(mess);
-    std::string uname = msg->username;
-    std::string client_name = client_inbox_from_id(msg->session_id);
-    
-    ServerInboxResponse res;
-    int counter = 0;
-    for (const auto& i: state.inboxes[uname]) {
-        strcpy(res.inbox[counter].subject, i.msg.subject);
-        strcpy(res.inbox[counter].sender, i.msg.from);
-        res.inbox[counter].read = i.msg.read;
-        res.inbox[counter].id.index = i.id.index;
-        res.inbox[counter].id.origin = i.id.origin;
-        res.inbox[counter].timestamp = i.msg.date_sent;
-        if (counter >= INBOX_LIMIT) {
-            res.mail_count = counter;
-            SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
-            MessageType::INBOX, sizeof(res), 
-            reinterpret_cast<const char *>(&res));
-            counter = -1;
-        }
-        counter++;
+    // A header for a copy already held would reference, then free, a body
+    // this caller still holds
+    Mailbox& box = inbox_for(key);
+    if (box.find(copy.id) != nullptr)
+    {
+        // A replayed message the store kept past the manifest: its copies
+        // count for the attachment entry the replay made afresh
+        auto attached = state.attachments.find(copy.id);
+        if (replaying_log && attached != state.attachments.end())
+            ++attached->second.copies;
+        return false;
     }
-    res.mail_count = counter;
-    SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
-    MessageType::INBOX, sizeof(res), 
-    reinterpret_cast<const char *>(&res));
 
-    char temp[100];
-    strcpy(temp, "retreived inbox");
-    send_ack(msg->session_id, temp);
+    if (use_mail_store)
+        copy.slot = mail_store.add_header(key, copy);
+    box.insert(copy);
+    mark_dirty(key);
+    if (!use_mail_store)
+        share_body(copy, "");
+    response_cache.invalidate_listings(key);
+    search_indexes[key].add(copy);
+    schedule_expiry(key, copy);
+    auto attached = state.attachments.find(copy.id);
+    if (attached != state.attachments.end())
+        ++attached->second.copies;
+    return true;
 }
 
-void send_mail_to_client()
+/*
+    Removes a copy from the mailbox `key` with everything derived from it.
+    Returns false if it was not there.
+*/
+bool remove_copy(const std::string& key, const MessageIdentifier& id)
 {
-    ReadMessage *msg = reinterpret_cast<ReadMessage*>(mess);
-    std::string uname = msg->username;
-    std::string client_name = client_inbox_from_id(msg->session_id);
-    
-    ServerResponse res;
-    bool exist = false;
-    for (const auto& i: state.inboxes[uname]) {
-        if (i.id == msg->id) {
-            res.data = i;
-            SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
-            MessageType::RESPONSE, sizeof(res), 
-            reinterpret_cast<const char *>(&res));
-            exist = true;
-        }
-    }
-    if (!exist) 
+    response_cache.invalidate(key, id);
+    Mailbox& box = inbox_for(key);
+    const StoredMail * mail = box.find(id);
+    if (mail == nullptr) return false;
+
+    search_indexes[key].remove(*mail);
+    unstore_mail(*mail);
+    box.erase(id);
+    mark_dirty(key);
+    if (!use_mail_store)
+        unshare_body(id);
+
+    auto attached = state.attachments.find(id);
+    if (attached != state.attachments.end())
     {
-        char temp[100];
-        strcpy(temp, "couldnt find ");
-        strcat(temp, std::to_string((*(state.inboxes[uname].begin())).id.origin).c_str());
-        strcat(temp, std::to_string((*(state.inboxes[uname].begin())).id.index).c_str());
-        send_ack(msg->session_id, temp);
+        --attached->second.copies;
+        drop_unused_attachments(id);
     }
+    return true;
 }
 
-void send_component_to_client()
+/*
+    Records a new message's attachments before its copies are delivered.
+    Every replica references the blobs; one that lacks a blob fetches it
+    from the mail's origin, which checked it was uploaded.
+*/
+void attach_blobs(const MessageIdentifier& id, const AttachmentRef * refs, int n)
 {
-    GetComponentMessage *msg = reinterpret_cast<GetComponentMessage*>(mess);
-    std::string client_name = client_inbox_from_id(msg->session_id);
+    n = std::min(std::max(n, 0), MAX_ATTACHMENTS);
+    if (n == 0) return;
 
-    ServerResponse res;
-    ComponentMessage comp;
-    comp.num_servers = n_synching;
-    int index = 0;
-    for (int j = 0; j < 5; j++) {
-        if (servers_present[j]) {
-            strcpy(comp.names[index], synch_members[j]);
-            index++;
-        }
+    // A replayed message already in the attachment table has its refs,
+    // counted by open_blob_store
+    if (state.attachments.count(id)) return;
+
+    MessageAttachments& attached = state.attachments[id];
+    attached.refs.assign(refs, refs + n);
+    for (const auto& ref : attached.refs)
+    {
+        blob_store.add_ref(ref.hash);
+        if (!blob_store.contains(ref.hash))
+            want_blob(ref.hash, id.origin);
     }
-    res.data = comp;
-    SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
-            MessageType::COMPONENT, sizeof(res), 
-            reinterpret_cast<const char *>(&res));
-    char temp [100];
-    strcpy(temp, "total num of servers: ");
-    strcat(temp, std::to_string(comp.num_servers).c_str());
-    send_ack(msg->session_id, temp);
 }
 
-void process_connection_request()
+/*
+    Releases the blobs of a message no copy refers to any more; the blob
+    files go at the next garbage collection.
+*/
+void drop_unused_attachments(const MessageIdentifier& id)
 {
-    ConnectMessage * msg = reinterpret_cast<ConnectMessage*>(mess);
-    std::string conn_group = "client_" + std::to_string(msg->session_id) + "_connect";
-    SP_join(mbox, conn_group.c_str());
-    client_connections.insert(conn_group);
+    auto attached = state.attachments.find(id);
+    if (attached == state.attachments.end() || attached->second.copies > 0)
+        return;
+
+    for (const auto& ref : attached->second.refs)
+        blob_store.release(ref.hash);
+    state.attachments.erase(attached);
 }
 
-void synchronize()
+/*
+    Requests are sent once connected; until then they wait for the first
+    membership change.
+*/
+void want_blob(const BlobHash& hash, int holder)
 {
-    synchronizing = true;
-    start:
-    copy_group_members();
-    broadcast_knowledge();
+    if (!wanted_blobs.emplace(hash, holder).second) return;
+    if (mbox > 0)
+        request_blob(hash, holder);
+}
 
-    // Check if another split occurred
-    if (!wait_for_everyone())
-        goto start;
-
-    send_my_messages();
-    synchronizing = false;
+void request_blob(const BlobHash& hash, int holder)
+{
+    BlobRequestMessage msg;
+    msg.type = MessageType::FETCH_BLOB;
+    msg.session_id = 0;
+    msg.hash = hash;
+    msg.holder = holder;
+    SP_multicast(mbox, AGREED_MESS, server_group.c_str(),
+        MessageType::FETCH_BLOB, sizeof(msg),
+        reinterpret_cast<const char *>(&msg));
 }
 
-void broadcast_knowledge()
+/*
+    After a membership change the servers able to answer may have changed.
+*/
+void request_wanted_blobs()
 {
-    KnowledgeMessage msg;
-    msg.sender = server_index;
-    for (int i = 0; i < N_MACHINES; i++)
+    for (auto it = wanted_blobs.begin(); it != wanted_blobs.end(); )
     {
-        for (int j = 0; j < N_MACHINES; j++)
+        if (blob_store.contains(it->first))
         {
-            msg.summary[i][j] = state.knowledge[i][j];
+            it = wanted_blobs.erase(it);
+            continue;
         }
+        request_blob(it->first, it->second);
+        ++it;
     }
+}
 
-    SP_multicast(mbox, AGREED_MESS, server_group.c_str(),
-        MessageType::KNOWLEDGE, sizeof(msg),
-        reinterpret_cast<const char *>(&msg));
+/*
+    Answers a FETCH_BLOB on the server group, so every server waiting for
+    the blob receives the one copy. Only the holder answers while it is in
+    our component.
+*/
+void serve_blob_request()
+{
+    const BlobRequestMessage * msg = reinterpret_cast<const BlobRequestMessage*>(mess);
+    bool holder_present = msg->holder >= 0 && msg->holder < N_MACHINES
+        && servers_present[msg->holder];
+    if (holder_present && msg->holder != server_index) return;
+
+    blob_store.for_each_chunk(msg->hash, MessageType::BLOB_DATA,
+        [](const BlobMessage& chunk) {
+            SP_multicast(mbox, AGREED_MESS, server_group.c_str(),
+                MessageType::BLOB_DATA, offsetof(BlobMessage, data) + chunk.length,
+                reinterpret_cast<const char *>(&chunk));
+        });
 }
 
-void copy_group_members()
+void receive_blob_data()
 {
-    for (int i = 0; i < n_connected; i++)
+    const BlobMessage * chunk = reinterpret_cast<const BlobMessage*>(mess);
+    if (!wanted_blobs.count(chunk->hash)) return;
+    if (blob_store.add_chunk(*chunk))
+        wanted_blobs.erase(chunk->hash);
+}
+
+/*
+    Allocates a body for new mail, in the mail store if one is used.
+*/
+BodyPtr new_body()
+{
+    if (use_mail_store)
+        return BodyPtr::stored(mail_store.add_body());
+    return BodyPtr::make();
+}
+
+/*
+    Frees a stored body that was delivered to nobody.
+*/
+void release_unused_body(const BodyPtr& body)
+{
+    if (body.store_slot() != NO_SLOT)
+        mail_store.release_if_unused(body.store_slot());
+}
+
+/*
+    Removes a copy from the mail store before it is erased from its inbox.
+*/
+void unstore_mail(const StoredMail& mail)
+{
+    if (mail.slot != NO_SLOT)
+        mail_store.remove_header(mail.slot);
+}
+
+/*
+    Writes a copy's flags through to the mail store after a change, or
+    marks its mailbox for the next snapshot.
+*/
+void store_flags(const std::string& key, const MessageIdentifier& id)
+{
+    mark_dirty(key);
+    if (!use_mail_store) return;
+
+    const StoredMail * mail = inbox_for(key).find(id);
+    if (mail != nullptr && mail->slot != NO_SLOT)
+        mail_store.set_flags(mail->slot, mail->flags);
+}
+
+/*
+    The users a mail command goes to, each once. Lists were expanded where
+    the mail entered the system (see expand_lists), so applying a command
+    never depends on list updates ordered around it. A list name, which
+    only commands logged before that carry, reaches nobody, as does a name
+    that is not a valid user name.
+*/
+std::vector<std::string> resolve_recipients(const char (*names)[MAX_USERNAME], int n)
+{
+    std::vector<std::string> recipients;
+    std::unordered_set<std::string> seen;
+    for (int i = 0; i < n; i++)
     {
-        strcpy(synch_members[i], target_groups[i]);
+        std::string name(names[i], strnlen(names[i], MAX_USERNAME));
+        if (name[0] != LIST_PREFIX && valid_username(name) && seen.insert(name).second)
+            recipients.push_back(name);
     }
+    return recipients;
 }
 
 /*
-    Receives a knowledge message from every server in the group except us.
-    If a serviceable command is received or connection is established, handle 
-    it immediately.
-    If an update command is received, stash it in the queue.
-    If a membership message is received from server_group while waiting, 
-    return false.
+    Lists are created by their first member and removed with their last.
 */
-bool wait_for_everyone()
+void apply_list_message(const CommandPtr& command)
 {
-    clear_synch_arrays();
+    const ListMessage& msg = std::get<ListMessage>(command->data);
+    if (msg.list[0] != LIST_PREFIX || msg.member[0] == LIST_PREFIX) return;
 
-    n_received = 1;
-    received[server_index] = true;
-    servers_present[server_index] = true;
-    n_synching = n_connected;
+    std::set<std::string>& members = state.lists[msg.list];
+    if (msg.op == ListOp::ADD_MEMBER)
+        members.insert(msg.member);
+    else
+        members.erase(msg.member);
 
-    while (n_received < n_synching)
+    char temp[100];
+    snprintf(temp, sizeof(temp), "%s has %zu members", msg.list, members.size());
+    if (members.empty())
+        state.lists.erase(msg.list);
+    send_ack(msg.session_id, temp);
+}
+
+/*
+    Moving into a folder creates it, so a move ordered before the create
+    on some replica still files the mail the same way everywhere. A copy
+    ends up where its latest move by UpdateStamp put it, whatever order
+    concurrent moves are applied in, and a move of mail that has not
+    arrived is kept until it does.
+*/
+void apply_folder_message(const CommandPtr& command)
+{
+    const FolderMessage& msg = std::get<FolderMessage>(command->data);
+    std::string folder(msg.folder, strnlen(msg.folder, MAX_FOLDER));
+    if (!valid_folder_name(folder)) return;
+
+    if (folder != INBOX_FOLDER)
+        state.folders[msg.username][folder];
+    if (msg.op == FolderOp::CREATE_FOLDER)
     {
-        read_message();
+        char temp[100];
+        snprintf(temp, sizeof(temp), "created folder %s", folder.c_str());
+        send_ack(msg.session_id, temp);
+        return;
+    }
 
-        if (Is_regular_mess(service_type))
+    UpdateStamp stamp{command->timestamp, command->id.origin, command->id.index};
+    int count = std::min(std::max(msg.count, 0), MAX_FLAG_BATCH);
+    int moved = 0;
+    for (int i = 0; i < count; i++)
+    {
+        CopyUpdates& updates = state.copy_updates[msg.username][msg.ids[i]];
+        if (!updates.moved || updates.move_stamp < stamp)
         {
-            switch (mess_type)
-            {
-                case MessageType::KNOWLEDGE:
-                    update_knowledge();
-                    mark_knowledge_as_received();
-                    break;
-                case MessageType::CONNECT:
-                    process_connection_request();
-                    break;
-                case MessageType::SHOW_INBOX:
-                    send_inbox_to_client();
-                    break;
-                case MessageType::SHOW_COMPONENT:
-                    send_component_to_client();
-                    break;
-                case MessageType::COMMAND:
-                    process_command_message(true);
-                    break;
-                case MessageType::MAIL:
-                case MessageType::READ:
-                case MessageType::DELETE:
-                    stash_command();
-                    break;
-                default:
-                    break;
-            }
+            updates.moved = true;
+            updates.move_stamp = stamp;
+            updates.folder = folder;
         }
-        else if (Is_reg_memb_mess(service_type))
-        {
-            if (is_server_memb_mess()) return false;
 
-            process_membership_message();
-        }
+        if (inbox_for(key_of(msg.username, msg.ids[i])).find(msg.ids[i]) == nullptr)
+            continue;
+        updates.delivered = true;
+        if (updates.folder == folder && move_mail(msg.username, msg.ids[i], folder))
+            ++moved;
     }
+
+    char temp[100];
+    snprintf(temp, sizeof(temp), "moved %d of %d emails to %s", moved, count,
+        folder.c_str());
+    send_ack(msg.session_id, temp);
+}
+
+/*
+    The copy is added to its new mailbox before it leaves the old one, so
+    a stored body never drops to zero references in between.
+*/
+bool move_mail(const std::string& user, const MessageIdentifier& id,
+    const std::string& folder)
+{
+    std::string from_folder = folder_of(user, id);
+    if (from_folder == folder) return false;
+
+    std::string from = mailbox_key(user, from_folder);
+    const StoredMail * mail = inbox_for(from).find(id);
+    if (mail == nullptr) return false;
+
+    StoredMail copy = *mail;
+    copy.slot = NO_SLOT;
+    add_copy(mailbox_key(user, folder), copy);
+    remove_copy(from, id);
+
+    unfile_mail(user, from_folder, id);
+    if (folder != INBOX_FOLDER)
+        state.folders[user][folder].insert(id);
     return true;
 }
 
-void clear_synch_arrays()
+/*
+    Inbox mail is kept under the user's own name, so everything keyed by
+    user before folders existed still names the inbox.
+*/
+std::string mailbox_key(const std::string& user, const std::string& folder)
 {
-    for (int i = 0; i < N_MACHINES; i++)
-    {
-        received[i] = false;
-        servers_present[i] = false;
-    }
+    if (folder.empty() || folder == INBOX_FOLDER)
+        return user;
+    return user + FOLDER_SEPARATOR + folder;
 }
 
-void update_knowledge()
+std::string owner_of(const std::string& key)
 {
-    KnowledgeMessage * msg = reinterpret_cast<KnowledgeMessage*>(mess);
+    return key.substr(0, key.find(FOLDER_SEPARATOR));
+}
 
-    for (int i = 0; i < N_MACHINES; i++)
+/*
+    The folder holding `id` for `user`; mail not filed anywhere else is in
+    the inbox.
+*/
+std::string folder_of(const std::string& user, const MessageIdentifier& id)
+{
+    auto folders = state.folders.find(user);
+    if (folders != state.folders.end())
     {
-        for (int j = 0; j < N_MACHINES; j++)
+        for (const auto& folder : folders->second)
         {
-            if (msg->summary[i][j] > state.knowledge[i][j])
-            {
-                state.knowledge[i][j] = msg->summary[i][j];
-                ++changes_since_garbage_collection;
-            }
+            if (folder.second.contains(id))
+                return folder.first;
         }
     }
+    return INBOX_FOLDER;
+}
 
-    ++changes_since_garbage_collection;
-    if (changes_since_garbage_collection >= MAX_CHANGES_BW_GARBAGE)
+std::string key_of(const std::string& user, const MessageIdentifier& id)
+{
+    return mailbox_key(user, folder_of(user, id));
+}
+
+/*
+    The inbox first, then every other folder of `user`.
+*/
+std::vector<std::string> mailbox_keys(const std::string& user)
+{
+    std::vector<std::string> keys{user};
+    auto folders = state.folders.find(user);
+    if (folders != state.folders.end())
     {
-        collect_garbage();
-        changes_since_garbage_collection = 0;
+        for (const auto& folder : folders->second)
+            keys.push_back(mailbox_key(user, folder.first));
     }
+    return keys;
 }
 
-void mark_knowledge_as_received()
+bool folder_exists(const std::string& user, const std::string& folder)
 {
-    KnowledgeMessage * msg = reinterpret_cast<KnowledgeMessage*>(mess);
+    if (folder.empty() || folder == INBOX_FOLDER) return true;
+    auto folders = state.folders.find(user);
+    return folders != state.folders.end() && folders->second.count(folder);
+}
 
-    // Need to check that this member is currently in our partition
-    // and we haven't received an update from them yet
-    if (sender_in_group() && received[msg->sender] == false)
+void unfile_mail(const std::string& user, const std::string& folder,
+    const MessageIdentifier& id)
+{
+    if (folder == INBOX_FOLDER) return;
+    auto folders = state.folders.find(user);
+    if (folders == state.folders.end()) return;
+    auto it = folders->second.find(folder);
+    if (it != folders->second.end())
+        it->second.erase(id);
+}
+
+/*
+    Removes a pending id for `user`. Snapshots written before pending sets
+    were kept per user hold their ids under the empty name.
+*/
+bool take_pending(PendingSets& sets, const std::string& user, const MessageIdentifier& id)
+{
+    auto it = sets.find(user);
+    if (it != sets.end() && it->second.erase(id))
+        return true;
+
+    auto legacy = sets.find("");
+    return legacy != sets.end() && legacy->second.erase(id);
+}
+
+/*
+    Only reached when replaying commands logged before reads were gossiped.
+*/
+void apply_read_message(const CommandPtr& command)
+{
+    const ReadMessage& msg = std::get<ReadMessage>(command->data);
+    mark_read(msg.username, msg.id);
+    send_ack(msg.session_id, "read email");
+}
+
+/*
+    Records that `user` has read `id`, flagging the message if it has
+    arrived. Returns false if the mark was already known.
+*/
+bool mark_read(const std::string& user, const MessageIdentifier& id)
+{
+    IdSet& marks = state.read_marks[user];
+    if (marks.contains(id)) return false;
+
+    marks.insert(id);
+    std::string key = key_of(user, id);
+    if (inbox_for(key).set_flags(id, MAIL_READ, 0))
+        store_flags(key, id);
+    response_cache.invalidate(key, id);
+    return true;
+}
+
+/*
+    A read made here is journalled, and its ack held until the journal is
+    committed with the log.
+*/
+void mark_read_locally(const std::string& user, const MessageIdentifier& id)
+{
+    if (mark_read(user, id))
     {
-        received[msg->sender] = true;
-        servers_present[msg->sender] = true;
-        ++n_received;
+        unsent_reads[user].insert(id);
+        read_journal.append(user, id);
     }
 }
 
-void collect_garbage()
+/*
+    Snapshots written before read marks were kept per user hold them under
+    the empty name.
+*/
+bool marked_read(const std::string& user, const MessageIdentifier& id)
 {
-    for (int i = 0; i < N_MACHINES; ++i)
+    auto it = state.read_marks.find(user);
+    if (it != state.read_marks.end() && it->second.contains(id))
+        return true;
+
+    auto legacy = state.read_marks.find("");
+    return legacy != state.read_marks.end() && legacy->second.contains(id);
+}
+
+/*
+    Moves the read bit of a client flag update into the gossiped read marks,
+    since read state only grows. Returns false if nothing is left to order
+    as a command, after acking the client.
+*/
+bool take_read_marks(FlagMessage& msg)
+{
+    int count = std::min(std::max(msg.count, 0), MAX_FLAG_BATCH);
+    if (msg.set & MAIL_READ)
     {
-        int min_index = INT_MAX;
-        for (int j = 0; j < N_MACHINES; ++j)
+        for (int i = 0; i < count; i++)
         {
-            min_index = std::min(min_index, state.knowledge[j][i]);
+            mark_read_locally(msg.username, msg.ids[i]);
         }
-        state.safe_delivered[i] = min_index;
-        erase_queue_up_to(i, min_index);
     }
+    msg.set &= ~MAIL_READ;
+    msg.clear &= ~MAIL_READ;
+    if (msg.set != 0 || msg.clear != 0)
+        return true;
+
+    char temp[100];
+    sprintf(temp, "updated %d emails", count);
+    send_ack(msg.session_id, temp);
+    return false;
+}
+
+/*
+    Sends each user's unsent read marks as READ_DELTA messages, coalescing
+    every mark made since the previous tick.
+*/
+void flush_read_marks()
+{
+    for (const auto& user : unsent_reads)
+    {
+        send_read_ranges(user.first, user.second);
+    }
+    unsent_reads.clear();
 }
 
-void erase_queue_up_to(int origin, int index)
+/*
+    Every read mark and every read message this replica holds, by owner.
+    Marks dropped by collect_garbage are covered by the message flags.
+*/
+std::map<std::string, IdSet> collect_read_state()
 {
-    auto& queue = command_queue[origin];
-    while (!queue.empty() && queue.front()->id.index <= index)
+    auto add_ranges = [](IdSet& to, const IdSet& from) {
+        from.for_each_range([&to](int origin, int first, int last) {
+            to.insert_range(origin, first, last);
+        });
+    };
+
+    // Every folder's read mail counts towards its owner's state
+    std::map<std::string, IdSet> read;
+    for (const auto& marks : state.read_marks)
+        add_ranges(read[marks.first], marks.second);
+    for (const auto& inbox : unloaded_inboxes)
+        add_ranges(read[owner_of(inbox.first)], inbox.second.read);
+    for (const auto& inbox : state.inboxes)
     {
-        if (different_block(origin, queue.front()->id.index))
+        IdSet& ids = read[owner_of(inbox.first)];
+        for (const auto& entry : inbox.second)
         {
-            write_state();
-            for (int i = current_block[origin]; 
-                i < queue.front()->id.index / FILE_BLOCK_SIZE; i++)
-            {
-                delete_file_block(origin, i);
-            }
-            current_block[origin] = index / FILE_BLOCK_SIZE;
+            if (entry.second.flags & MAIL_READ)
+                ids.insert(entry.second.id);
         }
-        queue.pop_front();
     }
+    return read;
 }
 
-bool different_block(int origin, int index)
+int read_summary_bucket(const std::string& user)
 {
-    return current_block[origin] != index / FILE_BLOCK_SIZE;
+    return crc32c(0, user.data(), user.size()) % READ_SUMMARY_BUCKETS;
 }
 
-void delete_file_block(int origin, int block)
+/*
+    Digest of one range of a user's read ids. Ranges are kept coalesced, so
+    equal sets have equal ranges and the sum of their digests matches.
+*/
+uint64_t read_range_digest(const std::string& user, int origin, int first, int last)
 {
-    int index = block * FILE_BLOCK_SIZE;
-    delete_file_block_by_index(origin, index);
+    uint64_t x = crc32c(0, user.data(), user.size());
+    x = x * 0x9e3779b97f4a7c15ULL + static_cast<uint32_t>(origin);
+    x = x * 0x9e3779b97f4a7c15ULL + static_cast<uint32_t>(first);
+    x = x * 0x9e3779b97f4a7c15ULL + static_cast<uint32_t>(last);
+    // splitmix64 finalizer
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
 }
 
-void delete_file_block_by_index(int origin, int index)
+/*
+    After a membership change, sends a summary of the read state this
+    replica holds: per origin and bucket of users, a count and a digest.
+    Once every server present has sent one, exchange_read_state sends only
+    the buckets they disagree on, so merged components converge even if
+    deltas were lost without every read id crossing the network again.
+*/
+void broadcast_read_state()
 {
-    const std::string filename = get_log_name(origin, index);
-    if (std::filesystem::exists(filename.c_str()));
-        remove(filename.c_str());
+    unsent_reads.clear();
+    summary_reads = collect_read_state();
+
+    ReadSummaryMessage msg;
+    msg.sender = server_index;
+    memset(msg.count, 0, sizeof(msg.count));
+    memset(msg.digest, 0, sizeof(msg.digest));
+    for (const auto& user : summary_reads)
+    {
+        int bucket = read_summary_bucket(user.first);
+        user.second.for_each_range([&](int origin, int first, int last) {
+            msg.count[origin][bucket] += last - first + 1;
+            msg.digest[origin][bucket] += read_range_digest(user.first, origin, first, last);
+        });
+    }
+
+    SP_multicast(mbox, AGREED_MESS, server_group.c_str(),
+        MessageType::READ_SUMMARY, sizeof(msg),
+        reinterpret_cast<const char *>(&msg));
 }
 
-bool sender_in_group()
+/*
+    Keeps a READ_SUMMARY, including our own, and exchanges read state once
+    every server present has sent one.
+*/
+void merge_read_summary()
 {
-    for (int i = 0; i < n_synching; i++)
+    const ReadSummaryMessage * msg = reinterpret_cast<const ReadSummaryMessage*>(mess);
+    if (msg->sender < 0 || msg->sender >= N_MACHINES) return;
+
+    read_summaries[msg->sender] = *msg;
+    summary_received[msg->sender] = true;
+    if (synchronizing) return;
+
+    for (int i = 0; i < N_MACHINES; i++)
     {
-        if (strcmp(sender, synch_members[i]) == 0)
+        if (servers_present[i] && !summary_received[i]) return;
+    }
+    exchange_read_state();
+}
+
+/*
+    Sends the read ranges of every origin and bucket on which the summaries
+    of the servers present differ. Every server holding ids there sends
+    them, so each one missing some receives them.
+*/
+void exchange_read_state()
+{
+    const ReadSummaryMessage& mine = read_summaries[server_index];
+    bool differs[N_MACHINES][READ_SUMMARY_BUCKETS] = {};
+    for (int i = 0; i < N_MACHINES; i++)
+    {
+        if (!servers_present[i]) continue;
+        const ReadSummaryMessage& theirs = read_summaries[i];
+        for (int origin = 0; origin < N_MACHINES; origin++)
+        {
+            for (int bucket = 0; bucket < READ_SUMMARY_BUCKETS; bucket++)
+            {
+                if (mine.count[origin][bucket] != theirs.count[origin][bucket]
+                    || mine.digest[origin][bucket] != theirs.digest[origin][bucket])
+                    differs[origin][bucket] = true;
+            }
+        }
+    }
+
+    for (const auto& user : summary_reads)
+    {
+        int bucket = read_summary_bucket(user.first);
+        IdSet ids;
+        user.second.for_each_range([&](int origin, int first, int last) {
+            if (differs[origin][bucket])
+                ids.insert_range(origin, first, last);
+        });
+        if (!ids.empty())
+            send_read_ranges(user.first, ids);
+    }
+    clear_read_summaries();
+}
+
+void clear_read_summaries()
+{
+    summary_reads.clear();
+    for (int i = 0; i < N_MACHINES; i++)
+        summary_received[i] = false;
+}
+
+void send_read_ranges(const std::string& user, const IdSet& ids)
+{
+    ReadDeltaMessage msg;
+    strncpy(msg.username, user.c_str(), MAX_USERNAME - 1);
+    msg.username[MAX_USERNAME - 1] = '\0';
+    msg.count = 0;
+
+    auto flush = [&msg]() {
+        SP_multicast(mbox, AGREED_MESS, server_group.c_str(),
+            MessageType::READ_DELTA, sizeof(msg),
+            reinterpret_cast<const char *>(&msg));
+        msg.count = 0;
+    };
+
+    ids.for_each_range([&msg, &flush](int origin, int first, int last) {
+        msg.ranges[msg.count++] = ReadRange{origin, first, last};
+        if (msg.count == MAX_READ_RANGES)
+            flush();
+    });
+    if (msg.count > 0)
+        flush();
+}
+
+/*
+    Merges a READ_DELTA, including our own. Ids at or below safe_delivered
+    have been applied everywhere, so only messages still present need
+    flagging and no mark is kept for them.
+*/
+void merge_read_delta()
+{
+    const ReadDeltaMessage * msg = reinterpret_cast<const ReadDeltaMessage*>(mess);
+    std::string user(msg->username, strnlen(msg->username, MAX_USERNAME));
+    int count = std::min(std::max(msg->count, 0), MAX_READ_RANGES);
+
+    for (int i = 0; i < count; i++)
+    {
+        const ReadRange& range = msg->ranges[i];
+        if (range.origin < 0 || range.origin >= N_MACHINES || range.first > range.last)
+            continue;
+
+        int safe = state.safe_delivered[range.origin];
+        if (range.last > safe)
+        {
+            state.read_marks[user].insert_range(range.origin,
+                std::max(range.first, safe + 1), range.last);
+        }
+        flag_read_range(user, range.origin, range.first, range.last);
+    }
+}
+
+/*
+    Flags the messages of `user` from `origin` with index in [first, last],
+    in every folder.
+*/
+void flag_read_range(const std::string& user, int origin, int first, int last)
+{
+    for (const auto& key : mailbox_keys(user))
+        flag_read_range_in(key, origin, first, last);
+}
+
+/*
+    Walks whichever of the range and the mailbox is smaller.
+*/
+void flag_read_range_in(const std::string& key, int origin, int first, int last)
+{
+    Mailbox * inbox = find_inbox(key);
+    if (inbox == nullptr) return;
+
+    std::vector<MessageIdentifier> ids;
+    if (static_cast<long long>(last) - first < static_cast<long long>(inbox->size()))
+    {
+        for (int index = first; index <= last; index++)
+            ids.push_back(MessageIdentifier{index, origin});
+    }
+    else
+    {
+        for (const auto& entry : *inbox)
+        {
+            const MessageIdentifier& id = entry.second.id;
+            if (id.origin == origin && id.index >= first && id.index <= last)
+                ids.push_back(id);
+        }
+    }
+
+    for (const auto& id : ids)
+    {
+        const StoredMail * mail = inbox->find(id);
+        if (mail == nullptr || (mail->flags & MAIL_READ)) continue;
+        inbox->set_flags(id, MAIL_READ, 0);
+        store_flags(key, id);
+        response_cache.invalidate(key, id);
+    }
+}
+
+void apply_delete_message(const CommandPtr& command)
+{
+    const DeleteMessage& msg = std::get<DeleteMessage>(command->data);
+    std::string folder = folder_of(msg.username, msg.id);
+
+    if (!remove_copy(mailbox_key(msg.username, folder), msg.id)) {
+        state.pending_delete[msg.username].insert(msg.id);
+        printf("adding to pending delete\n");
+        char temp[100];
+        strcpy(temp, "could not find to delete");
+        send_ack(msg.session_id, temp);
+    } else {
+        unfile_mail(msg.username, folder, msg.id);
+        forget_copy_updates(msg.username, msg.id);
+        char temp[100];
+        strcpy(temp, "successfully deleted");
+        send_ack(msg.session_id, temp);
+    }
+}
+
+/*
+    Applies one flag change to a batch of messages. Each flag takes the
+    value of its latest change by UpdateStamp, so replicas applying
+    concurrent changes in different orders agree, and a change to mail that
+    has not arrived is kept until it does. The read bit is carried by read
+    marks; it only appears here in commands logged before that, and is
+    merged as a mark so it also covers messages that have not arrived.
+*/
+void apply_flag_message(const CommandPtr& command)
+{
+    const FlagMessage& msg = std::get<FlagMessage>(command->data);
+    int count = std::min(std::max(msg.count, 0), MAX_FLAG_BATCH);
+
+    if (msg.set & MAIL_READ)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            mark_read(msg.username, msg.ids[i]);
+        }
+    }
+    uint8_t set = msg.set & ~MAIL_READ;
+    uint8_t clear = msg.clear & ~MAIL_READ;
+    char temp[100];
+    if (set == 0 && clear == 0)
+    {
+        sprintf(temp, "updated %d emails", count);
+        send_ack(msg.session_id, temp);
+        return;
+    }
+
+    UpdateStamp stamp{command->timestamp, command->id.origin, command->id.index};
+    int updated = 0;
+    for (int i = 0; i < count; i++)
+    {
+        CopyUpdates& updates = state.copy_updates[msg.username][msg.ids[i]];
+        record_flag_change(updates, stamp, set, clear);
+
+        std::string key = key_of(msg.username, msg.ids[i]);
+        if (inbox_for(key).set_flags(msg.ids[i], updates.flags & updates.flags_known,
+                ~updates.flags & updates.flags_known))
+        {
+            updates.delivered = true;
+            ++updated;
+            store_flags(key, msg.ids[i]);
+        }
+        response_cache.invalidate(key, msg.ids[i]);
+    }
+
+    sprintf(temp, "updated %d of %d emails", updated, count);
+    send_ack(msg.session_id, temp);
+}
+
+/*
+    Keeps, for each flag in `set` or `clear`, whichever is later of this
+    change and the one recorded. A flag in both is cleared, as
+    Mailbox::set_flags does.
+*/
+void record_flag_change(CopyUpdates& updates, const UpdateStamp& stamp, uint8_t set,
+    uint8_t clear)
+{
+    for (int bit = 0; bit < MAIL_FLAG_BITS; bit++)
+    {
+        uint8_t flag = 1 << bit;
+        if (!((set | clear) & flag)) continue;
+        if ((updates.flags_known & flag) && stamp < updates.flag_stamps[bit]) continue;
+
+        updates.flags_known |= flag;
+        updates.flag_stamps[bit] = stamp;
+        if (clear & flag)
+            updates.flags &= ~flag;
+        else
+            updates.flags |= flag;
+    }
+}
+
+CopyUpdates * find_copy_updates(const std::string& user, const MessageIdentifier& id)
+{
+    auto copies = state.copy_updates.find(user);
+    if (copies == state.copy_updates.end()) return nullptr;
+    auto it = copies->second.find(id);
+    return it == copies->second.end() ? nullptr : &it->second;
+}
+
+/*
+    Gives a copy about to be delivered the flag changes ordered before it
+    arrived. Returns the folder to file it in: that of its latest move, or
+    else `folder`.
+*/
+std::string apply_copy_updates(const std::string& user, StoredMail& copy,
+    const std::string& folder)
+{
+    CopyUpdates * updates = find_copy_updates(user, copy.id);
+    if (updates == nullptr) return folder;
+
+    copy.flags = (copy.flags & ~updates->flags_known) | (updates->flags & updates->flags_known);
+    updates->delivered = true;
+    return updates->moved ? updates->folder : folder;
+}
+
+/*
+    Drops the changes to a copy once it is deleted; a later change finds no
+    mail and is kept as undelivered until expire_copy_updates.
+*/
+void forget_copy_updates(const std::string& user, const MessageIdentifier& id)
+{
+    auto copies = state.copy_updates.find(user);
+    if (copies == state.copy_updates.end()) return;
+    copies->second.erase(id);
+    if (copies->second.empty())
+        state.copy_updates.erase(copies);
+}
+
+/*
+    Mail from `origin` up to `index` has been applied everywhere, so changes
+    and moves of copies of it that never arrived here were of deleted mail.
+*/
+void expire_copy_updates(int origin, int index)
+{
+    for (auto user = state.copy_updates.begin(); user != state.copy_updates.end(); )
+    {
+        auto& copies = user->second;
+        for (auto it = copies.begin(); it != copies.end(); )
+        {
+            if (!it->second.delivered && it->first.origin == origin
+                    && it->first.index <= index)
+                it = copies.erase(it);
+            else
+                ++it;
+        }
+        if (copies.empty())
+            user = state.copy_updates.erase(user);
+        else
+            ++user;
+    }
+}
+
+/*
+    Expiry commands only name mail from their own origin, which was applied
+    before them, so a missing message has already been deleted and needs no
+    pending entry. Ids are located in whichever folder holds them now.
+*/
+void apply_expire_message(const CommandPtr& command)
+{
+    const ExpireMessage& msg = std::get<ExpireMessage>(command->data);
+    int count = std::min(std::max(msg.count, 0), MAX_EXPIRE_BATCH);
+
+    for (int i = 0; i < count; i++)
+    {
+        std::string folder = folder_of(msg.username, msg.ids[i]);
+        if (remove_copy(mailbox_key(msg.username, folder), msg.ids[i]))
+        {
+            unfile_mail(msg.username, folder, msg.ids[i]);
+            forget_copy_updates(msg.username, msg.ids[i]);
+        }
+    }
+}
+
+long retention_for(const std::string& user)
+{
+    auto it = retentions.find(user);
+    return it == retentions.end() ? default_retention : it->second;
+}
+
+/*
+    Each server only expires mail it originated, so exactly one expiry
+    command is issued per message.
+*/
+void schedule_expiry(const std::string& key, const StoredMail& mail)
+{
+    if (mail.id.origin != server_index) return;
+
+    long retention = retention_for(owner_of(key));
+    if (retention <= 0) return;
+
+    expiry_wheel.schedule(mail.date_sent + retention, ExpiryTimer{key, mail.id});
+}
+
+/*
+    An unloaded inbox gets one timer for its oldest local mail; it is
+    loaded when that fires, which schedules the rest.
+*/
+void schedule_all_expiries()
+{
+    for (const auto& inbox : state.inboxes)
+    {
+        for (const auto& entry : inbox.second)
+        {
+            schedule_expiry(inbox.first, entry.second);
+        }
+    }
+
+    for (const auto& inbox : unloaded_inboxes)
+    {
+        long retention = retention_for(owner_of(inbox.first));
+        if (retention <= 0 || inbox.second.oldest_local == 0) continue;
+
+        ExpiryTimer timer;
+        timer.user = inbox.first;
+        timer.load = true;
+        expiry_wheel.schedule(inbox.second.oldest_local + retention, timer);
+    }
+}
+
+/*
+    Collects mail whose retention has run out and replicates its removal as
+    batched expiry commands through the normal command path.
+*/
+void expire_old_mail()
+{
+    std::unordered_map<std::string, std::vector<MessageIdentifier>> due;
+    std::vector<std::string> wake;
+    expiry_wheel.advance(time(nullptr), [&due, &wake](const ExpiryTimer& timer) {
+        if (timer.load)
+        {
+            wake.push_back(timer.user);
+            return;
+        }
+        auto it = state.inboxes.find(timer.user);
+        if (it != state.inboxes.end() && it->second.find(timer.id) != nullptr)
+            due[owner_of(timer.user)].push_back(timer.id);
+    });
+
+    // Loading schedules the inbox's own timers, which fire on the next tick
+    for (const auto& user : wake)
+        load_inbox(user);
+
+    for (const auto& user : due)
+    {
+        const std::vector<MessageIdentifier>& ids = user.second;
+        for (size_t first = 0; first < ids.size(); first += MAX_EXPIRE_BATCH)
+        {
+            CommandPtr expire_command = CommandPtr::make();
+            expire_command->id.origin = server_index;
+            expire_command->id.index = state.knowledge[server_index][server_index] + 1;
+            auto temptime = std::chrono::system_clock::now();
+            expire_command->timestamp = std::chrono::system_clock::to_time_t(temptime);
+
+            ExpireMessage expire;
+            strcpy(expire.username, user.first.c_str());
+            expire.count = std::min(ids.size() - first, size_t(MAX_EXPIRE_BATCH));
+            std::copy(ids.begin() + first, ids.begin() + first + expire.count, expire.ids);
+            expire_command->data = expire;
+
+            apply_new_command(expire_command);
+        }
+    }
+}
+
+/*
+    Commands go to the log and to other servers encoded, at the size of
+    what they hold rather than of the largest command.
+*/
+std::string serialize_command(const CommandPtr& command)
+{
+    std::string out;
+    encode_command(*command, out);
+    return out;
+}
+
+/*
+    Returns a null pointer if `data` is not a well formed command.
+*/
+CommandPtr deserialize_command(const char * data, size_t len)
+{
+    CommandPtr command = CommandPtr::make();
+    if (!decode_command(data, len, *command))
+        return CommandPtr();
+    return command;
+}
+
+void broadcast_command(const CommandPtr& command)
+{
+    std::string encoded = serialize_command(command);
+    SP_multicast(mbox, AGREED_MESS, server_group.c_str(),
+        MessageType::COMMAND, encoded.size(), encoded.data());
+}
+
+void send_inbox_to_client()
+{
+    GetInboxMessage *msg = reinterpret_cast<GetInboxMessage*>(mess);
+    std::string client_name = client_inbox_from_id(msg->session_id);
+    std::string uname;
+    if (!requested_mailbox(msg->session_id, msg->username, msg->folder, uname))
+        return;
+    
+    InboxQuery query;
+    query.filters = msg->filters;
+    if (query.filters & FILTER_SENDER)
+        query.sender = std::string(msg->sender, strnlen(msg->sender, MAX_USERNAME));
+    query.since = msg->since;
+    query.until = msg->until;
+    query.newest_first = msg->order == SortOrder::NEWEST_FIRST;
+
+    ResponseCache::Pages encoded;
+    const ResponseCache::Pages * pages = response_cache.find_listing(uname, query);
+    if (pages == nullptr) {
+        encoded = encode_listing(uname, query);
+        pages = &encoded;
+    }
+    for (const auto& page : *pages) {
+        SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
+        MessageType::INBOX, page.size(), page.data());
+    }
+    if (pages == &encoded)
+        response_cache.store_listing(uname, query, std::move(encoded));
+
+    char temp[100];
+    strcpy(temp, "retreived inbox");
+    send_ack(msg->session_id, temp);
+}
+
+/*
+    Encodes the INBOX pages answering `query`. The last page may be empty.
+*/
+ResponseCache::Pages encode_listing(const std::string& uname, const InboxQuery& query)
+{
+    ResponseCache::Pages pages;
+    ServerInboxResponse res;
+    int counter = 0;
+    auto flush = [&pages, &res, &counter]() {
+        res.mail_count = counter;
+        pages.emplace_back(reinterpret_cast<const char *>(&res), sizeof(res));
+        counter = 0;
+    };
+
+    inbox_for(uname).query(query, [&](const StoredMail& mail) {
+        if (counter >= INBOX_LIMIT)
+            flush();
+        fill_inbox_header(res.inbox[counter], mail);
+        counter++;
+        return true;
+    });
+    flush();
+    return pages;
+}
+
+/*
+    Answers a SEARCH with one page of matching headers, newest first,
+    followed by an ack carrying the match and page counts.
+*/
+void send_search_results_to_client()
+{
+    SearchMessage *msg = reinterpret_cast<SearchMessage*>(mess);
+    std::string client_name = client_inbox_from_id(msg->session_id);
+    std::string uname;
+    if (!requested_mailbox(msg->session_id, msg->username, msg->folder, uname))
+        return;
+    msg->query[MAX_SUBJECT - 1] = '\0';
+
+    const Mailbox& inbox = inbox_for(uname);
+    std::vector<const StoredMail*> matches;
+    for (const auto& id : search_indexes[uname].query(msg->query))
+    {
+        const StoredMail * mail = inbox.find(id);
+        if (mail != nullptr)
+            matches.push_back(mail);
+    }
+    std::sort(matches.begin(), matches.end(),
+        [](const StoredMail * a, const StoredMail * b) {
+            return InboxKey{b->date_sent, b->id} < InboxKey{a->date_sent, a->id};
+        });
+
+    int total = matches.size();
+    int pages = (total + INBOX_LIMIT - 1) / INBOX_LIMIT;
+    int page = std::max(msg->page, 0);
+
+    ServerInboxResponse res;
+    res.mail_count = 0;
+    for (int i = page * INBOX_LIMIT; i < total && res.mail_count < INBOX_LIMIT; i++)
+    {
+        fill_inbox_header(res.inbox[res.mail_count], *matches[i]);
+        res.mail_count++;
+    }
+    SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
+    MessageType::INBOX, sizeof(res), 
+    reinterpret_cast<const char *>(&res));
+
+    char temp[100];
+    sprintf(temp, "%d matches, page %d of %d", total, 
+        pages == 0 ? 0 : page + 1, pages);
+    send_ack(msg->session_id, temp);
+}
+
+void fill_inbox_header(InboxHeader& header, const StoredMail& mail)
+{
+    strcpy(header.subject, mail.body->subject);
+    strcpy(header.sender, mail.body->from);
+    header.flags = mail.flags;
+    header.id.index = mail.id.index;
+    header.id.origin = mail.id.origin;
+    header.timestamp = mail.date_sent;
+}
+
+void send_mail_to_client()
+{
+    ReadMessage *msg = reinterpret_cast<ReadMessage*>(mess);
+    std::string uname = key_of(msg->username, msg->id);
+    std::string client_name = client_inbox_from_id(msg->session_id);
+    
+    const std::string * cached = response_cache.find_message(uname, msg->id);
+    if (cached != nullptr) {
+        SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
+        MessageType::RESPONSE, cached->size(), cached->data());
+        return;
+    }
+
+    ServerResponse res;
+    const StoredMail * mail = inbox_for(uname).find(msg->id);
+    if (mail != nullptr) {
+        InboxMessage message = make_inbox_message(msg->username, *mail);
+        auto attached = state.attachments.find(msg->id);
+        if (attached != state.attachments.end())
+        {
+            message.msg.n_attachments = attached->second.refs.size();
+            std::copy(attached->second.refs.begin(), attached->second.refs.end(),
+                message.msg.attachments);
+        }
+        res.data = message;
+        SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
+        MessageType::RESPONSE, sizeof(res), 
+        reinterpret_cast<const char *>(&res));
+        response_cache.store_message(uname, msg->id,
+            std::string(reinterpret_cast<const char *>(&res), sizeof(res)));
+    }
+    else
+    {
+        char temp[100];
+        strcpy(temp, "couldnt find ");
+        strcat(temp, std::to_string(msg->id.origin).c_str());
+        strcat(temp, std::to_string(msg->id.index).c_str());
+        send_ack(msg->session_id, temp);
+    }
+}
+
+/*
+    Answers FETCH_BODIES with the requested messages packed into as few
+    BODIES messages as they fit, then one ack. Read marks go out with the
+    next tick's gossip, as one READ_DELTA for the whole batch.
+*/
+void send_bodies_to_client()
+{
+    const FetchBodiesMessage * msg = reinterpret_cast<const FetchBodiesMessage*>(mess);
+    std::string uname(msg->username, strnlen(msg->username, MAX_USERNAME));
+    std::string client_name = client_inbox_from_id(msg->session_id);
+    int count = std::min(std::max(msg->count, 0), MAX_FETCH_BATCH);
+
+    BodiesMessage res;
+    res.count = 0;
+    res.missing = 0;
+    res.used = 0;
+    auto flush = [&res, &client_name]() {
+        SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
+            MessageType::BODIES, offsetof(BodiesMessage, data) + res.used,
+            reinterpret_cast<const char *>(&res));
+        res.count = 0;
+        res.used = 0;
+    };
+
+    std::vector<MessageIdentifier> found;
+    for (int i = 0; i < count; i++)
+    {
+        const MessageIdentifier& id = msg->ids[i];
+        const Mailbox * inbox = find_inbox(key_of(uname, id));
+        const StoredMail * mail = inbox == nullptr ? nullptr : inbox->find(id);
+        if (mail == nullptr)
+        {
+            ++res.missing;
+            continue;
+        }
+
+        if (!pack_body(res, *mail))
+        {
+            flush();
+            pack_body(res, *mail);
+        }
+        found.push_back(id);
+    }
+    flush();
+
+    if (msg->mark_read)
+    {
+        for (const auto& id : found)
+            mark_read_locally(uname, id);
+    }
+
+    char temp[100];
+    sprintf(temp, "fetched %zu of %d emails", found.size(), count);
+    send_ack(msg->session_id, temp);
+}
+
+/*
+    Appends one message to a BODIES response. Returns false, leaving it
+    unchanged, if the message does not fit.
+*/
+bool pack_body(BodiesMessage& res, const StoredMail& mail)
+{
+    PackedBody packed;
+    packed.id = mail.id;
+    packed.date_sent = mail.date_sent;
+    packed.flags = mail.flags;
+    packed.from_len = strlen(mail.body->from);
+    packed.subject_len = strlen(mail.body->subject);
+    packed.message_len = strlen(mail.body->message);
+    packed.n_attachments = 0;
+    auto attached = state.attachments.find(mail.id);
+    if (attached != state.attachments.end())
+        packed.n_attachments = attached->second.refs.size();
+
+    size_t size = sizeof(packed) + packed.from_len + packed.subject_len
+        + packed.message_len + packed.n_attachments * sizeof(AttachmentRef);
+    if (res.used + size > BODIES_PAYLOAD) return false;
+
+    char * out = res.data + res.used;
+    auto append = [&out](const void * data, size_t len) {
+        memcpy(out, data, len);
+        out += len;
+    };
+    append(&packed, sizeof(packed));
+    append(mail.body->from, packed.from_len);
+    append(mail.body->subject, packed.subject_len);
+    append(mail.body->message, packed.message_len);
+    if (packed.n_attachments > 0)
+        append(attached->second.refs.data(), packed.n_attachments * sizeof(AttachmentRef));
+
+    res.used += size;
+    ++res.count;
+    return true;
+}
+
+void send_stats_to_client()
+{
+    GetStatsMessage *msg = reinterpret_cast<GetStatsMessage*>(mess);
+    std::string client_name = client_inbox_from_id(msg->session_id);
+    std::string uname;
+    if (!requested_mailbox(msg->session_id, msg->username, msg->folder, uname))
+        return;
+
+    const Mailbox& inbox = inbox_for(uname);
+    Quota quota = quota_for(msg->username);
+
+    ServerResponse res;
+    StatsMessage stats;
+    stats.total = inbox.size();
+    stats.unread = inbox.unread();
+    stats.bytes = inbox.bytes();
+    stats.quota_messages = quota.messages;
+    stats.quota_bytes = quota.bytes;
+    res.data = stats;
+    SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
+            MessageType::STATS, sizeof(res), 
+            reinterpret_cast<const char *>(&res));
+
+    char temp[100];
+    strcpy(temp, "retrieved mailbox stats");
+    send_ack(msg->session_id, temp);
+}
+
+/*
+    Resolves the folder named in a client request to its mailbox key, or
+    acks the client if the folder does not exist.
+*/
+bool requested_mailbox(uint32_t session_id, const char * user, const char * folder,
+    std::string& key)
+{
+    if (!accept_username(session_id, user))
+        return false;
+    std::string name(folder, strnlen(folder, MAX_FOLDER));
+    if (!folder_exists(user, name))
+    {
+        send_ack(session_id, "no such folder");
+        return false;
+    }
+    key = mailbox_key(user, name);
+    return true;
+}
+
+/*
+    Mail may only reference blobs already uploaded to this server.
+*/
+bool attachments_present(uint32_t session_id, const AttachmentRef * refs, int n)
+{
+    n = std::min(std::max(n, 0), MAX_ATTACHMENTS);
+    for (int i = 0; i < n; i++)
+    {
+        if (blob_store.contains(refs[i].hash)) continue;
+
+        char temp[100];
+        snprintf(temp, sizeof(temp), "attachment %.*s was not uploaded",
+            MAX_ATTACHMENT_NAME, refs[i].name);
+        send_ack(session_id, temp);
+        return false;
+    }
+    return true;
+}
+
+/*
+    Chunks are not acked; the mail that references the blob is rejected if
+    it did not arrive intact.
+*/
+void process_put_blob()
+{
+    blob_store.add_chunk(*reinterpret_cast<const BlobMessage*>(mess));
+}
+
+void send_blob_to_client()
+{
+    const BlobRequestMessage * msg = reinterpret_cast<const BlobRequestMessage*>(mess);
+    std::string client_name = client_inbox_from_id(msg->session_id);
+
+    bool found = blob_store.for_each_chunk(msg->hash, MessageType::BLOB,
+        [&client_name](const BlobMessage& chunk) {
+            SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
+                MessageType::BLOB, offsetof(BlobMessage, data) + chunk.length,
+                reinterpret_cast<const char *>(&chunk));
+        });
+    send_ack(msg->session_id, found ? "attachment sent" : "attachment not available yet");
+}
+
+Quota quota_for(const std::string& user)
+{
+    auto it = quotas.find(user);
+    return it == quotas.end() ? default_quota : it->second;
+}
+
+/*
+    Sets a command's data to a client's mail, if accepted. Mail to a list
+    is sent as multi-mail to its members. Returns false, after acking, if
+    the mail is not accepted.
+*/
+bool accept_mail(const MailMessage& msg, CommandPtr& command)
+{
+    if (msg.to[0] == LIST_PREFIX)
+    {
+        MultiMailMessage multi{};
+        multi.session_id = msg.session_id;
+        multi.seq_num = msg.seq_num;
+        strcpy(multi.username, msg.username);
+        multi.n_recipients = 1;
+        strcpy(multi.to[0], msg.to);
+        strcpy(multi.subject, msg.subject);
+        strcpy(multi.message, msg.message);
+        multi.n_attachments = msg.n_attachments;
+        memcpy(multi.attachments, msg.attachments, sizeof(multi.attachments));
+        return accept_multi_mail(multi, command);
+    }
+
+    if (!accept_username(msg.session_id, msg.username))
+        return false;
+    if (!attachments_present(msg.session_id, msg.attachments, msg.n_attachments))
+        return false;
+    if (!accept_within_quota(msg.session_id, msg.to, strlen(msg.subject) + strlen(msg.message)))
+        return false;
+    command->data = msg;
+    return true;
+}
+
+bool accept_multi_mail(MultiMailMessage msg, CommandPtr& command)
+{
+    if (!accept_username(msg.session_id, msg.username))
+        return false;
+    if (!attachments_present(msg.session_id, msg.attachments, msg.n_attachments))
+        return false;
+    if (!expand_lists(msg) || !accept_recipients(msg))
+        return false;
+    command->data = msg;
+    return true;
+}
+
+/*
+    Replaces the distribution lists among a mail's recipients with their
+    current members and drops duplicates. Done once, at the origin, so the
+    command names the users it goes to and applies alike on every replica
+    however list updates are ordered against it. Unknown lists expand to
+    nobody. Returns false, after acking, if nobody is left or the
+    recipients do not fit in one command.
+*/
+bool expand_lists(MultiMailMessage& msg)
+{
+    std::vector<std::string> recipients;
+    std::unordered_set<std::string> seen;
+    auto add = [&recipients, &seen](const std::string& name) {
+        if (seen.insert(name).second)
+            recipients.push_back(name);
+    };
+
+    int n = std::min(std::max(msg.n_recipients, 0), MAX_RECIPIENTS);
+    for (int i = 0; i < n; i++)
+    {
+        std::string name(msg.to[i], strnlen(msg.to[i], MAX_USERNAME));
+        if (name[0] != LIST_PREFIX)
+        {
+            add(name);
+            continue;
+        }
+
+        auto list = state.lists.find(name);
+        if (list == state.lists.end()) continue;
+        for (const auto& member : list->second)
+        {
+            add(member);
+        }
+    }
+
+    char temp[100];
+    if (recipients.empty() || recipients.size() > MAX_RECIPIENTS)
+    {
+        snprintf(temp, sizeof(temp), "mail has %zu recipients, must have 1 to %d",
+            recipients.size(), MAX_RECIPIENTS);
+        send_ack(msg.session_id, temp);
+        return false;
+    }
+
+    msg.n_recipients = recipients.size();
+    for (int i = 0; i < msg.n_recipients; i++)
+    {
+        strncpy(msg.to[i], recipients[i].c_str(), MAX_USERNAME - 1);
+        msg.to[i][MAX_USERNAME - 1] = '\0';
+    }
+    return true;
+}
+
+/*
+    Checked where a client's mail enters the system, before a command is
+    created, so mail over quota is never replicated. Rejections are acked.
+*/
+bool accept_within_quota(uint32_t session_id, const char * to, size_t mail_bytes)
+{
+    if (!accept_username(session_id, to)) return false;
+    Quota quota = quota_for(to);
+    if (quota.messages == 0 && quota.bytes == 0) return true;
+
+    // Quotas cover every folder, Sent included
+    int total = 0;
+    long bytes = 0;
+    for (const auto& key : mailbox_keys(to))
+    {
+        const Mailbox * inbox = find_inbox(key);
+        if (inbox == nullptr) continue;
+        total += inbox->size();
+        bytes += inbox->bytes();
+    }
+    bytes += mail_bytes;
+
+    if ((quota.messages != 0 && total + 1 > quota.messages)
+        || (quota.bytes != 0 && bytes > quota.bytes))
+    {
+        char temp[100];
+        snprintf(temp, sizeof(temp), "mailbox of %s is full", to);
+        send_ack(session_id, temp);
+        return false;
+    }
+    return true;
+}
+
+/*
+    Drops the recipients over quota, and acks each, before the command is
+    created. Returns false if nobody is left.
+*/
+bool accept_recipients(MultiMailMessage& msg)
+{
+    size_t bytes = strlen(msg.subject) + strlen(msg.message);
+    int accepted = 0;
+    int n = std::min(std::max(msg.n_recipients, 0), MAX_RECIPIENTS);
+    for (int i = 0; i < n; i++)
+    {
+        if (accept_within_quota(msg.session_id, msg.to[i], bytes))
+            strcpy(msg.to[accepted++], msg.to[i]);
+    }
+    msg.n_recipients = accepted;
+    return accepted > 0;
+}
+
+void send_component_to_client()
+{
+    GetComponentMessage *msg = reinterpret_cast<GetComponentMessage*>(mess);
+    std::string client_name = client_inbox_from_id(msg->session_id);
+
+    ServerResponse res;
+    ComponentMessage comp;
+    comp.num_servers = n_synching;
+    int index = 0;
+    for (int j = 0; j < 5; j++) {
+        if (servers_present[j]) {
+            strcpy(comp.names[index], synch_members[j]);
+            index++;
+        }
+    }
+    res.data = comp;
+    SP_multicast(mbox, AGREED_MESS, client_name.c_str(),
+            MessageType::COMPONENT, sizeof(res), 
+            reinterpret_cast<const char *>(&res));
+    char temp [100];
+    strcpy(temp, "total num of servers: ");
+    strcat(temp, std::to_string(comp.num_servers).c_str());
+    send_ack(msg->session_id, temp);
+}
+
+void process_connection_request()
+{
+    ConnectMessage * msg = reinterpret_cast<ConnectMessage*>(mess);
+    std::string conn_group = "client_" + std::to_string(msg->session_id) + "_connect";
+    SP_join(mbox, conn_group.c_str());
+    client_connections.insert(conn_group);
+}
+
+void synchronize()
+{
+    // Knowledge and resent commands must not cover anything uncommitted
+    commit_log();
+    synchronizing = true;
+    start:
+    copy_group_members();
+    broadcast_knowledge();
+
+    // Check if another split occurred
+    if (!wait_for_everyone())
+        goto start;
+
+    send_my_messages();
+    synchronizing = false;
+}
+
+void broadcast_knowledge()
+{
+    KnowledgeMessage msg;
+    msg.sender = server_index;
+    for (int i = 0; i < N_MACHINES; i++)
+    {
+        for (int j = 0; j < N_MACHINES; j++)
+        {
+            msg.summary[i][j] = state.knowledge[i][j];
+        }
+    }
+
+    SP_multicast(mbox, AGREED_MESS, server_group.c_str(),
+        MessageType::KNOWLEDGE, sizeof(msg),
+        reinterpret_cast<const char *>(&msg));
+}
+
+void copy_group_members()
+{
+    for (int i = 0; i < n_connected; i++)
+    {
+        strcpy(synch_members[i], target_groups[i]);
+    }
+}
+
+/*
+    Receives a knowledge message from every server in the group except us.
+    If a serviceable command is received or connection is established, handle 
+    it immediately.
+    If an update command is received, stash it in the queue.
+    If a membership message is received from server_group while waiting, 
+    return false.
+*/
+bool wait_for_everyone()
+{
+    clear_synch_arrays();
+
+    n_received = 1;
+    received[server_index] = true;
+    servers_present[server_index] = true;
+    n_synching = n_connected;
+
+    while (n_received < n_synching)
+    {
+        read_message();
+
+        if (Is_regular_mess(service_type))
+        {
+            switch (mess_type)
+            {
+                case MessageType::KNOWLEDGE:
+                    update_knowledge();
+                    mark_knowledge_as_received();
+                    break;
+                case MessageType::CONNECT:
+                    process_connection_request();
+                    break;
+                case MessageType::SHOW_INBOX:
+                    send_inbox_to_client();
+                    break;
+                case MessageType::SEARCH:
+                    send_search_results_to_client();
+                    break;
+                case MessageType::MAILBOX_STATS:
+                    send_stats_to_client();
+                    break;
+                case MessageType::SHOW_COMPONENT:
+                    send_component_to_client();
+                    break;
+                case MessageType::READ:
+                    process_read_command();
+                    break;
+                case MessageType::FETCH_BODIES:
+                    send_bodies_to_client();
+                    break;
+                case MessageType::READ_DELTA:
+                    merge_read_delta();
+                    break;
+                case MessageType::READ_SUMMARY:
+                    merge_read_summary();
+                    break;
+                case MessageType::PUT_BLOB:
+                    process_put_blob();
+                    break;
+                case MessageType::GET_BLOB:
+                    send_blob_to_client();
+                    break;
+                case MessageType::FETCH_BLOB:
+                    serve_blob_request();
+                    break;
+                case MessageType::BLOB_DATA:
+                    receive_blob_data();
+                    break;
+                case MessageType::COMMAND:
+                    process_command_message(true);
+                    break;
+                case MessageType::MAIL:
+                case MessageType::MULTI_MAIL:
+                case MessageType::DELETE:
+                case MessageType::FLAG:
+                case MessageType::LIST_UPDATE:
+                case MessageType::FOLDER:
+                    stash_command();
+                    break;
+                default:
+                    break;
+            }
+        }
+        else if (Is_reg_memb_mess(service_type))
+        {
+            if (is_server_memb_mess()) return false;
+
+            process_membership_message();
+        }
+    }
+    return true;
+}
+
+void clear_synch_arrays()
+{
+    for (int i = 0; i < N_MACHINES; i++)
+    {
+        received[i] = false;
+        servers_present[i] = false;
+    }
+    // Summaries of an earlier membership no longer describe this one
+    clear_read_summaries();
+}
+
+void update_knowledge()
+{
+    KnowledgeMessage * msg = reinterpret_cast<KnowledgeMessage*>(mess);
+
+    for (int i = 0; i < N_MACHINES; i++)
+    {
+        for (int j = 0; j < N_MACHINES; j++)
+        {
+            if (msg->summary[i][j] > state.knowledge[i][j])
+            {
+                state.knowledge[i][j] = msg->summary[i][j];
+                ++changes_since_garbage_collection;
+            }
+        }
+    }
+
+    ++changes_since_garbage_collection;
+    if (changes_since_garbage_collection >= MAX_CHANGES_BW_GARBAGE)
+    {
+        collect_garbage();
+        changes_since_garbage_collection = 0;
+    }
+}
+
+void mark_knowledge_as_received()
+{
+    KnowledgeMessage * msg = reinterpret_cast<KnowledgeMessage*>(mess);
+
+    // Need to check that this member is currently in our partition
+    // and we haven't received an update from them yet
+    if (sender_in_group() && received[msg->sender] == false)
+    {
+        received[msg->sender] = true;
+        servers_present[msg->sender] = true;
+        ++n_received;
+    }
+}
+
+void collect_garbage()
+{
+    for (int i = 0; i < N_MACHINES; ++i)
+    {
+        int min_index = INT_MAX;
+        for (int j = 0; j < N_MACHINES; ++j)
+        {
+            min_index = std::min(min_index, state.knowledge[j][i]);
+        }
+        state.safe_delivered[i] = min_index;
+        erase_queue_up_to(i, min_index);
+
+        // Mail from origin i up to min_index has been applied everywhere, so
+        // a pending read or delete for it can never be matched again
+        expire_pending(state.pending_delete, i, min_index);
+        expire_pending(state.read_marks, i, min_index);
+        expire_copy_updates(i, min_index);
+    }
+    blob_store.collect();
+}
+
+void expire_pending(PendingSets& sets, int origin, int index)
+{
+    for (auto it = sets.begin(); it != sets.end(); )
+    {
+        it->second.expire_up_to(origin, index);
+        if (it->second.empty())
+            it = sets.erase(it);
+        else
+            ++it;
+    }
+}
+
+void erase_queue_up_to(int origin, int index)
+{
+    auto& queue = command_queue[origin];
+    while (!queue.empty() && queue.front()->id.index <= index)
+    {
+        if (different_block(origin, queue.front()->id.index))
+        {
+            write_state();
+            for (int i = current_block[origin]; 
+                i < queue.front()->id.index / FILE_BLOCK_SIZE; i++)
+            {
+                delete_file_block(origin, i);
+            }
+            current_block[origin] = index / FILE_BLOCK_SIZE;
+        }
+        queue.pop_front();
+    }
+}
+
+bool different_block(int origin, int index)
+{
+    return current_block[origin] != index / FILE_BLOCK_SIZE;
+}
+
+void delete_file_block(int origin, int block)
+{
+    int index = block * FILE_BLOCK_SIZE;
+    delete_file_block_by_index(origin, index);
+}
+
+void delete_file_block_by_index(int origin, int index)
+{
+    remove(get_log_name(origin, index).c_str());
+    remove(get_legacy_log_name(origin, index).c_str());
+}
+
+bool sender_in_group()
+{
+    for (int i = 0; i < n_synching; i++)
+    {
+        if (strcmp(sender, synch_members[i]) == 0)
             return true;
     }
-    return false;
+    return false;
+}
+
+void stash_command()
+{
+    CommandPtr new_command = CommandPtr::make();
+    new_command->id.origin = server_index;
+    new_command->id.index = state.knowledge[server_index][server_index] + 1;
+    auto temptime = std::chrono::system_clock::now();
+    new_command->timestamp = std::chrono::system_clock::to_time_t(temptime);
+    switch(mess_type) {
+        case MessageType::MAIL:
+            if (!accept_mail(*reinterpret_cast<MailMessage*>(mess), new_command))
+                return;
+            break;
+        case MessageType::MULTI_MAIL:
+            if (!accept_multi_mail(*reinterpret_cast<MultiMailMessage*>(mess), new_command))
+                return;
+            break;
+        case MessageType::DELETE: 
+            new_command->data = *reinterpret_cast<DeleteMessage*>(mess);
+            break;
+        case MessageType::FLAG: {
+            FlagMessage msg = *reinterpret_cast<FlagMessage*>(mess);
+            if (!take_read_marks(msg))
+                return;
+            new_command->data = msg;
+            break;
+        }
+        case MessageType::LIST_UPDATE:
+            if (!valid_list_update(*reinterpret_cast<ListMessage*>(mess)))
+                return;
+            new_command->data = *reinterpret_cast<ListMessage*>(mess);
+            break;
+        case MessageType::FOLDER:
+            if (!valid_folder_update(*reinterpret_cast<FolderMessage*>(mess)))
+                return;
+            new_command->data = *reinterpret_cast<FolderMessage*>(mess);
+            break;
+    }
+    synch_queue.push_back(new_command);
+}
+
+void send_my_messages()
+{
+    count_my_synch_servers();
+    send_synch_commands();
+}
+
+/*
+    Records which servers' messages we are most up to date on and therefore
+    need to send to the group. Ties are broken by server id.
+*/
+void count_my_synch_servers()
+{
+    for (int i = 0; i < N_MACHINES; i++)
+    {
+        need_to_send[i] = false;
+    }
+
+    for (int i = 0; i < N_MACHINES; i++) // Loop over each origin server
+    {
+        int max_server = 0;
+        int max_message = INT_MIN;
+        int min_message = INT_MAX;
+        for (int j = 0; j < N_MACHINES; j++) // Loop over servers in this group
+        {
+            if (!servers_present[j]) continue; // Skip if this server is not in the group
+            if (state.knowledge[j][i] > max_message)
+            {
+                max_server = j;
+                max_message = state.knowledge[j][i];
+            }
+            if (state.knowledge[j][i] < min_message)
+            {
+                min_message = state.knowledge[j][i];
+            }
+        }
+        if (max_server == server_index)
+        {
+            need_to_send[i] = true;
+            start_index[i] = min_message;
+        }
+    }
+}
+
+void send_synch_commands()
+{
+    for (int i = 0; i < N_MACHINES; i++)
+    {
+        if (need_to_send[i])
+        {
+            broadcast_messages_from_queue(i, start_index[i]);
+        }
+    }
+}
+
+void broadcast_messages_from_queue(int origin, int start_index)
+{
+    auto it = find_message_index(command_queue[origin], start_index);
+    while (it != command_queue[origin].end())
+    {
+        broadcast_command(*it);
+        ++it;
+    }
+}
+
+/*
+    Linear scan through list to find user command with index start_index.
+    If not found, return list.cend();
+*/
+CommandQueue::iterator 
+find_message_index(CommandQueue& queue, int start_index)
+{
+    auto it = queue.begin();
+    while (it != queue.end())
+    {
+        if ((*it)->id.index == start_index + 1) return it;
+        ++it;
+    }
+    return it;
+}
+
+void apply_queued_updates()
+{
+    while (!synch_queue.empty())
+    {
+        apply_new_command(synch_queue.front());
+        synch_queue.pop_front();
+    }
+}
+
+void end_connection(const std::string& group)
+{
+    SP_leave(mbox, group.c_str());
+    client_connections.erase(group);
+}
+
+void goodbye()
+{
+    printf("Bye.\n");
+
+    SP_disconnect(mbox);
+
+    exit(0);
+}
+
+std::string client_connection_from_id(uint32_t id)
+{
+    return "client_" + std::to_string(id) + "_connect";
+}
+
+std::string client_inbox_from_id(uint32_t id)
+{
+    return "client_" + std::to_string(id) + "_in";
+}
+
+bool message_sent_to_inbox()
+{
+    return strcmp(target_groups[0], server_inbox.c_str()) == 0;
+}
+
+bool message_sent_to_servers()
+{
+    return strcmp(target_groups[0], server_group.c_str()) == 0;
+}
+
+bool connection_exists(uint32_t session_id)
+{
+    return client_connections.find(client_connection_from_id(session_id))
+        != client_connections.end();
+}
+
+bool is_server_memb_mess()
+{
+    return strcmp(sender, server_group.c_str()) == 0;
+}
+
+/*
+    Reads optional settings from CONFIG_FILE. Each line is one of
+        quota <user|*> <max messages> <max bytes>
+        retention <user|*> <seconds>
+        cache <bytes>
+        store mmap|snapshot
+        layout columnar|tree
+        durability none|ack|interval <milliseconds>
+    where 0 means unlimited and * sets the default, except that cache 0
+    turns the response cache off. Durability ack, the default, syncs the
+    log before acking; interval syncs in the background at most once per
+    interval, checked at least every TICK_INTERVAL; none leaves syncing to
+    the OS. Lines starting with # are ignored.
+*/
+void load_config()
+{
+    std::ifstream config(CONFIG_FILE);
+    std::string line;
+    while (std::getline(config, line))
+    {
+        std::istringstream words(line);
+        std::string key;
+        if (!(words >> key) || key[0] == '#') continue;
+
+        if (key == "quota")
+        {
+            std::string user;
+            Quota quota;
+            if (!(words >> user >> quota.messages >> quota.bytes))
+            {
+                std::cerr << "Ignoring malformed quota: " << line << std::endl;
+                continue;
+            }
+            if (user == "*")
+                default_quota = quota;
+            else
+                quotas[user] = quota;
+        }
+        else if (key == "store")
+        {
+            std::string backend;
+            words >> backend;
+            if (backend == "mmap")
+                use_mail_store = true;
+            else if (backend != "snapshot" && backend != "json")
+                std::cerr << "Unknown store: " << line << std::endl;
+        }
+        else if (key == "layout")
+        {
+            std::string layout;
+            words >> layout;
+            if (layout == "columnar")
+                Mailbox::columnar_layout = true;
+            else if (layout != "tree")
+                std::cerr << "Unknown layout: " << line << std::endl;
+        }
+        else if (key == "durability")
+        {
+            std::string mode;
+            int interval_ms = 0;
+            words >> mode;
+            if (mode == "none")
+                log_writer.set_durability(DURABILITY_NONE, 0);
+            else if (mode == "ack")
+                log_writer.set_durability(DURABILITY_ACK, 0);
+            else if (mode == "interval" && words >> interval_ms && interval_ms >= 0)
+                log_writer.set_durability(DURABILITY_INTERVAL, interval_ms);
+            else
+                std::cerr << "Unknown durability: " << line << std::endl;
+        }
+        else if (key == "cache")
+        {
+            size_t bytes;
+            if (!(words >> bytes))
+            {
+                std::cerr << "Ignoring malformed cache size: " << line << std::endl;
+                continue;
+            }
+            response_cache.set_budget(bytes);
+        }
+        else if (key == "retention")
+        {
+            std::string user;
+            long seconds;
+            if (!(words >> user >> seconds))
+            {
+                std::cerr << "Ignoring malformed retention: " << line << std::endl;
+                continue;
+            }
+            if (user == "*")
+                default_retention = seconds;
+            else
+                retentions[user] = seconds;
+        }
+        else
+        {
+            std::cerr << "Unknown setting in " CONFIG_FILE ": " << key << std::endl;
+        }
+    }
+}
+
+void load_state()
+{
+    read_state_file();
+    open_mail_store();
+    open_blob_store();
+
+    rebuild_search_index();
+    schedule_all_expiries();
+
+    read_log_files();
+    replay_read_journal();
+    if (!read_journal.open(read_journal_file))
+    {
+        perror("Could not open read journal");
+        exit(1);
+    }
+}
+
+/*
+    Re-applies the reads acked before a restart that no manifest recorded.
+    They are gossiped again, since the restart may have come before they
+    were sent.
+*/
+void replay_read_journal()
+{
+    ReadJournal::replay(read_journal_file, [](const std::string& user,
+            const MessageIdentifier& id) {
+        if (mark_read(user, id))
+            unsent_reads[user].insert(id);
+    });
+}
+
+/*
+    Maps the mail store when it is enabled in CONFIG_FILE. A new store is
+    filled from the inboxes just read from the snapshot. An existing
+    store replaces them. Replay starts from the manifest's progress, which
+    is written in one step with its pending sets and attachments; the
+    store, flushed before each manifest, may be ahead of it.
+*/
+void open_mail_store()
+{
+    if (!use_mail_store) return;
+
+    if (!mail_store.open("store_" + std::to_string(server_id)))
+    {
+        perror("Could not open mail store");
+        exit(1);
+    }
+    stored_body = [](uint32_t slot) { return mail_store.body(slot); };
+
+    if (mail_store.fresh())
+        import_inboxes_to_store();
+    else
+        read_inboxes_from_store();
+
+    printf("mail store: %u messages, %u bodies\n",
+        mail_store.mail_count(), mail_store.body_count());
+}
+
+void import_inboxes_to_store()
+{
+    load_all_inboxes();
+
+    // The store replaces the inbox and body files
+    for (const auto& saved : saved_inboxes)
+        obsolete_files.push_back(saved.second.file);
+    for (const auto& body_file : body_file_refs)
+        obsolete_files.push_back(body_file.first);
+    saved_inboxes.clear();
+    dirty_inboxes.clear();
+    shared_bodies.clear();
+    body_file_refs.clear();
+
+    // Old mailboxes keep their bodies alive until every copy has moved
+    std::vector<Mailbox> imported;
+    std::unordered_map<const MailBody*, BodyPtr> moved;
+    for (auto& inbox : state.inboxes)
+    {
+        Mailbox stored;
+        for (const auto& entry : inbox.second)
+        {
+            StoredMail mail = entry.second;
+            BodyPtr& body = moved[mail.body.get()];
+            if (!body)
+            {
+                body = BodyPtr::stored(mail_store.add_body());
+                *body = *mail.body;
+            }
+            mail.body = body;
+            mail.slot = mail_store.add_header(inbox.first, mail);
+            stored.insert(mail);
+        }
+        imported.push_back(std::move(inbox.second));
+        inbox.second = std::move(stored);
+    }
+    checkpoint_mail_store();
+}
+
+void read_inboxes_from_store()
+{
+    state.inboxes.clear();
+    unloaded_inboxes.clear();
+    saved_inboxes.clear();
+    shared_bodies.clear();
+    body_file_refs.clear();
+    mail_store.collect_orphans();
+    mail_store.for_each_mail([](const std::string& owner, const StoredMail& mail) {
+        if (!state.inboxes[owner].insert(mail))
+            mail_store.remove_header(mail.slot);
+    });
+
+    // The store is newer than the snapshot's record of where mail is filed
+    for (auto& user : state.folders)
+    {
+        for (auto& folder : user.second)
+            folder.second = IdSet();
+    }
+    for (const auto& inbox : state.inboxes)
+    {
+        std::string owner = owner_of(inbox.first);
+        if (owner == inbox.first) continue;
+        IdSet& filed = state.folders[owner][inbox.first.substr(owner.size() + 1)];
+        for (const auto& entry : inbox.second)
+            filed.insert(entry.second.id);
+    }
+}
+
+void checkpoint_mail_store()
+{
+    StoreCheckpoint checkpoint;
+    memcpy(checkpoint.knowledge, state.knowledge, sizeof(checkpoint.knowledge));
+    memcpy(checkpoint.applied_to_state, state.applied_to_state,
+        sizeof(checkpoint.applied_to_state));
+    if (!mail_store.save_checkpoint(checkpoint))
+        perror("Could not sync mail store");
+}
+
+/*
+    Blob references are rebuilt from the snapshot's attachment table; blobs
+    it does not mention are collected, and missing ones are fetched.
+*/
+void open_blob_store()
+{
+    if (!blob_store.open("blobs_" + std::to_string(server_id)))
+    {
+        perror("Could not open blob store");
+        exit(1);
+    }
+    for (const auto& attached : state.attachments)
+    {
+        for (const auto& ref : attached.second.refs)
+        {
+            blob_store.add_ref(ref.hash);
+            if (!blob_store.contains(ref.hash))
+                want_blob(ref.hash, attached.first.origin);
+        }
+    }
+    blob_store.find_unreferenced();
+}
+
+/*
+    Reads the manifest, or else the snapshot files of an earlier version,
+    which the first write_state replaces with a manifest.
+*/
+void read_state_file()
+{
+    if (std::filesystem::exists(manifest_file))
+    {
+        read_snapshot(manifest_file);
+        remove_stale_inbox_files();
+        repopulate_local_data();
+        return;
+    }
+
+    bool legacy = !std::filesystem::exists(inbox_state_file)
+        && std::filesystem::exists(legacy_inbox_state_file);
+    require(
+        legacy || std::filesystem::exists(inbox_state_file),
+        "No inbox state file detected",
+        legacy ? read_legacy_inbox_state : read_inbox_state
+    );
+    legacy = !std::filesystem::exists(log_state_file)
+        && std::filesystem::exists(legacy_log_state_file);
+    require(
+        legacy || std::filesystem::exists(log_state_file),
+        "No log state file detected",
+        legacy ? read_legacy_log_state : read_log_state
+    );
+    repopulate_local_data();
+}
+
+/*
+    Walks a mapped manifest, or a snapshot of the previous binary version;
+    records are read in place.
+*/
+void read_snapshot(const std::string& path)
+{
+    MappedFile file;
+    SnapshotReader snapshot;
+    if (!file.open(path) || !snapshot.open(file.data(), file.size()))
+    {
+        std::cerr << "Could not read snapshot " << path << std::endl;
+        exit(1);
+    }
+
+    ProgressRecord progress;
+    if (snapshot.first(SECTION_PROGRESS, progress))
+    {
+        memcpy(state.knowledge, progress.knowledge, sizeof(state.knowledge));
+        memcpy(state.applied_to_state, progress.applied_to_state,
+            sizeof(state.applied_to_state));
+    }
+    SafeDeliveredRecord delivered;
+    if (snapshot.first(SECTION_SAFE_DELIVERED, delivered))
+    {
+        memcpy(state.safe_delivered, delivered.safe_delivered,
+            sizeof(state.safe_delivered));
+    }
+    read_pending_sets(snapshot, SECTION_PENDING_DELETE, state.pending_delete);
+    read_pending_sets(snapshot, SECTION_READ_MARKS, state.read_marks);
+    read_inbox_files(snapshot);
+    read_inbox_index(snapshot);
+    snapshot.for_each<RangeRecord>(SECTION_INBOX_READ, [&snapshot](const RangeRecord& r) {
+        unloaded_inboxes[snapshot.str(r.user)].read.insert_range(r.origin, r.first, r.last);
+    });
+    read_lists(snapshot);
+    read_folders(snapshot);
+    read_attachments(snapshot);
+    read_copy_updates(snapshot);
+    read_moves(snapshot);
+}
+
+void read_inbox_state()
+{
+    read_snapshot(inbox_state_file);
+    obsolete_files.push_back(inbox_state_file);
+}
+
+void read_log_state()
+{
+    MappedFile file;
+    SnapshotReader snapshot;
+    SafeDeliveredRecord progress;
+    if (!file.open(log_state_file) || !snapshot.open(file.data(), file.size())
+        || !snapshot.first(SECTION_SAFE_DELIVERED, progress))
+    {
+        std::cerr << "Could not read snapshot " << log_state_file << std::endl;
+        exit(1);
+    }
+    memcpy(state.safe_delivered, progress.safe_delivered, sizeof(state.safe_delivered));
+    obsolete_files.push_back(log_state_file);
+}
+
+/*
+    The next write_state replaces a JSON snapshot with a binary one.
+*/
+void read_legacy_inbox_state()
+{
+    ptree state_tree;
+
+    read_json(legacy_inbox_state_file, state_tree);
+    read_2d_ptree_array(state.knowledge, N_MACHINES, N_MACHINES, 
+        state_tree.get_child("knowledge"));
+    read_1d_ptree_array(state.applied_to_state, N_MACHINES, 
+        state_tree.get_child("applied_to_state"));
+    read_pending_sets_from_ptree(state.read_marks,
+        state_tree.get_child("read_marks", state_tree.get_child("pending_read", ptree())));
+    read_pending_sets_from_ptree(state.pending_delete, 
+        state_tree.get_child("pending_delete"));
+    // Snapshots written before the inbox data file hold every inbox inline
+    extract_inboxes_to_state(state_tree.get_child("inboxes", ptree()),
+        state_tree.get_child("bodies", ptree()));
+    load_legacy_inboxes(state_tree.get_child("inbox_data", ptree()));
+    read_lists_from_ptree(state_tree.get_child("lists", ptree()));
+    read_folders_from_ptree(state_tree.get_child("folders", ptree()));
+    read_attachments_from_ptree(state_tree.get_child("attachments", ptree()));
+
+    for (const auto& inbox : state.inboxes)
+    {
+        mark_dirty(inbox.first);
+        for (const auto& entry : inbox.second)
+            share_body(entry.second, "");
+    }
+    obsolete_files.push_back(legacy_inbox_state_file);
+}
+
+void read_legacy_log_state()
+{
+    ptree state_tree;
+
+    read_json(legacy_log_state_file, state_tree);
+    read_1d_ptree_array(state.safe_delivered, N_MACHINES, 
+        state_tree.get_child("safe_delivered"));
+    obsolete_files.push_back(legacy_log_state_file);
+}
+
+void repopulate_local_data()
+{
+    for (int i = 0; i < N_MACHINES; ++i)
+    {
+        current_block[i] = (state.safe_delivered[i] + 1) / FILE_BLOCK_SIZE;
+    }
+}
+
+/*
+    Bodies are stored once and looked up by identifier, so every recipient's
+    copy shares the same body again after a restart.
+*/
+void extract_inboxes_to_state(const ptree& pt, const ptree& body_tree)
+{
+    std::unordered_map<MessageIdentifier, BodyPtr, IdentifierHash> bodies;
+    for (const auto& child : body_tree)
+    {
+        bodies[identifier_from_ptree(child.second.get_child("id"))] 
+            = body_from_ptree(child.second);
+    }
+
+    for (const auto& inbox : pt.get_child(""))
+    {
+        read_inbox_list_from_ptree(state.inboxes[inbox.first], inbox.second, bodies);
+    }
+}
+
+void read_inbox_list_from_ptree(Mailbox& inbox, const ptree& pt,
+    std::unordered_map<MessageIdentifier, BodyPtr, IdentifierHash>& bodies)
+{
+    for (const auto& child : pt)
+    {
+        inbox.insert(stored_mail_from_ptree(child.second, bodies));
+    }
+}
+
+void rebuild_search_index()
+{
+    search_indexes.clear();
+    for (const auto& inbox : state.inboxes)
+    {
+        SearchIndex& index = search_indexes[inbox.first];
+        for (const auto& entry : inbox.second)
+        {
+            index.add(entry.second);
+        }
+    }
+}
+
+/*
+    Every access to an inbox outside loading goes through here, so an
+    inbox left in the snapshot is materialized before it is read or
+    changed. Commands replayed from the log load only the inboxes they
+    touch.
+*/
+Mailbox& inbox_for(const std::string& user)
+{
+    if (!unloaded_inboxes.empty() && unloaded_inboxes.count(user))
+        load_inbox(user);
+    return state.inboxes[user];
+}
+
+/*
+    Like inbox_for, but does not create an inbox for an unknown user.
+*/
+Mailbox * find_inbox(const std::string& user)
+{
+    if (!unloaded_inboxes.empty() && unloaded_inboxes.count(user))
+        load_inbox(user);
+    auto it = state.inboxes.find(user);
+    return it == state.inboxes.end() ? nullptr : &it->second;
+}
+
+/*
+    Reads one mailbox from its inbox file and builds what startup builds
+    for loaded inboxes: search index and expiry timers. A body already
+    loaded for another copy is shared; others are read from their body
+    file. Inbox files of earlier versions hold their bodies inline.
+*/
+void load_inbox(const std::string& user)
+{
+    auto lazy = unloaded_inboxes.find(user);
+    if (lazy == unloaded_inboxes.end()) return;
+
+    MappedFile file;
+    SnapshotReader doc;
+    if (!file.open(lazy->second.file) || !doc.open(file.data(), file.size()))
+    {
+        std::cerr << "Could not read inbox of " << user << " from "
+            << lazy->second.file << std::endl;
+        exit(1);
+    }
+    saved_inboxes[user] = std::move(lazy->second);
+    unloaded_inboxes.erase(lazy);
+
+    Mailbox& inbox = state.inboxes[user];
+    doc.for_each<MailRecord>(SECTION_MAIL, [&doc, &inbox](const MailRecord& r) {
+        StoredMail mail = stored_mail_from_record(doc, r);
+        auto shared = shared_bodies.find(mail.id);
+        if (shared != shared_bodies.end())
+            mail.body = shared->second.body;
+        if (inbox.insert(mail))
+            share_body(mail, "");
+    });
+
+    std::map<std::string, BodyFile> body_files;
+    doc.for_each<MailRefRecord>(SECTION_MAIL_REF,
+        [&doc, &inbox, &body_files](const MailRefRecord& r) {
+            StoredMail mail;
+            mail.id = MessageIdentifier{r.index, r.origin};
+            mail.date_sent = r.date_sent;
+            mail.flags = r.flags;
+            std::string file = doc.str(r.body_file);
+            auto shared = shared_bodies.find(mail.id);
+            if (shared != shared_bodies.end())
+                mail.body = shared->second.body;
+            else
+                mail.body = read_body(body_files, file, mail.id);
+            if (inbox.insert(mail))
+                share_body(mail, file);
+        });
+    index_inbox(user, inbox);
+}
+
+/*
+    Reads the body of `id` from the body file `file`, mapping it on first
+    use. The manifest names only complete files, so a missing body is
+    fatal.
+*/
+BodyPtr read_body(std::map<std::string, BodyFile>& files, const std::string& file,
+    const MessageIdentifier& id)
+{
+    auto opened = files.try_emplace(file);
+    BodyFile& body_file = opened.first->second;
+    if (opened.second && (!body_file.file.open(file)
+            || !body_file.doc.open(body_file.file.data(), body_file.file.size())))
+    {
+        std::cerr << "Could not read body file " << file << std::endl;
+        exit(1);
+    }
+
+    BodyRecord r;
+    bool found = body_file.doc.find_sorted<BodyRecord>(SECTION_BODY,
+        [&id](const BodyRecord& r) {
+            MessageIdentifier at{r.index, r.origin};
+            return at < id ? -1 : id < at ? 1 : 0;
+        }, r);
+    if (!found)
+    {
+        std::cerr << "Body of " << id.origin << "." << id.index
+            << " missing from " << file << std::endl;
+        exit(1);
+    }
+
+    BodyPtr body = BodyPtr::make();
+    body_file.doc.copy(r.from, body->from, MAX_USERNAME);
+    body_file.doc.copy(r.subject, body->subject, MAX_SUBJECT);
+    body_file.doc.copy(r.message, body->message, EMAIL_LEN);
+    return body;
+}
+
+/*
+    Counts a loaded copy against its message's shared body. `file` is the
+    body file holding it, if known.
+*/
+void share_body(const StoredMail& copy, const std::string& file)
+{
+    SharedBody& shared = shared_bodies[copy.id];
+    if (!shared.body)
+        shared.body = copy.body;
+    if (shared.file.empty())
+        shared.file = file;
+    ++shared.copies;
+}
+
+void unshare_body(const MessageIdentifier& id)
+{
+    auto shared = shared_bodies.find(id);
+    if (shared != shared_bodies.end() && --shared->second.copies <= 0)
+        shared_bodies.erase(shared);
+}
+
+void load_all_inboxes()
+{
+    while (!unloaded_inboxes.empty())
+    {
+        std::string user = unloaded_inboxes.begin()->first;
+        load_inbox(user);
+    }
+}
+
+void index_inbox(const std::string& user, const Mailbox& inbox)
+{
+    SearchIndex& index = search_indexes[user];
+    for (const auto& entry : inbox)
+    {
+        index.add(entry.second);
+        schedule_expiry(user, entry.second);
+    }
+}
+
+/*
+    Replays each origin's log from the first command not yet safe
+    delivered. One reader thread per origin maps and checks that origin's
+    segments, while this thread applies the commands, origin by origin, as
+    each reader finishes. Checkpoints are held back until the whole log is
+    applied, then written once.
+*/
+void read_log_files()
+{
+    OriginReplay logs[N_MACHINES];
+    std::vector<std::thread> readers;
+    for (int i = 0; i < N_MACHINES; i++)
+        readers.emplace_back(read_origin_log, i, state.safe_delivered[i] + 1, std::ref(logs[i]));
+
+    replaying_log = true;
+    for (int i = 0; i < N_MACHINES; i++)
+    {
+        readers[i].join();
+        for (const LogRecord& command : logs[i].commands)
+            replay_logged_command(command);
+        logs[i] = OriginReplay();
+    }
+    replaying_log = false;
+
+    if (updates_since_serialize > 0)
+    {
+        write_state();
+        updates_since_serialize = 0;
+    }
+}
+
+/*
+    Reads one origin's log from `index` on, block by block. A block may
+    have a file of the previous format, read first, as well as a segment.
+    Runs on a reader thread, so it touches nothing but `log` and the files.
+*/
+void read_origin_log(int origin, int index, OriginReplay& log)
+{
+    while (true)
+    {
+        int block = index / FILE_BLOCK_SIZE;
+        index = read_legacy_log_file(origin, index, log);
+        index = read_log_segment(origin, index, log);
+        if (index / FILE_BLOCK_SIZE == block) break;
+    }
+}
+
+/*
+    Copies a command out of its log record and applies it if the snapshot
+    does not already include it, queueing it for synchronization either
+    way. This is the only copy made of a replayed command. Records were
+    checked by valid_logged_command as they were read.
+*/
+void replay_logged_command(const LogRecord& record)
+{
+    CommandPtr command = CommandPtr::make();
+    if (record.type == LOG_RECORD_IMAGE)
+        memcpy(static_cast<void *>(command.get()), record.data, sizeof(UserCommand));
+    else
+        decode_command(record.data, record.length, *command);
+    if (command->id.index > state.applied_to_state[command->id.origin])
+        apply_command_to_state(command);
+    else
+        add_command_to_queue(command);
+}
+
+/*
+    Collects the commands of the segment holding `index` from that command
+    on and returns the index of the first command it did not hold. Every
+    record is checked against its checksum; reading stops at the first bad
+    one, and an open segment is truncated there so appends resume after
+    its last good record.
+*/
+int read_log_segment(int origin, int index, OriginReplay& log)
+{
+    std::string filename = get_log_name(origin, index);
+    auto segment = std::make_unique<LogSegment>();
+    if (!segment->open(filename)) return index;
+
+    LogRecord record;
+    if (segment->seek(index))
+    {
+        while (segment->next(record) && record.index == index
+            && valid_logged_command(record))
+        {
+            log.commands.push_back(record);
+            ++index;
+        }
+    }
+    if (segment->damaged())
+    {
+        std::cerr << "Bad record in " + filename + " at offset "
+            + std::to_string(segment->position()) + "\n";
+        if (!segment->sealed() && truncate(filename.c_str(), segment->position()) != 0)
+            perror("Could not truncate log");
+    }
+    log.segments.push_back(std::move(segment));
+    return index;
+}
+
+/*
+    Whether a record holds a command: a whole command image, or an encoding
+    that decodes. Runs on the recovery readers, so decodes onto the stack.
+*/
+bool valid_logged_command(const LogRecord& record)
+{
+    if (record.type == LOG_RECORD_IMAGE)
+        return record.length == sizeof(UserCommand);
+    UserCommand command;
+    return record.type == LOG_RECORD_COMMAND
+        && decode_command(record.data, record.length, command);
+}
+
+/*
+    Checks every log segment of this server, reporting the damaged ones.
+    Returns the number of segments that failed.
+*/
+int scrub_logs()
+{
+    std::string prefix = "log_" + std::to_string(server_id) + "_";
+    std::vector<std::string> files;
+    for (const auto& entry : std::filesystem::directory_iterator("."))
+    {
+        std::string name = entry.path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) == 0 && entry.path().extension() == ".seg")
+            files.push_back(name);
+    }
+    std::sort(files.begin(), files.end());
+
+    int failed = 0;
+    uintmax_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& file : files)
+    {
+        LogSegment segment;
+        const char * problem = segment.open(file) ? segment.verify() : "not a log segment";
+        if (problem != nullptr)
+        {
+            printf("%s: %s\n", file.c_str(), problem);
+            ++failed;
+        }
+        bytes += std::filesystem::file_size(file);
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    printf("scrubbed %zu segments, %ju bytes in %.3f s (%.1f MB/s), %d damaged\n",
+        files.size(), bytes, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0.0, failed);
+    return failed;
+}
+
+/*
+    Collects the commands of a block file written before log segments,
+    which holds bare commands with no framing. Only the identifier of a
+    skipped command is read.
+*/
+int read_legacy_log_file(int origin, int index, OriginReplay& log)
+{
+    auto file = std::make_unique<MappedFile>();
+    if (!file->open(get_legacy_log_name(origin, index))) return index;
+    file->advise(MADV_SEQUENTIAL);
+
+    for (size_t at = 0; at + sizeof(UserCommand) <= file->size(); at += sizeof(UserCommand))
+    {
+        MessageIdentifier id;
+        memcpy(&id, file->data() + at + offsetof(UserCommand, id), sizeof(id));
+        if (id.index != index) continue;
+        log.commands.push_back(LogRecord{index, file->data() + at,
+            static_cast<uint32_t>(sizeof(UserCommand)), LOG_RECORD_IMAGE});
+        ++index;
+    }
+    log.legacy_files.push_back(std::move(file));
+    return index;
+}
+
+/*
+    Buffers a command in its origin's open log segment. It is written out once
+    commit_log runs.
+*/
+void write_command_to_log(const CommandPtr& command)
+{
+    std::string record = serialize_command(command);
+    if (!log_writer.append(command->id.origin, command->id.index, record.data(),
+            record.size(), LOG_RECORD_COMMAND))
+    {
+        perror("Could not write log");
+        exit(1);
+    }
+}
+
+/*
+    Commits the commands logged and reads journalled since the last commit,
+    then broadcasts the commands originated here and sends the acks held
+    back for them. No other server applies a command this one could lose.
+    With interval durability this also runs the background sync when it
+    is due.
+*/
+void commit_log()
+{
+    bool ok;
+    if (log_writer.uncommitted() > 0)
+    {
+        auto start = std::chrono::steady_clock::now();
+        ok = log_writer.commit();
+        commit_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+    }
+    else
+    {
+        ok = log_writer.sync_if_due();
+    }
+    if (!ok)
+    {
+        perror("Could not sync log");
+        exit(1);
+    }
+    if (read_journal.uncommitted() > 0
+        && !read_journal.commit(log_writer.mode() == DURABILITY_ACK))
+    {
+        perror("Could not write read journal");
+        exit(1);
+    }
+    for (const auto& command : held_broadcasts)
+        broadcast_command(command);
+    held_broadcasts.clear();
+    for (const auto& ack : held_acks)
+        send_ack(ack.first, ack.second.c_str());
+    held_acks.clear();
 }
 
-void stash_command()
+/*
+    Rewrites the inbox files of mailboxes changed since the last snapshot,
+    then replaces the manifest, which names every inbox file along with
+    replication progress. Snapshot I/O follows the rate of change, not the
+    amount of stored mail. With a mail store, the store is flushed first;
+    the manifest alone holds the replay point, so no crash can pair it with
+    pending sets of another moment.
+*/
+void write_state()
 {
-    std::shared_ptr<UserCommand> new_command = std::make_shared<UserCommand>();
-    new_command->id.origin = server_index;
-    new_command->id.index = state.knowledge[server_index][server_index] + 1;
-    auto temptime = std::chrono::system_clock::now();
-    new_command->timestamp = std::chrono::system_clock::to_time_t(temptime);
-    switch(mess_type) {
-        case MessageType::MAIL:
-            new_command->data = *reinterpret_cast<MailMessage*>(mess);
-            break;
-        case MessageType::READ:
-            new_command->data = *reinterpret_cast<ReadMessage*>(mess);
-            break;
-        case MessageType::DELETE: 
-            new_command->data = *reinterpret_cast<DeleteMessage*>(mess);
-            break;
+    // The manifest must not get ahead of the log, whatever the durability
+    commit_log();
+    if (!log_writer.sync_all())
+    {
+        perror("Could not sync log");
+        exit(1);
     }
-    synch_queue.push_back(new_command);
+
+    // With a mail store the inboxes are already on disk once flushed
+    if (use_mail_store)
+        checkpoint_mail_store();
+    else
+        write_dirty_inboxes();
+
+    bool written = replace_snapshot(manifest_file, [](SnapshotWriter& manifest) {
+        ProgressRecord progress;
+        memcpy(progress.knowledge, state.knowledge, sizeof(progress.knowledge));
+        memcpy(progress.applied_to_state, state.applied_to_state,
+            sizeof(progress.applied_to_state));
+        manifest.section_of(SECTION_PROGRESS, progress);
+        SafeDeliveredRecord delivered;
+        memcpy(delivered.safe_delivered, state.safe_delivered,
+            sizeof(delivered.safe_delivered));
+        manifest.section_of(SECTION_SAFE_DELIVERED, delivered);
+
+        write_pending_sets(manifest, SECTION_PENDING_DELETE, state.pending_delete);
+        write_pending_sets(manifest, SECTION_READ_MARKS, state.read_marks);
+        write_inbox_index(manifest);
+        write_stats(manifest);
+        write_lists(manifest);
+        write_folders(manifest);
+        write_attachments(manifest);
+        write_copy_updates(manifest);
+        write_moves(manifest);
+    });
+    if (!written)
+    {
+        perror("Could not write manifest");
+        return;
+    }
+
+    std::error_code ec;
+    for (const auto& file : obsolete_files)
+        std::filesystem::remove(file, ec);
+    obsolete_files.clear();
+
+    // Every journalled read is now in the manifest or the inboxes
+    if (!read_journal.reset())
+        perror("Could not reset read journal");
 }
 
-void send_my_messages()
+void mark_dirty(const std::string& key)
 {
-    count_my_synch_servers();
-    send_synch_commands();
+    if (!use_mail_store)
+        dirty_inboxes.insert(key);
 }
 
 /*
-    Records which servers' messages we are most up to date on and therefore
-    need to send to the group. Ties are broken by server id.
+    Writes each changed mailbox to a new inbox file. Bodies no body file
+    holds yet go first into one new body file, so a message's body is
+    written once however many copies refer to it. The files replaced stay
+    until the manifest naming the new ones is in place.
 */
-void count_my_synch_servers()
+void write_dirty_inboxes()
 {
-    for (int i = 0; i < N_MACHINES; i++)
+    std::map<MessageIdentifier, SharedBody*> unwritten;
+    for (const auto& key : dirty_inboxes)
     {
-        need_to_send[i] = false;
+        auto inbox = state.inboxes.find(key);
+        if (inbox == state.inboxes.end()) continue;
+        for (const auto& entry : inbox->second)
+        {
+            SharedBody& shared = shared_bodies[entry.second.id];
+            if (!shared.body)
+                shared.body = entry.second.body;
+            if (shared.file.empty())
+                unwritten.emplace(entry.second.id, &shared);
+        }
     }
+    if (!unwritten.empty())
+        write_body_file(unwritten);
 
-    for (int i = 0; i < N_MACHINES; i++) // Loop over each origin server
+    // Replaced files give up their bodies only once every new file counts its own
+    std::vector<std::map<std::string, int>> replaced;
+    for (const auto& key : dirty_inboxes)
     {
-        int max_server = 0;
-        int max_message = INT_MIN;
-        int min_message = INT_MAX;
-        for (int j = 0; j < N_MACHINES; j++) // Loop over servers in this group
+        auto saved = saved_inboxes.find(key);
+        if (saved != saved_inboxes.end())
         {
-            if (!servers_present[j]) continue; // Skip if this server is not in the group
-            if (state.knowledge[j][i] > max_message)
-            {
-                max_server = j;
-                max_message = state.knowledge[j][i];
-            }
-            if (state.knowledge[j][i] < min_message)
-            {
-                min_message = state.knowledge[j][i];
-            }
+            obsolete_files.push_back(saved->second.file);
+            replaced.push_back(std::move(saved->second.bodies));
+            saved_inboxes.erase(saved);
         }
-        if (max_server == server_index)
+        auto inbox = state.inboxes.find(key);
+        if (inbox == state.inboxes.end() || inbox->second.empty()) continue;
+
+        LazyInbox summary = summarize_inbox(inbox->second);
+        FILE * out = create_inbox_file(summary.file);
+        SnapshotWriter doc(out);
+        doc.begin_section(SECTION_MAIL_REF, sizeof(MailRefRecord));
+        for (const auto& entry : inbox->second)
         {
-            need_to_send[i] = true;
-            start_index[i] = min_message;
+            const std::string& body_file = shared_bodies[entry.second.id].file;
+            doc.record(mail_ref_record(doc, entry.second, body_file));
+            ++summary.bodies[body_file];
+            ++body_file_refs[body_file];
         }
+        doc.end_section();
+        close_inbox_file(out, summary.file, doc.finish() >= 0);
+        saved_inboxes.emplace(key, std::move(summary));
     }
+    for (const auto& bodies : replaced)
+        release_body_files(bodies);
+    dirty_inboxes.clear();
 }
 
-void send_synch_commands()
+/*
+    Writes `bodies` to a new body file, sorted by id as load_inbox looks
+    them up, and records the file in each.
+*/
+void write_body_file(const std::map<MessageIdentifier, SharedBody*>& bodies)
 {
-    for (int i = 0; i < N_MACHINES; i++)
+    std::string filename;
+    FILE * out = create_inbox_file(filename);
+    SnapshotWriter doc(out);
+    doc.begin_section(SECTION_BODY, sizeof(BodyRecord));
+    for (const auto& entry : bodies)
+        doc.record(body_record(doc, entry.first, *entry.second->body));
+    doc.end_section();
+    close_inbox_file(out, filename, doc.finish() >= 0);
+
+    for (const auto& entry : bodies)
+        entry.second->file = filename;
+}
+
+/*
+    Drops the references of a replaced inbox file. A body file no inbox
+    file refers to any more goes with the next manifest; body files are
+    not compacted, so one stays while any copy written into it remains.
+*/
+void release_body_files(const std::map<std::string, int>& bodies)
+{
+    for (const auto& body : bodies)
     {
-        if (need_to_send[i])
-        {
-            broadcast_messages_from_queue(i, start_index[i]);
-        }
+        auto refs = body_file_refs.find(body.first);
+        if (refs == body_file_refs.end()) continue;
+        refs->second -= body.second;
+        if (refs->second > 0) continue;
+
+        obsolete_files.push_back(body.first);
+        body_file_refs.erase(refs);
     }
 }
 
-void broadcast_messages_from_queue(int origin, int start_index)
+FILE * create_inbox_file(std::string& filename)
 {
-    auto it = find_message_index(command_queue[origin], start_index);
-    while (it != command_queue[origin].end())
+    std::error_code ec;
+    std::filesystem::create_directories(inbox_dir, ec);
+    filename = inbox_dir + "/" + std::to_string(++next_inbox_file) + ".dat";
+    FILE * out = fopen(filename.c_str(), "wb");
+    if (out == nullptr)
     {
-        broadcast_command(*it);
-        ++it;
+        perror("Could not create inbox file");
+        exit(1);
     }
+    return out;
 }
 
 /*
-    Linear scan through list to find user command with index start_index.
-    If not found, return list.cend();
+    Syncs a new inbox file. A manifest must never name a file that is not
+    complete on disk, so failing to write one is fatal.
 */
-std::list<std::shared_ptr<UserCommand>>::iterator 
-find_message_index(std::list<std::shared_ptr<UserCommand>>& queue, int start_index)
+void close_inbox_file(FILE * out, const std::string& filename, bool ok)
 {
-    auto it = queue.begin();
-    while (it != queue.end())
+    ok = fflush(out) == 0 && fsync(fileno(out)) == 0 && ok;
+    ok = fclose(out) == 0 && ok;
+    if (!ok)
     {
-        if ((*it)->id.index == start_index + 1) return it;
-        ++it;
+        std::cerr << "Could not write inbox file " << filename << std::endl;
+        exit(1);
     }
-    return it;
 }
 
-void apply_queued_updates()
+/*
+    Removes inbox and body files the manifest does not name: those written
+    for a manifest that was never put in place.
+*/
+void remove_stale_inbox_files()
 {
-    while (!synch_queue.empty())
+    std::unordered_set<std::string> named;
+    for (const auto& inbox : unloaded_inboxes)
+        named.insert(std::filesystem::path(inbox.second.file).filename().string());
+    for (const auto& body_file : body_file_refs)
+        named.insert(std::filesystem::path(body_file.first).filename().string());
+
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(inbox_dir, ec))
     {
-        apply_new_command(synch_queue.front());
-        synch_queue.pop_front();
+        if (!named.count(entry.path().filename().string()))
+            std::filesystem::remove(entry.path(), ec);
     }
 }
 
-void end_connection(const std::string& group)
+void write_inbox_index(SnapshotWriter& manifest)
 {
-    SP_leave(mbox, group.c_str());
-    client_connections.erase(group);
+    auto each_inbox = [](auto f) {
+        for (const auto& inbox : unloaded_inboxes)
+            f(inbox.first, inbox.second);
+        for (const auto& inbox : saved_inboxes)
+            f(inbox.first, inbox.second);
+    };
+
+    manifest.section_of(SECTION_INBOX_DIR, InboxDirRecord{next_inbox_file});
+    manifest.begin_section(SECTION_INBOX_FILES, sizeof(InboxFileRecord));
+    each_inbox([&manifest](const std::string& user, const LazyInbox& lazy) {
+        manifest.record(InboxFileRecord{manifest.str(user), manifest.str(lazy.file),
+            lazy.total, lazy.unread, lazy.bytes, lazy.oldest_local});
+    });
+    manifest.end_section();
+    manifest.begin_section(SECTION_INBOX_READ, sizeof(RangeRecord));
+    each_inbox([&manifest](const std::string& user, const LazyInbox& lazy) {
+        StrRef name = manifest.str(user);
+        lazy.read.for_each_range([&manifest, name](int origin, int first, int last) {
+            manifest.record(RangeRecord{name, origin, first, last});
+        });
+    });
+    manifest.end_section();
+    manifest.begin_section(SECTION_INBOX_BODIES, sizeof(InboxBodiesRecord));
+    each_inbox([&manifest](const std::string& user, const LazyInbox& lazy) {
+        StrRef name = manifest.str(user);
+        for (const auto& body : lazy.bodies)
+            manifest.record(InboxBodiesRecord{name, manifest.str(body.first), body.second, 0});
+    });
+    manifest.end_section();
 }
 
-void goodbye()
+void read_inbox_files(const SnapshotReader& snapshot)
 {
-    printf("Bye.\n");
-
-    SP_disconnect(mbox);
-
-    exit(0);
+    InboxDirRecord dir;
+    if (snapshot.first(SECTION_INBOX_DIR, dir))
+        next_inbox_file = dir.next_file;
+
+    snapshot.for_each<InboxFileRecord>(SECTION_INBOX_FILES,
+        [&snapshot](const InboxFileRecord& r) {
+            LazyInbox& lazy = unloaded_inboxes[snapshot.str(r.user)];
+            lazy.file = snapshot.str(r.file);
+            lazy.total = r.total;
+            lazy.unread = r.unread;
+            lazy.bytes = r.bytes;
+            lazy.oldest_local = r.oldest_local;
+        });
+    snapshot.for_each<InboxBodiesRecord>(SECTION_INBOX_BODIES,
+        [&snapshot](const InboxBodiesRecord& r) {
+            std::string file = snapshot.str(r.file);
+            unloaded_inboxes[snapshot.str(r.user)].bodies[file] += r.copies;
+            body_file_refs[file] += r.copies;
+        });
 }
 
-std::string client_connection_from_id(uint32_t id)
+/*
+    Snapshots of the previous version keep every mailbox in one shared
+    data file. Each document is copied out to its own inbox file as is;
+    the data file goes once the first manifest is written.
+*/
+void read_inbox_index(const SnapshotReader& snapshot)
 {
-    return "client_" + std::to_string(id) + "_connect";
-}
+    InboxDataRecord data;
+    if (!snapshot.first(SECTION_INBOX_DATA, data)) return;
+    std::string data_file = snapshot.str(data.file);
 
-std::string client_inbox_from_id(uint32_t id)
-{
-    return "client_" + std::to_string(id) + "_in";
+    MappedFile mapped;
+    if (!mapped.open(data_file))
+    {
+        std::cerr << "Could not map " << data_file << std::endl;
+        exit(1);
+    }
+    snapshot.for_each<InboxIndexRecord>(SECTION_INBOX_INDEX,
+        [&snapshot, &mapped, &data_file](const InboxIndexRecord& r) {
+            if (r.offset < 0 || r.length < 0
+                || static_cast<size_t>(r.offset + r.length) > mapped.size())
+            {
+                std::cerr << "Inbox index does not match " << data_file << std::endl;
+                exit(1);
+            }
+            LazyInbox& lazy = unloaded_inboxes[snapshot.str(r.user)];
+            FILE * out = create_inbox_file(lazy.file);
+            close_inbox_file(out, lazy.file,
+                fwrite(mapped.data() + r.offset, 1, r.length, out) == static_cast<size_t>(r.length));
+            lazy.total = r.total;
+            lazy.unread = r.unread;
+            lazy.bytes = r.bytes;
+            lazy.oldest_local = r.oldest_local;
+        });
+    obsolete_files.push_back(data_file);
 }
 
-bool message_sent_to_inbox()
+LazyInbox summarize_inbox(const Mailbox& inbox)
 {
-    return strcmp(target_groups[0], server_inbox.c_str()) == 0;
+    LazyInbox lazy;
+    lazy.total = inbox.size();
+    lazy.unread = inbox.unread();
+    lazy.bytes = inbox.bytes();
+    lazy.oldest_local = 0;
+    for (const auto& entry : inbox)
+    {
+        const StoredMail& mail = entry.second;
+        if (mail.id.origin == server_index
+            && (lazy.oldest_local == 0 || mail.date_sent < lazy.oldest_local))
+            lazy.oldest_local = mail.date_sent;
+        if (mail.flags & MAIL_READ)
+            lazy.read.insert(mail.id);
+    }
+    return lazy;
 }
 
-bool message_sent_to_servers()
+MailRefRecord mail_ref_record(SnapshotWriter& doc, const StoredMail& mail,
+    const std::string& body_file)
 {
-    return strcmp(target_groups[0], server_group.c_str()) == 0;
+    MailRefRecord r;
+    r.index = mail.id.index;
+    r.origin = mail.id.origin;
+    r.date_sent = mail.date_sent;
+    r.flags = mail.flags;
+    r.body_file = doc.str(body_file);
+    return r;
 }
 
-bool connection_exists(uint32_t session_id)
+BodyRecord body_record(SnapshotWriter& doc, const MessageIdentifier& id, const MailBody& body)
 {
-    return client_connections.find(client_connection_from_id(session_id))
-        != client_connections.end();
+    BodyRecord r;
+    r.index = id.index;
+    r.origin = id.origin;
+    r.from = doc.str(body.from, strnlen(body.from, MAX_USERNAME));
+    r.subject = doc.str(body.subject, strnlen(body.subject, MAX_SUBJECT));
+    r.message = doc.str(body.message, strnlen(body.message, EMAIL_LEN));
+    return r;
 }
 
-bool is_server_memb_mess()
+StoredMail stored_mail_from_record(const SnapshotReader& doc, const MailRecord& r)
 {
-    return strcmp(sender, server_group.c_str()) == 0;
+    StoredMail mail;
+    mail.id = MessageIdentifier{r.index, r.origin};
+    mail.date_sent = r.date_sent;
+    mail.flags = r.flags;
+    mail.body = BodyPtr::make();
+    doc.copy(r.from, mail.body->from, MAX_USERNAME);
+    doc.copy(r.subject, mail.body->subject, MAX_SUBJECT);
+    doc.copy(r.message, mail.body->message, EMAIL_LEN);
+    return mail;
 }
 
-std::multiset<InboxMessage>::iterator
-find_mail_by_id(const MessageIdentifier& id, const std::string& name)
+/*
+    Per-user counters, so tools reading the snapshot do not need to walk
+    every inbox. They are recomputed when inboxes are loaded.
+*/
+void write_stats(SnapshotWriter& snapshot)
 {
-    for (auto it = state.inboxes[name].begin(); it != state.inboxes[name].end(); it++)
+    snapshot.begin_section(SECTION_STATS, sizeof(StatsRecord));
+    for (const auto& inbox : state.inboxes)
     {
-        if (*it == id)
-        {
-            return it;
-        }
+        snapshot.record(StatsRecord{snapshot.str(inbox.first),
+            static_cast<int32_t>(inbox.second.size()), inbox.second.unread(),
+            static_cast<int64_t>(inbox.second.bytes())});
+    }
+    for (const auto& inbox : unloaded_inboxes)
+    {
+        snapshot.record(StatsRecord{snapshot.str(inbox.first),
+            inbox.second.total, inbox.second.unread, inbox.second.bytes});
     }
-    return state.inboxes[name].end();
+    snapshot.end_section();
 }
 
-void load_state()
+void write_lists(SnapshotWriter& snapshot)
 {
-    read_state_file();
-
-    read_log_files();
+    snapshot.begin_section(SECTION_LISTS, sizeof(ListRecord));
+    for (const auto& list : state.lists)
+    {
+        StrRef name = snapshot.str(list.first);
+        for (const auto& member : list.second)
+            snapshot.record(ListRecord{name, snapshot.str(member)});
+    }
+    snapshot.end_section();
 }
 
-void read_state_file()
+void read_lists(const SnapshotReader& snapshot)
 {
-    require(
-        std::filesystem::exists(inbox_state_file),
-        "No inbox state file detected",
-        read_inbox_state
-    );
-    require(
-        std::filesystem::exists(log_state_file),
-        "No log state file detected",
-        read_log_state
-    );
-    repopulate_local_data();
+    snapshot.for_each<ListRecord>(SECTION_LISTS, [&snapshot](const ListRecord& r) {
+        state.lists[snapshot.str(r.list)].insert(snapshot.str(r.member));
+    });
 }
 
-void read_inbox_state()
+void write_folders(SnapshotWriter& snapshot)
 {
-    ptree state_tree;
-    std::string filename = inbox_state_file;
-
-    read_json(inbox_state_file, state_tree);
-    read_2d_ptree_array(state.knowledge, N_MACHINES, N_MACHINES, 
-        state_tree.get_child("knowledge"));
-    read_1d_ptree_array(state.applied_to_state, N_MACHINES, 
-        state_tree.get_child("applied_to_state"));
-    rehydrate_set_from_ptree(state.pending_read, identifier_from_ptree, 
-        state_tree.get_child("pending_read"));
-    rehydrate_set_from_ptree(state.pending_delete, identifier_from_ptree, 
-        state_tree.get_child("pending_delete"));
-    extract_inboxes_to_state(state_tree.get_child("inboxes"));
+    snapshot.begin_section(SECTION_FOLDERS, sizeof(FolderRecord));
+    for (const auto& user : state.folders)
+    {
+        StrRef owner = snapshot.str(user.first);
+        for (const auto& folder : user.second)
+        {
+            StrRef name = snapshot.str(folder.first);
+            if (folder.second.empty())
+                snapshot.record(FolderRecord{owner, name, -1, 0, 0});
+            folder.second.for_each_range([&](int origin, int first, int last) {
+                snapshot.record(FolderRecord{owner, name, origin, first, last});
+            });
+        }
+    }
+    snapshot.end_section();
 }
 
-void read_log_state()
+void read_folders(const SnapshotReader& snapshot)
 {
-    ptree state_tree;
-
-    std::string filename = log_state_file;
-    read_json(log_state_file, state_tree);
-    read_1d_ptree_array(state.safe_delivered, N_MACHINES, 
-        state_tree.get_child("safe_delivered"));
+    snapshot.for_each<FolderRecord>(SECTION_FOLDERS, [&snapshot](const FolderRecord& r) {
+        IdSet& filed = state.folders[snapshot.str(r.user)][snapshot.str(r.folder)];
+        if (r.origin >= 0)
+            filed.insert_range(r.origin, r.first, r.last);
+    });
 }
 
-void repopulate_local_data()
+void write_attachments(SnapshotWriter& snapshot)
 {
-    for (int i = 0; i < N_MACHINES; ++i)
+    snapshot.begin_section(SECTION_ATTACHMENTS, sizeof(AttachmentRecord));
+    for (const auto& attached : state.attachments)
     {
-        current_block[i] = (state.safe_delivered[i] + 1) / FILE_BLOCK_SIZE;
+        for (const auto& ref : attached.second.refs)
+        {
+            AttachmentRecord r;
+            r.index = attached.first.index;
+            r.origin = attached.first.origin;
+            r.copies = attached.second.copies;
+            r.size = ref.size;
+            memcpy(r.hash, ref.hash.bytes, BLOB_HASH_LEN);
+            r.name = snapshot.str(ref.name, strnlen(ref.name, MAX_ATTACHMENT_NAME));
+            snapshot.record(r);
+        }
     }
+    snapshot.end_section();
 }
 
-void extract_inboxes_to_state(const ptree& pt)
+void read_attachments(const SnapshotReader& snapshot)
 {
-    for (const auto& inbox : pt.get_child(""))
-    {
-        state.inboxes[inbox.first] = get_inbox_list_from_ptree(inbox.second);
-    }
+    snapshot.for_each<AttachmentRecord>(SECTION_ATTACHMENTS,
+        [&snapshot](const AttachmentRecord& r) {
+            MessageAttachments& attached = state.attachments[MessageIdentifier{r.index, r.origin}];
+            attached.copies = r.copies;
+
+            AttachmentRef ref;
+            memset(&ref, 0, sizeof(ref));
+            memcpy(ref.hash.bytes, r.hash, BLOB_HASH_LEN);
+            ref.size = r.size;
+            snapshot.copy(r.name, ref.name, MAX_ATTACHMENT_NAME);
+            attached.refs.push_back(ref);
+        });
 }
 
-std::multiset<InboxMessage> get_inbox_list_from_ptree(const ptree& pt)
+/*
+    Pending sets are written as one record per contiguous range of ids.
+*/
+void write_pending_sets(SnapshotWriter& snapshot, SnapshotSection kind,
+    const PendingSets& sets)
 {
-    std::multiset<InboxMessage> inbox;
-    for (const auto& child : pt)
+    snapshot.begin_section(kind, sizeof(RangeRecord));
+    for (const auto& user : sets)
     {
-        inbox.insert(inbox_message_from_ptree(child.second));
+        StrRef name = snapshot.str(user.first);
+        user.second.for_each_range([&snapshot, name](int origin, int first, int last) {
+            snapshot.record(RangeRecord{name, origin, first, last});
+        });
     }
-    return inbox;
+    snapshot.end_section();
 }
 
-void read_log_files()
+void read_pending_sets(const SnapshotReader& snapshot, SnapshotSection kind,
+    PendingSets& sets)
 {
-    int index;
-    int current_block;
-    std::shared_ptr<UserCommand> command;
-    UserCommand buf;
-    std::string filename;
-    std::ifstream infile;
-    std::string line;
-    for (int i = 0; i < N_MACHINES; i++)
-    {
-        index = state.safe_delivered[i] + 1;
-        current_block = index / FILE_BLOCK_SIZE;
-
-        filename = get_log_name(i, index);
-        if (!std::filesystem::exists(filename)) continue;
-        infile.open(filename, std::ios::binary);
+    snapshot.for_each<RangeRecord>(kind, [&snapshot, &sets](const RangeRecord& r) {
+        sets[snapshot.str(r.user)].insert_range(r.origin, r.first, r.last);
+    });
+}
 
-        // Apply all remaining files to state
-        while (!infile.eof())
+/*
+    One record per flag with a recorded change.
+*/
+void write_copy_updates(SnapshotWriter& snapshot)
+{
+    snapshot.begin_section(SECTION_FLAG_UPDATES, sizeof(FlagUpdateRecord));
+    for (const auto& user : state.copy_updates)
+    {
+        StrRef name = snapshot.str(user.first);
+        for (const auto& copy : user.second)
         {
-            infile.read(reinterpret_cast<char*>(&buf), sizeof(UserCommand));
-            if (buf.id.index == index) 
+            const CopyUpdates& updates = copy.second;
+            for (int bit = 0; bit < MAIL_FLAG_BITS; bit++)
             {
-                if (index > state.applied_to_state[i])
-                {
-                    apply_command_to_state(std::make_shared<UserCommand>(buf));
-                }
-                else
-                {
-                    add_command_to_queue(std::make_shared<UserCommand>(buf));
-                }
-                ++index;
-            }
-
-            if (index / FILE_BLOCK_SIZE != current_block)
-            {
-                infile.close();
-                if (std::filesystem::exists(get_log_name(i, index)))
-                {
-                    current_block = index / FILE_BLOCK_SIZE;
-                    infile.open(get_log_name(i, index), std::ios::binary);
-                }
-                else
-                {
-                    break;
-                }
+                uint8_t flag = 1 << bit;
+                if (!(updates.flags_known & flag)) continue;
+
+                FlagUpdateRecord r;
+                memset(&r, 0, sizeof(r));
+                r.user = name;
+                r.index = copy.first.index;
+                r.origin = copy.first.origin;
+                r.timestamp = updates.flag_stamps[bit].timestamp;
+                r.stamp_origin = updates.flag_stamps[bit].origin;
+                r.stamp_index = updates.flag_stamps[bit].index;
+                r.flag = flag;
+                r.value = (updates.flags & flag) != 0;
+                r.delivered = updates.delivered;
+                snapshot.record(r);
             }
         }
-        if (infile.is_open()) infile.close();
     }
+    snapshot.end_section();
 }
 
-void write_command_to_log(const std::shared_ptr<UserCommand>& command)
+void write_moves(SnapshotWriter& snapshot)
 {
-    const int origin = command->id.origin;
-    const int index = command->id.index;
-
-    int block = index / FILE_BLOCK_SIZE;
-
-    outfile.open(get_log_name(origin, index), 
-        std::ios_base::app | std::ios::binary);
-
-    outfile.write(reinterpret_cast<const char*>(&(*command)), sizeof(UserCommand));
-    outfile.close();
+    snapshot.begin_section(SECTION_MOVES, sizeof(MoveRecord));
+    for (const auto& user : state.copy_updates)
+    {
+        StrRef name = snapshot.str(user.first);
+        for (const auto& copy : user.second)
+        {
+            const CopyUpdates& updates = copy.second;
+            if (!updates.moved) continue;
+
+            MoveRecord r;
+            memset(&r, 0, sizeof(r));
+            r.user = name;
+            r.index = copy.first.index;
+            r.origin = copy.first.origin;
+            r.timestamp = updates.move_stamp.timestamp;
+            r.stamp_origin = updates.move_stamp.origin;
+            r.stamp_index = updates.move_stamp.index;
+            r.folder = snapshot.str(updates.folder);
+            r.delivered = updates.delivered;
+            snapshot.record(r);
+        }
+    }
+    snapshot.end_section();
 }
 
-void write_state()
+void read_copy_updates(const SnapshotReader& snapshot)
 {
-    write_inbox_state();
-    write_log_state();
+    snapshot.for_each<FlagUpdateRecord>(SECTION_FLAG_UPDATES,
+        [&snapshot](const FlagUpdateRecord& r) {
+            CopyUpdates& updates = state.copy_updates[snapshot.str(r.user)]
+                [MessageIdentifier{r.index, r.origin}];
+            UpdateStamp stamp{static_cast<time_t>(r.timestamp), r.stamp_origin, r.stamp_index};
+            uint8_t flag = static_cast<uint8_t>(r.flag);
+            record_flag_change(updates, stamp, r.value ? flag : 0, r.value ? 0 : flag);
+            updates.delivered = updates.delivered || r.delivered;
+        });
 }
 
-void write_inbox_state()
+void read_moves(const SnapshotReader& snapshot)
 {
-    ptree state_tree;
-    state_tree.push_back(std::make_pair("knowledge", 
-        generate_2d_ptree(state.knowledge, N_MACHINES, N_MACHINES)));
-    state_tree.push_back(std::make_pair("applied_to_state",
-        generate_1d_ptree(state.applied_to_state, N_MACHINES)));
+    snapshot.for_each<MoveRecord>(SECTION_MOVES, [&snapshot](const MoveRecord& r) {
+        CopyUpdates& updates = state.copy_updates[snapshot.str(r.user)]
+            [MessageIdentifier{r.index, r.origin}];
+        updates.moved = true;
+        updates.move_stamp = UpdateStamp{static_cast<time_t>(r.timestamp), r.stamp_origin,
+            r.stamp_index};
+        updates.folder = snapshot.str(r.folder);
+        updates.delivered = updates.delivered || r.delivered;
+    });
+}
 
-    state_tree.push_back(std::make_pair("pending_delete",
-        write_pending_delete_to_ptree()));
-    state_tree.push_back(std::make_pair("pending_read",
-        write_pending_read_to_ptree()));
+/*
+    Inbox documents of a JSON snapshot are JSON as well. They are all
+    loaded at startup; the next snapshot writes them to inbox files and
+    removes the old data file.
+*/
+void load_legacy_inboxes(const ptree& pt)
+{
+    std::string data_file = pt.get<std::string>("file", "");
+    if (data_file.empty()) return;
+    std::ifstream data(data_file, std::ios::binary);
+    ptree none;
+    for (const auto& entry : pt.get_child("index", none))
+    {
+        std::string doc(entry.second.get<long>("length"), '\0');
+        data.seekg(entry.second.get<long>("offset"));
+        if (!data.read(&doc[0], doc.size()))
+        {
+            std::cerr << "Could not read inbox of " << entry.first << " from "
+                << data_file << std::endl;
+            exit(1);
+        }
 
-    state_tree.push_back(std::make_pair("inboxes", write_inboxes_to_ptree()));
+        ptree doc_tree;
+        std::istringstream in(doc);
+        read_json(in, doc_tree);
+        std::unordered_map<MessageIdentifier, BodyPtr, IdentifierHash> bodies;
+        for (const auto& child : doc_tree.get_child("bodies"))
+        {
+            bodies[identifier_from_ptree(child.second.get_child("id"))]
+                = body_from_ptree(child.second);
+        }
+        read_inbox_list_from_ptree(state.inboxes[entry.first],
+            doc_tree.get_child("inbox"), bodies);
+    }
+    obsolete_files.push_back(data_file);
+}
 
-    write_json(inbox_state_file, state_tree);
+void read_lists_from_ptree(const ptree& pt)
+{
+    for (const auto& list : pt)
+    {
+        std::set<std::string>& members = state.lists[list.first];
+        for (const auto& member : list.second)
+        {
+            members.insert(member.second.get_value<std::string>());
+        }
+    }
 }
 
-ptree write_inboxes_to_ptree()
+void read_folders_from_ptree(const ptree& pt)
 {
-    ptree inbox_tree;
-    for (const auto& inbox : state.inboxes)
+    for (const auto& user : pt)
     {
-        inbox_tree.push_back(std::make_pair(inbox.first, 
-            ptree_from_inbox(inbox.second)));
+        for (const auto& folder : user.second)
+            read_id_set_from_ptree(state.folders[user.first][folder.first], folder.second);
     }
-    return inbox_tree;
 }
 
-ptree write_pending_delete_to_ptree()
+void read_attachments_from_ptree(const ptree& pt)
 {
-    ptree delete_tree;
-    for (const auto& id : state.pending_delete)
+    for (const auto& child : pt)
     {
-        delete_tree.push_back(std::make_pair("", ptree_from_identifier(id)));
+        MessageAttachments& attached
+            = state.attachments[identifier_from_ptree(child.second.get_child("id"))];
+        attached.copies = child.second.get<int>("copies");
+        for (const auto& file : child.second.get_child("files"))
+        {
+            AttachmentRef ref;
+            memset(&ref, 0, sizeof(ref));
+            if (!hash_from_hex(file.second.get<std::string>("hash"), ref.hash)) continue;
+            ref.size = file.second.get<uint32_t>("size");
+            strncpy(ref.name, file.second.get<std::string>("name").c_str(),
+                MAX_ATTACHMENT_NAME - 1);
+            attached.refs.push_back(ref);
+        }
     }
-    return delete_tree;
 }
 
-ptree write_pending_read_to_ptree()
+/*
+    Accepts both range entries and the single-identifier entries written by
+    older snapshots.
+*/
+void read_id_set_from_ptree(IdSet& ids, const ptree& pt)
 {
-    ptree read_tree;
-    for (const auto& id : state.pending_read)
+    for (const auto& child : pt)
     {
-        read_tree.push_back(std::make_pair("", ptree_from_identifier(id)));
+        if (child.second.get_child_optional("index"))
+        {
+            ids.insert(identifier_from_ptree(child.second));
+        }
+        else
+        {
+            ids.insert_range(child.second.get<int>("origin"),
+                child.second.get<int>("first"), child.second.get<int>("last"));
+        }
     }
-    return read_tree;
 }
-ptree ptree_from_inbox(const std::multiset<InboxMessage>& inbox)
+
+/*
+    Older snapshots hold a single array of ids with no user; its entries
+    have empty keys and are kept under the empty name.
+*/
+void read_pending_sets_from_ptree(PendingSets& sets, const ptree& pt)
 {
-    ptree inbox_tree;
-    for (const auto& message : inbox)
+    if (!pt.empty() && pt.front().first.empty())
+    {
+        read_id_set_from_ptree(sets[""], pt);
+        return;
+    }
+
+    for (const auto& user : pt)
     {
-        inbox_tree.push_back(std::make_pair("", ptree_from_inbox_message(message)));
+        read_id_set_from_ptree(sets[user.first], user.second);
     }
-    return inbox_tree;
 }
 
 std::string get_log_name(int origin, int index)
+{
+    return get_legacy_log_name(origin, index) + ".seg";
+}
+
+std::string get_legacy_log_name(int origin, int index)
 {
     return "log_" 
     + std::to_string(server_id) 
@@ -1132,14 +4358,6 @@ std::string get_log_name(int origin, int index)
     + "_" + std::to_string(index / FILE_BLOCK_SIZE);
 }
 
-ptree ptree_from_identifier(const MessageIdentifier& id)
-{
-    ptree output;
-    output.put("origin", id.origin);
-    output.put("index", id.index);
-    return output;
-}
-
 MessageIdentifier identifier_from_ptree(const ptree& pt)
 {
     MessageIdentifier id;
@@ -1148,46 +4366,31 @@ MessageIdentifier identifier_from_ptree(const ptree& pt)
     return id;
 }
 
-ptree inbox_to_ptree(const std::pair<std::string, std::multiset<InboxMessage>>& inbox)
-{
-    ptree output;
-    output.push_back(std::make_pair(inbox.first, 
-        generate_iterable_ptree(inbox.second, ptree_from_inbox_message)));
-    return output;
-}
-
-ptree ptree_from_inbox_message(const InboxMessage& message)
-{
-    ptree output;
-    output.put("read", message.msg.read);
-    output.push_back(std::make_pair("id", ptree_from_identifier(message.id)));
-    output.put("date_sent", message.msg.date_sent);
-    output.put("to", message.msg.to);
-    output.put("from", message.msg.from);
-    output.put("subject", message.msg.subject);
-    output.put("message", message.msg.message);
-    return output;
-}
-
-InboxMessage inbox_message_from_ptree(const ptree& pt)
+/*
+    Entries from snapshots that predate shared bodies carry their own copy
+    of the body.
+*/
+StoredMail stored_mail_from_ptree(const ptree& pt,
+    std::unordered_map<MessageIdentifier, BodyPtr, IdentifierHash>& bodies)
 {
-    InboxMessage result;
+    StoredMail result;
     result.id = identifier_from_ptree(pt.get_child("id"));
-    result.msg.date_sent = pt.get<time_t>("date_sent");
-    strcpy(result.msg.from, pt.get<std::string>("from").c_str());
-    strcpy(result.msg.to, pt.get<std::string>("to").c_str());
-    strcpy(result.msg.subject, pt.get<std::string>("subject").c_str());
-    strcpy(result.msg.message, pt.get<std::string>("message").c_str());
-    result.msg.read = pt.get<bool>("read");
+    result.date_sent = pt.get<time_t>("date_sent");
+    // Snapshots written before flags existed only carry "read"
+    result.flags = pt.get<int>("flags", pt.get<bool>("read", false) ? MAIL_READ : 0);
+
+    BodyPtr& body = bodies[result.id];
+    if (!body)
+        body = body_from_ptree(pt);
+    result.body = body;
     return result;
 }
 
-void write_log_state()
+BodyPtr body_from_ptree(const ptree& pt)
 {
-    ptree state_tree;
-    state_tree.push_back(std::make_pair("safe_delivered",
-        generate_1d_ptree(state.safe_delivered, N_MACHINES)));
-    
-    write_json(log_state_file, state_tree);
+    BodyPtr body = BodyPtr::make();
+    strcpy(body->from, pt.get<std::string>("from").c_str());
+    strcpy(body->subject, pt.get<std::string>("subject").c_str());
+    strcpy(body->message, pt.get<std::string>("message").c_str());
+    return body;
 }
-
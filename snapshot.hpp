@@ -0,0 +1,506 @@
+#pragma once
+
+#include "messages.h"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC 0x50414e534c49414dULL    // "MAILSNAP"
+#define SNAPSHOT_VERSION 1
+
+/*
+    Binary snapshot layout, all integers in host byte order:
+
+        SnapshotHeader
+        sections: SectionHeader, then `count` records of `record_size` bytes
+        string table
+        SnapshotFooter
+
+    Records have a fixed layout and refer to text through StrRefs into the
+    string table, which holds each distinct string once. A reader maps the
+    file and walks records in place; nothing is parsed into a tree. The
+    manifest, each mailbox's inbox file and each body file are snapshots
+    of this form.
+*/
+
+enum SnapshotSection : uint32_t
+{
+    SECTION_PROGRESS = 1,       // ProgressRecord
+    SECTION_SAFE_DELIVERED,     // SafeDeliveredRecord
+    SECTION_PENDING_DELETE,     // RangeRecord
+    SECTION_READ_MARKS,         // RangeRecord
+    SECTION_LISTS,              // ListRecord
+    SECTION_FOLDERS,            // FolderRecord
+    SECTION_ATTACHMENTS,        // AttachmentRecord
+    SECTION_INBOX_DATA,         // InboxDataRecord, previous version only
+    SECTION_INBOX_INDEX,        // InboxIndexRecord, previous version only
+    SECTION_INBOX_READ,         // RangeRecord, read ids of indexed inboxes
+    SECTION_STATS,              // StatsRecord
+    SECTION_MAIL,               // MailRecord, in inbox files of earlier versions
+    SECTION_INBOX_DIR,          // InboxDirRecord
+    SECTION_INBOX_FILES,        // InboxFileRecord
+    SECTION_FLAG_UPDATES,       // FlagUpdateRecord
+    SECTION_MOVES,              // MoveRecord
+    SECTION_BODY,               // BodyRecord, in body files
+    SECTION_MAIL_REF,           // MailRefRecord, in inbox files
+    SECTION_INBOX_BODIES        // InboxBodiesRecord
+};
+
+struct SnapshotHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct SectionHeader
+{
+    uint32_t kind;
+    uint32_t record_size;
+    uint64_t count;
+};
+
+struct SnapshotFooter
+{
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t magic;
+};
+
+struct StrRef
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct ProgressRecord
+{
+    int32_t knowledge[N_MACHINES][N_MACHINES];
+    int32_t applied_to_state[N_MACHINES];
+};
+
+struct SafeDeliveredRecord
+{
+    int32_t safe_delivered[N_MACHINES];
+};
+
+// One inclusive id range of a user's set
+struct RangeRecord
+{
+    StrRef user;
+    int32_t origin;
+    int32_t first;
+    int32_t last;
+};
+
+struct ListRecord
+{
+    StrRef list;
+    StrRef member;
+};
+
+// An empty folder has a single record with origin -1
+struct FolderRecord
+{
+    StrRef user;
+    StrRef folder;
+    int32_t origin;
+    int32_t first;
+    int32_t last;
+};
+
+// One attachment of a message; a message has one record per attachment
+struct AttachmentRecord
+{
+    int32_t index;
+    int32_t origin;
+    int32_t copies;
+    uint32_t size;
+    unsigned char hash[BLOB_HASH_LEN];
+    StrRef name;
+};
+
+// One data file holding every inbox, as written before inbox files
+struct InboxDataRecord
+{
+    StrRef file;
+    int32_t generation;
+    int32_t reserved;
+};
+
+struct InboxIndexRecord
+{
+    StrRef user;
+    int64_t offset;
+    int64_t length;
+    int32_t total;
+    int32_t unread;
+    int64_t bytes;
+    int64_t oldest_local;
+};
+
+struct InboxDirRecord
+{
+    int64_t next_file;
+};
+
+// A mailbox's file and what the server needs from it before loading it
+struct InboxFileRecord
+{
+    StrRef user;
+    StrRef file;
+    int32_t total;
+    int32_t unread;
+    int64_t bytes;
+    int64_t oldest_local;
+};
+
+// Per-user counters, so tools need not walk every inbox
+struct StatsRecord
+{
+    StrRef user;
+    int32_t total;
+    int32_t unread;
+    int64_t bytes;
+};
+
+// A copy with its body inline, as inbox files held before body files
+struct MailRecord
+{
+    int32_t index;
+    int32_t origin;
+    int64_t date_sent;
+    uint32_t flags;
+    StrRef from;
+    StrRef subject;
+    StrRef message;
+};
+
+/*
+    A message body, stored once however many copies there are. A body file
+    holds its records sorted by id.
+*/
+struct BodyRecord
+{
+    int32_t index;
+    int32_t origin;
+    StrRef from;
+    StrRef subject;
+    StrRef message;
+};
+
+// One copy in an inbox file; its body is in the body file named
+struct MailRefRecord
+{
+    int32_t index;
+    int32_t origin;
+    int64_t date_sent;
+    uint32_t flags;
+    StrRef body_file;
+};
+
+// How many copies in a mailbox's inbox file have their body in `file`
+struct InboxBodiesRecord
+{
+    StrRef user;
+    StrRef file;
+    int32_t copies;
+    int32_t reserved;
+};
+
+// The latest change to one flag of a user's copy, see CopyUpdates
+struct FlagUpdateRecord
+{
+    StrRef user;
+    int32_t index;
+    int32_t origin;
+    int64_t timestamp;          // the change's UpdateStamp
+    int32_t stamp_origin;
+    int32_t stamp_index;
+    uint32_t flag;
+    uint32_t value;
+    uint32_t delivered;
+    uint32_t reserved;
+};
+
+// The latest move of a user's copy, see CopyUpdates
+struct MoveRecord
+{
+    StrRef user;
+    int32_t index;
+    int32_t origin;
+    int64_t timestamp;          // the move's UpdateStamp
+    int32_t stamp_origin;
+    int32_t stamp_index;
+    StrRef folder;
+    uint32_t delivered;
+    uint32_t reserved;
+};
+
+/*
+    Streams a snapshot to a file. Sections are written as their records
+    arrive; the record count is patched into the section header when the
+    section ends. Strings are collected and written once at the end.
+    Several snapshots may be written back to back into one file; offsets
+    are relative to where each starts.
+*/
+class SnapshotWriter
+{
+public:
+    explicit SnapshotWriter(FILE * out) : out(out)
+    {
+        start = ftell(out);
+        SnapshotHeader header{SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0};
+        put(&header, sizeof(header));
+    }
+
+    void begin_section(SnapshotSection kind, uint32_t record_size)
+    {
+        section = ftell(out);
+        SectionHeader header{kind, record_size, 0};
+        put(&header, sizeof(header));
+        count = 0;
+    }
+
+    template <typename T>
+    void record(const T& r)
+    {
+        put(&r, sizeof(r));
+        ++count;
+    }
+
+    void end_section()
+    {
+        long end = ftell(out);
+        fseek(out, section + offsetof(SectionHeader, count), SEEK_SET);
+        put(&count, sizeof(count));
+        fseek(out, end, SEEK_SET);
+    }
+
+    template <typename T>
+    void section_of(SnapshotSection kind, const T& r)
+    {
+        begin_section(kind, sizeof(T));
+        record(r);
+        end_section();
+    }
+
+    StrRef str(const char * s, size_t len)
+    {
+        auto it = interned.emplace(std::string(s, len), strings.size());
+        if (it.second)
+            strings.append(s, len);
+        return StrRef{static_cast<uint32_t>(it.first->second), static_cast<uint32_t>(len)};
+    }
+
+    StrRef str(const std::string& s) { return str(s.data(), s.size()); }
+
+    /*
+        Returns the size of the finished snapshot, or -1 on a write error.
+    */
+    long finish()
+    {
+        SnapshotFooter footer;
+        footer.strings_offset = ftell(out) - start;
+        footer.strings_size = strings.size();
+        footer.magic = SNAPSHOT_MAGIC;
+        put(strings.data(), strings.size());
+        put(&footer, sizeof(footer));
+        return ok ? ftell(out) - start : -1;
+    }
+
+private:
+    void put(const void * data, size_t len)
+    {
+        if (len > 0 && fwrite(data, 1, len, out) != len)
+            ok = false;
+    }
+
+    FILE * out;
+    long start;
+    long section = 0;
+    uint64_t count = 0;
+    bool ok = true;
+    std::string strings;
+    std::unordered_map<std::string, uint64_t> interned;
+};
+
+/*
+    Walks a snapshot held in memory, normally a mapped file. Records are
+    copied out one at a time, since a snapshot embedded in a larger file
+    need not be aligned.
+*/
+class SnapshotReader
+{
+public:
+    /*
+        Returns false if `data` is not a complete snapshot of this version.
+    */
+    bool open(const char * data, size_t size)
+    {
+        base = data;
+
+        SnapshotHeader header;
+        SnapshotFooter footer;
+        if (size < sizeof(header) + sizeof(footer)) return false;
+        memcpy(&header, data, sizeof(header));
+        memcpy(&footer, data + size - sizeof(footer), sizeof(footer));
+        if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION
+            || footer.magic != SNAPSHOT_MAGIC)
+            return false;
+        if (footer.strings_offset < sizeof(header)
+            || footer.strings_offset + footer.strings_size + sizeof(footer) != size)
+            return false;
+
+        strings = data + footer.strings_offset;
+        strings_size = footer.strings_size;
+        sections_end = footer.strings_offset;
+
+        // Section headers must tile the space before the string table
+        size_t pos = sizeof(header);
+        while (pos < sections_end)
+        {
+            SectionHeader section;
+            if (sections_end - pos < sizeof(section)) return false;
+            memcpy(&section, data + pos, sizeof(section));
+            pos += sizeof(section);
+            if (section.record_size == 0
+                || section.count > (sections_end - pos) / section.record_size)
+                return false;
+            pos += section.count * section.record_size;
+        }
+        return true;
+    }
+
+    /*
+        Calls `f` with every record of type T in sections of `kind`.
+        Returns false if such a section holds records of another size.
+    */
+    template <typename T, typename Func>
+    bool for_each(SnapshotSection kind, Func f) const
+    {
+        size_t pos = sizeof(SnapshotHeader);
+        while (pos < sections_end)
+        {
+            SectionHeader header;
+            memcpy(&header, base + pos, sizeof(header));
+            pos += sizeof(header);
+
+            if (header.kind == kind)
+            {
+                if (header.record_size != sizeof(T)) return false;
+                for (uint64_t i = 0; i < header.count; i++)
+                {
+                    T r;
+                    memcpy(&r, base + pos + i * sizeof(T), sizeof(T));
+                    f(r);
+                }
+            }
+            pos += header.count * header.record_size;
+        }
+        return true;
+    }
+
+    /*
+        Reads the single record of a one-record section.
+    */
+    template <typename T>
+    bool first(SnapshotSection kind, T& r) const
+    {
+        bool found = false;
+        for_each<T>(kind, [&r, &found](const T& record) {
+            if (!found) r = record;
+            found = true;
+        });
+        return found;
+    }
+
+    /*
+        Finds the record of type T in the first section of `kind`, whose
+        records are sorted, for which `compare(record)` is 0; it returns
+        less than 0 for records before the one wanted.
+    */
+    template <typename T, typename Compare>
+    bool find_sorted(SnapshotSection kind, Compare compare, T& r) const
+    {
+        size_t pos = sizeof(SnapshotHeader);
+        while (pos < sections_end)
+        {
+            SectionHeader header;
+            memcpy(&header, base + pos, sizeof(header));
+            pos += sizeof(header);
+
+            if (header.kind == kind)
+            {
+                if (header.record_size != sizeof(T)) return false;
+                uint64_t first = 0;
+                uint64_t last = header.count;
+                while (first < last)
+                {
+                    uint64_t middle = first + (last - first) / 2;
+                    memcpy(&r, base + pos + middle * sizeof(T), sizeof(T));
+                    int order = compare(r);
+                    if (order == 0) return true;
+                    if (order < 0)
+                        first = middle + 1;
+                    else
+                        last = middle;
+                }
+                return false;
+            }
+            pos += header.count * header.record_size;
+        }
+        return false;
+    }
+
+    std::string str(const StrRef& s) const
+    {
+        if (static_cast<uint64_t>(s.offset) + s.length > strings_size) return "";
+        return std::string(strings + s.offset, s.length);
+    }
+
+    /*
+        Copies a string into a fixed buffer of `size` bytes, truncating.
+    */
+    void copy(const StrRef& s, char * out, size_t size) const
+    {
+        size_t n = 0;
+        if (static_cast<uint64_t>(s.offset) + s.length <= strings_size)
+            n = std::min<size_t>(s.length, size - 1);
+        memcpy(out, strings + s.offset, n);
+        out[n] = '\0';
+    }
+
+private:
+    const char * base = nullptr;
+    const char * strings = nullptr;
+    size_t strings_size = 0;
+    size_t sections_end = 0;
+};
+
+/*
+    Writes a snapshot under a temporary name, syncs it and renames it into
+    place, so `path` always holds a complete snapshot. `write` fills in the
+    sections.
+*/
+template <typename Func>
+bool replace_snapshot(const std::string& path, Func write)
+{
+    std::string tmp = path + ".tmp";
+    FILE * out = fopen(tmp.c_str(), "wb");
+    if (out == nullptr) return false;
+
+    SnapshotWriter writer(out);
+    write(writer);
+    bool ok = writer.finish() >= 0 && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    ok = fclose(out) == 0 && ok;
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
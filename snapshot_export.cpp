@@ -0,0 +1,345 @@
+#include "sp.h"
+#include "snapshot.hpp"
+#include "blob_store.hpp"
+#include "utils.hpp"
+
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <string>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+/*
+    Offline tool: prints a server's binary snapshot as JSON.
+
+        snapshot_export <manifest_N.snap>
+        snapshot_export <inbox_state_N.snap> [<log_state_N.snap>]
+
+    The second form reads snapshots of the previous version. Inboxes are
+    read from the files the snapshot names, relative to its directory.
+*/
+
+/*
+    The child named `key`, added if missing. Keys are taken literally,
+    since user and folder names may contain the path separator.
+*/
+ptree& child_of(ptree& parent, const std::string& key)
+{
+    auto found = parent.find(key);
+    if (found != parent.not_found()) return found->second;
+    return parent.push_back(std::make_pair(key, ptree()))->second;
+}
+
+ptree ptree_from_range(int origin, int first, int last)
+{
+    ptree range;
+    range.put("origin", origin);
+    range.put("first", first);
+    range.put("last", last);
+    return range;
+}
+
+/*
+    Range records grouped under their user, in file order.
+*/
+ptree export_ranges(const SnapshotReader& snapshot, SnapshotSection kind)
+{
+    ptree users;
+    snapshot.for_each<RangeRecord>(kind, [&snapshot, &users](const RangeRecord& r) {
+        child_of(users, snapshot.str(r.user)).push_back(
+            std::make_pair("", ptree_from_range(r.origin, r.first, r.last)));
+    });
+    return users;
+}
+
+/*
+    Puts the body of `id` from the body file `file` into `mail`, or an
+    error if it cannot be found. Body files stay mapped in `files`.
+*/
+void export_body(ptree& mail, const std::filesystem::path& dir, const std::string& file,
+    int index, int origin,
+    std::map<std::string, std::pair<MappedFile, SnapshotReader>>& files)
+{
+    auto opened = files.try_emplace(file);
+    MappedFile& mapped = opened.first->second.first;
+    SnapshotReader& doc = opened.first->second.second;
+    if (opened.second && (!mapped.open((dir / file).string())
+            || !doc.open(mapped.data(), mapped.size())))
+        mapped.close();
+
+    BodyRecord r;
+    bool found = mapped.data() != nullptr && doc.find_sorted<BodyRecord>(SECTION_BODY,
+        [index, origin](const BodyRecord& r) {
+            MessageIdentifier at{r.index, r.origin};
+            MessageIdentifier id{index, origin};
+            return at < id ? -1 : id < at ? 1 : 0;
+        }, r);
+    if (!found)
+    {
+        mail.put("error", "body not found");
+        return;
+    }
+    mail.put("from", doc.str(r.from));
+    mail.put("subject", doc.str(r.subject));
+    mail.put("message", doc.str(r.message));
+}
+
+ptree export_inbox(const char * data, size_t size, const std::filesystem::path& dir)
+{
+    ptree inbox;
+    SnapshotReader doc;
+    if (!doc.open(data, size))
+    {
+        inbox.put("error", "unreadable document");
+        return inbox;
+    }
+
+    doc.for_each<MailRecord>(SECTION_MAIL, [&doc, &inbox](const MailRecord& r) {
+        ptree mail;
+        mail.put("id.origin", r.origin);
+        mail.put("id.index", r.index);
+        mail.put("date_sent", r.date_sent);
+        mail.put("flags", r.flags);
+        mail.put("from", doc.str(r.from));
+        mail.put("subject", doc.str(r.subject));
+        mail.put("message", doc.str(r.message));
+        inbox.push_back(std::make_pair("", mail));
+    });
+
+    std::map<std::string, std::pair<MappedFile, SnapshotReader>> body_files;
+    doc.for_each<MailRefRecord>(SECTION_MAIL_REF, [&](const MailRefRecord& r) {
+        std::string file = doc.str(r.body_file);
+        ptree mail;
+        mail.put("id.origin", r.origin);
+        mail.put("id.index", r.index);
+        mail.put("date_sent", r.date_sent);
+        mail.put("flags", r.flags);
+        mail.put("body_file", file);
+        export_body(mail, dir, file, r.index, r.origin, body_files);
+        inbox.push_back(std::make_pair("", mail));
+    });
+    return inbox;
+}
+
+ptree export_inbox_data(const SnapshotReader& snapshot, const std::filesystem::path& dir)
+{
+    ptree data_tree;
+    InboxDataRecord data;
+    if (!snapshot.first(SECTION_INBOX_DATA, data)) return data_tree;
+
+    std::string file = snapshot.str(data.file);
+    data_tree.put("file", file);
+    data_tree.put("generation", data.generation);
+
+    MappedFile mapped;
+    bool readable = mapped.open((dir / file).string());
+    ptree read_sets = export_ranges(snapshot, SECTION_INBOX_READ);
+    ptree index_tree;
+    ptree inboxes;
+    snapshot.for_each<InboxIndexRecord>(SECTION_INBOX_INDEX,
+        [&](const InboxIndexRecord& r) {
+            std::string user = snapshot.str(r.user);
+            ptree entry;
+            entry.put("offset", r.offset);
+            entry.put("length", r.length);
+            entry.put("total", r.total);
+            entry.put("unread", r.unread);
+            entry.put("bytes", r.bytes);
+            entry.put("oldest_local", r.oldest_local);
+            entry.push_back(std::make_pair("read", child_of(read_sets, user)));
+            index_tree.push_back(std::make_pair(user, entry));
+
+            if (readable && static_cast<size_t>(r.offset + r.length) <= mapped.size())
+            {
+                inboxes.push_back(std::make_pair(user,
+                    export_inbox(mapped.data() + r.offset, r.length, dir)));
+            }
+        });
+    data_tree.push_back(std::make_pair("index", index_tree));
+    data_tree.push_back(std::make_pair("inboxes", inboxes));
+    return data_tree;
+}
+
+ptree export_inbox_files(const SnapshotReader& snapshot, const std::filesystem::path& dir)
+{
+    ptree files_tree;
+    InboxDirRecord inbox_dir;
+    if (!snapshot.first(SECTION_INBOX_DIR, inbox_dir)) return files_tree;
+    files_tree.put("next_file", inbox_dir.next_file);
+
+    ptree read_sets = export_ranges(snapshot, SECTION_INBOX_READ);
+    ptree body_sets;
+    snapshot.for_each<InboxBodiesRecord>(SECTION_INBOX_BODIES,
+        [&snapshot, &body_sets](const InboxBodiesRecord& r) {
+            child_of(child_of(body_sets, snapshot.str(r.user)), snapshot.str(r.file))
+                .put_value(r.copies);
+        });
+    ptree index_tree;
+    ptree inboxes;
+    snapshot.for_each<InboxFileRecord>(SECTION_INBOX_FILES,
+        [&](const InboxFileRecord& r) {
+            std::string user = snapshot.str(r.user);
+            std::string file = snapshot.str(r.file);
+            ptree entry;
+            entry.put("file", file);
+            entry.put("total", r.total);
+            entry.put("unread", r.unread);
+            entry.put("bytes", r.bytes);
+            entry.put("oldest_local", r.oldest_local);
+            entry.push_back(std::make_pair("read", child_of(read_sets, user)));
+            entry.push_back(std::make_pair("bodies", child_of(body_sets, user)));
+            index_tree.push_back(std::make_pair(user, entry));
+
+            MappedFile mapped;
+            if (mapped.open((dir / file).string()))
+                inboxes.push_back(std::make_pair(user,
+                    export_inbox(mapped.data(), mapped.size(), dir)));
+        });
+    files_tree.push_back(std::make_pair("index", index_tree));
+    files_tree.push_back(std::make_pair("inboxes", inboxes));
+    return files_tree;
+}
+
+ptree export_inbox_state(const SnapshotReader& snapshot, const std::filesystem::path& dir)
+{
+    ptree state_tree;
+    ProgressRecord progress;
+    if (snapshot.first(SECTION_PROGRESS, progress))
+    {
+        state_tree.push_back(std::make_pair("knowledge",
+            generate_2d_ptree(progress.knowledge, N_MACHINES, N_MACHINES)));
+        state_tree.push_back(std::make_pair("applied_to_state",
+            generate_1d_ptree(progress.applied_to_state, N_MACHINES)));
+    }
+    SafeDeliveredRecord delivered;
+    if (snapshot.first(SECTION_SAFE_DELIVERED, delivered))
+    {
+        state_tree.push_back(std::make_pair("safe_delivered",
+            generate_1d_ptree(delivered.safe_delivered, N_MACHINES)));
+    }
+    state_tree.push_back(std::make_pair("pending_delete",
+        export_ranges(snapshot, SECTION_PENDING_DELETE)));
+    state_tree.push_back(std::make_pair("read_marks",
+        export_ranges(snapshot, SECTION_READ_MARKS)));
+    ptree inbox_files = export_inbox_files(snapshot, dir);
+    if (!inbox_files.empty())
+        state_tree.push_back(std::make_pair("inbox_files", inbox_files));
+    ptree inbox_data = export_inbox_data(snapshot, dir);
+    if (!inbox_data.empty())
+        state_tree.push_back(std::make_pair("inbox_data", inbox_data));
+
+    ptree stats_tree;
+    snapshot.for_each<StatsRecord>(SECTION_STATS, [&snapshot, &stats_tree](const StatsRecord& r) {
+        ptree stats;
+        stats.put("total", r.total);
+        stats.put("unread", r.unread);
+        stats.put("bytes", r.bytes);
+        stats_tree.push_back(std::make_pair(snapshot.str(r.user), stats));
+    });
+    state_tree.push_back(std::make_pair("stats", stats_tree));
+
+    ptree list_tree;
+    snapshot.for_each<ListRecord>(SECTION_LISTS, [&snapshot, &list_tree](const ListRecord& r) {
+        ptree member;
+        member.put("", snapshot.str(r.member));
+        child_of(list_tree, snapshot.str(r.list)).push_back(std::make_pair("", member));
+    });
+    state_tree.push_back(std::make_pair("lists", list_tree));
+
+    ptree folder_tree;
+    snapshot.for_each<FolderRecord>(SECTION_FOLDERS, [&snapshot, &folder_tree](const FolderRecord& r) {
+        ptree& ranges = child_of(child_of(folder_tree, snapshot.str(r.user)),
+            snapshot.str(r.folder));
+        if (r.origin >= 0)
+            ranges.push_back(std::make_pair("", ptree_from_range(r.origin, r.first, r.last)));
+    });
+    state_tree.push_back(std::make_pair("folders", folder_tree));
+
+    ptree attachment_tree;
+    snapshot.for_each<AttachmentRecord>(SECTION_ATTACHMENTS,
+        [&snapshot, &attachment_tree](const AttachmentRecord& r) {
+            BlobHash hash;
+            memcpy(hash.bytes, r.hash, BLOB_HASH_LEN);
+            ptree file;
+            file.put("origin", r.origin);
+            file.put("index", r.index);
+            file.put("copies", r.copies);
+            file.put("hash", hex_from_hash(hash));
+            file.put("size", r.size);
+            file.put("name", snapshot.str(r.name));
+            attachment_tree.push_back(std::make_pair("", file));
+        });
+    state_tree.push_back(std::make_pair("attachments", attachment_tree));
+
+    ptree update_tree;
+    snapshot.for_each<FlagUpdateRecord>(SECTION_FLAG_UPDATES,
+        [&snapshot, &update_tree](const FlagUpdateRecord& r) {
+            ptree update;
+            update.put("origin", r.origin);
+            update.put("index", r.index);
+            update.put("flag", r.flag);
+            update.put("value", r.value);
+            update.put("timestamp", r.timestamp);
+            update.put("stamp_origin", r.stamp_origin);
+            update.put("stamp_index", r.stamp_index);
+            update.put("delivered", r.delivered);
+            child_of(update_tree, snapshot.str(r.user)).push_back(std::make_pair("", update));
+        });
+    state_tree.push_back(std::make_pair("flag_updates", update_tree));
+
+    ptree move_tree;
+    snapshot.for_each<MoveRecord>(SECTION_MOVES, [&snapshot, &move_tree](const MoveRecord& r) {
+        ptree move;
+        move.put("origin", r.origin);
+        move.put("index", r.index);
+        move.put("folder", snapshot.str(r.folder));
+        move.put("timestamp", r.timestamp);
+        move.put("stamp_origin", r.stamp_origin);
+        move.put("stamp_index", r.stamp_index);
+        move.put("delivered", r.delivered);
+        child_of(move_tree, snapshot.str(r.user)).push_back(std::make_pair("", move));
+    });
+    state_tree.push_back(std::make_pair("moves", move_tree));
+    return state_tree;
+}
+
+bool open_snapshot(const char * path, MappedFile& file, SnapshotReader& snapshot)
+{
+    if (file.open(path) && snapshot.open(file.data(), file.size()))
+        return true;
+    std::cerr << path << " is not a readable snapshot" << std::endl;
+    return false;
+}
+
+int main(int argc, char * argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        std::cerr << "Usage: " << argv[0]
+            << " <manifest_N.snap | inbox_state_N.snap [log_state_N.snap]>" << std::endl;
+        return 1;
+    }
+
+    MappedFile file;
+    SnapshotReader snapshot;
+    if (!open_snapshot(argv[1], file, snapshot)) return 1;
+    ptree output = export_inbox_state(snapshot,
+        std::filesystem::path(argv[1]).parent_path());
+
+    if (argc == 3)
+    {
+        MappedFile log_file;
+        SnapshotReader log_snapshot;
+        SafeDeliveredRecord progress;
+        if (!open_snapshot(argv[2], log_file, log_snapshot)) return 1;
+        if (log_snapshot.first(SECTION_SAFE_DELIVERED, progress))
+        {
+            output.push_back(std::make_pair("safe_delivered",
+                generate_1d_ptree(progress.safe_delivered, N_MACHINES)));
+        }
+    }
+
+    write_json(std::cout, output);
+    return 0;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <ctime>
+#include <utility>
+#include <vector>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+/*
+    Hierarchical timer wheel with one second resolution. Level l holds
+    timers due within 2^(WHEEL_BITS * (l + 1)) seconds, so four levels of 64
+    slots cover about 194 days; later timers wait in an overflow list.
+    Timers move down a level when their slot comes around, so each second
+    of advance costs O(1) plus the number of timers that fire or cascade,
+    independent of how many are pending.
+
+    Timers cannot be cancelled; callers check whether a fired item is still
+    relevant.
+*/
+template <typename T>
+class TimerWheel
+{
+public:
+    explicit TimerWheel(time_t now = 0) : current(now) {}
+
+    void reset(time_t now)
+    {
+        for (auto& level : slots)
+            for (auto& slot : level)
+                slot.clear();
+        overflow.clear();
+        pending = 0;
+        current = now;
+    }
+
+    void schedule(time_t when, const T& item)
+    {
+        // Anything already due fires on the next tick
+        if (when <= current)
+            when = current + 1;
+        ++pending;
+        place(Entry{when, item});
+    }
+
+    /*
+        Moves time forward to `now`, calling `expired` with every item whose
+        deadline has passed.
+    */
+    template <typename Func>
+    void advance(time_t now, Func expired)
+    {
+        while (current < now)
+        {
+            ++current;
+            cascade();
+
+            std::vector<Entry> due;
+            due.swap(slots[0][current & WHEEL_MASK]);
+            for (auto& entry : due)
+            {
+                if (entry.when > current)
+                {
+                    place(std::move(entry));
+                    continue;
+                }
+                --pending;
+                expired(entry.item);
+            }
+        }
+    }
+
+    size_t size() const { return pending; }
+    time_t now() const { return current; }
+
+private:
+    struct Entry
+    {
+        time_t when;
+        T item;
+    };
+
+    void place(Entry entry)
+    {
+        time_t delta = entry.when - current;
+        for (int level = 0; level < WHEEL_LEVELS; level++)
+        {
+            if (delta < (time_t(1) << (WHEEL_BITS * (level + 1))))
+            {
+                int slot = (entry.when >> (WHEEL_BITS * level)) & WHEEL_MASK;
+                slots[level][slot].push_back(std::move(entry));
+                return;
+            }
+        }
+        overflow.push_back(std::move(entry));
+    }
+
+    /*
+        When the lower bits of the clock wrap, the matching slot of the next
+        level holds timers due within the coming lower-level period; push
+        them down.
+    */
+    void cascade()
+    {
+        for (int level = 1; level < WHEEL_LEVELS; level++)
+        {
+            time_t span = time_t(1) << (WHEEL_BITS * level);
+            if (current % span != 0) return;
+
+            int slot = (current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            std::vector<Entry> moving;
+            moving.swap(slots[level][slot]);
+            for (auto& entry : moving)
+                place(std::move(entry));
+        }
+
+        // Every top level step, pull in overflow timers that are now in range
+        std::vector<Entry> moving;
+        moving.swap(overflow);
+        for (auto& entry : moving)
+            place(std::move(entry));
+    }
+
+    std::vector<Entry> slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    std::vector<Entry> overflow;
+    size_t pending = 0;
+    time_t current;
+};